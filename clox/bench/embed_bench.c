@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/vm.h"
+
+#define REQUEST_COUNT 100000
+
+// A request handler with a little setup around it, as an embedder would
+// load it.
+static const char *handler_source =
+  "class Response {\n"
+  "  init(status, size) {\n"
+  "    this.status = status;\n"
+  "    this.size = size;\n"
+  "  }\n"
+  "}\n"
+  "\n"
+  "var routes = {\"/\": 1, \"/items\": 2, \"/users\": 3};\n"
+  "\n"
+  "fun handle(request) {\n"
+  "  var size = 0;\n"
+  "  for (var i = 0; i < 8; i = i + 1)\n"
+  "    size = size + request * i;\n"
+  "  var response = Response(200, size);\n"
+  "  return response.size + routes[\"/items\"];\n"
+  "}\n";
+
+static double
+seconds_since(clock_t start)
+{
+  return (double) (clock() - start) / CLOCKS_PER_SEC;
+}
+
+static double
+handle(VM *vm, int handler, int request)
+{
+  Value args[1] = { NUMBER_VAL(request) };
+  Value result;
+  if (vm_call(vm, handler, args, 1, &result) != INTERPRET_OK)
+    exit(1);
+  return AS_NUMBER(result);
+}
+
+// Compiles and runs the script again for every request, as vm_interpret
+// would have to.
+static double
+bench_recompile(VM *vm)
+{
+  double sum = 0;
+  for (int i = 0; i < REQUEST_COUNT; ++i) {
+    int script = vm_compile(vm, handler_source, strlen(handler_source));
+    if (script == -1 || vm_run(vm, script) != INTERPRET_OK)
+      exit(1);
+    int handler = vm_find_global(vm, "handle");
+    sum += handle(vm, handler, i);
+    vm_release(vm, handler);
+    vm_release(vm, script);
+  }
+  return sum;
+}
+
+static double
+bench_reuse(VM *vm)
+{
+  double sum = 0;
+  int script = vm_compile(vm, handler_source, strlen(handler_source));
+  if (script == -1 || vm_run(vm, script) != INTERPRET_OK)
+    exit(1);
+  int handler = vm_find_global(vm, "handle");
+  for (int i = 0; i < REQUEST_COUNT; ++i)
+    sum += handle(vm, handler, i);
+  vm_release(vm, handler);
+  vm_release(vm, script);
+  return sum;
+}
+
+int
+main()
+{
+  VM *vm = malloc(sizeof(VM));
+  if (vm == NULL)
+    return 1;
+  vm_init(vm);
+  clock_t start = clock();
+  double recompiled = bench_recompile(vm);
+  double elapsed = seconds_since(start);
+  printf("%-10s %8.2f us/request\n", "recompile",
+      elapsed / REQUEST_COUNT * 1e6);
+  start = clock();
+  double reused = bench_reuse(vm);
+  elapsed = seconds_since(start);
+  printf("%-10s %8.2f us/request\n", "reuse", elapsed / REQUEST_COUNT * 1e6);
+  vm_free(vm);
+  free(vm);
+  if (recompiled != reused) {
+    fprintf(stderr, "Results differ: %g and %g.\n", recompiled, reused);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../src/floats.h"
+
+// Compares the dispatched bulk operations against plain sequential loops, for
+// a buffer that fits in the cache and one that does not.
+static double sink;
+
+static double
+seconds_since(clock_t start)
+{
+  return (double) (clock() - start) / CLOCKS_PER_SEC;
+}
+
+static double
+loop_sum(const double *src, int count)
+{
+  double result = 0;
+  for (int i = 0; i < count; ++i)
+    result += src[i];
+  return result;
+}
+
+static double
+loop_dot(const double *a, const double *b, int count)
+{
+  double result = 0;
+  for (int i = 0; i < count; ++i)
+    result += a[i] * b[i];
+  return result;
+}
+
+static double
+loop_min(const double *src, int count)
+{
+  double result = src[0];
+  for (int i = 1; i < count; ++i)
+    result = src[i] < result ? src[i] : result;
+  return result;
+}
+
+static void
+loop_prefix_sum(double *dest, int count)
+{
+  for (int i = 1; i < count; ++i)
+    dest[i] += dest[i - 1];
+}
+
+static void
+report(const char *name, int count, int rounds, int buffers, clock_t start)
+{
+  double elapsed = seconds_since(start);
+  printf("%-16s %9d %8.2f GB/s\n", name, count,
+      (double) count * rounds * buffers * sizeof(double) / elapsed / 1e9);
+}
+
+static void
+bench(int count, int rounds)
+{
+  double *a = malloc(sizeof(double) * count);
+  double *b = malloc(sizeof(double) * count);
+  for (int i = 0; i < count; ++i) {
+    a[i] = (double) (rand() % 1000);
+    b[i] = (double) (rand() % 1000);
+  }
+  clock_t start = clock();
+  for (int r = 0; r < rounds; ++r)
+    sink += loop_sum(a, count);
+  report("loop sum", count, rounds, 1, start);
+  start = clock();
+  for (int r = 0; r < rounds; ++r)
+    sink += floats_sum(a, count);
+  report("floats_sum", count, rounds, 1, start);
+  start = clock();
+  for (int r = 0; r < rounds; ++r)
+    sink += loop_dot(a, b, count);
+  report("loop dot", count, rounds, 2, start);
+  start = clock();
+  for (int r = 0; r < rounds; ++r)
+    sink += floats_dot(a, b, count);
+  report("floats_dot", count, rounds, 2, start);
+  start = clock();
+  for (int r = 0; r < rounds; ++r)
+    sink += loop_min(a, count);
+  report("loop min", count, rounds, 1, start);
+  start = clock();
+  for (int r = 0; r < rounds; ++r)
+    sink += floats_min(a, count);
+  report("floats_min", count, rounds, 1, start);
+  // Repeated prefix sums would overflow, so they run over zeros.
+  floats_fill(b, count, 0);
+  start = clock();
+  for (int r = 0; r < rounds; ++r) {
+    loop_prefix_sum(b, count);
+    sink += b[count - 1];
+  }
+  report("loop prefix", count, rounds, 1, start);
+  start = clock();
+  for (int r = 0; r < rounds; ++r) {
+    floats_prefix_sum(b, count);
+    sink += b[count - 1];
+  }
+  report("floats_prefix", count, rounds, 1, start);
+  start = clock();
+  for (int r = 0; r < rounds; ++r)
+    floats_add(a, b, count);
+  report("floats_add", count, rounds, 2, start);
+  free(a);
+  free(b);
+}
+
+int
+main()
+{
+  floats_init();
+  bench(4096, 100000);
+  bench(16 * 1024 * 1024, 20);
+  printf("(%g)\n", sink);
+  return 0;
+}
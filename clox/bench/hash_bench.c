@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/object.h"
+#include "../src/table.h"
+#include "../src/vm.h"
+
+#define IDENTIFIER_COUNT 100000
+#define IDENTIFIER_MAX 24
+#define INSTANCE_COUNT 10000
+
+typedef uint32_t (*HashFn) (const char *key, int length);
+
+// The byte-at-a-time FNV-1a hash the VM used before, kept for comparison.
+static uint32_t
+hash_fnv1a(const char *key, int length)
+{
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; ++i) {
+    hash ^= (uint8_t) key[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+static const struct {
+  const char *name;
+  HashFn hash;
+} hashes[] = {
+  { "fnv1a", hash_fnv1a },
+  { "hash_string", hash_string },
+};
+
+#define HASH_COUNT (int) (sizeof(hashes) / sizeof(hashes[0]))
+
+static uint64_t random_state = 0x853c49e6748fea9bu;
+
+static uint32_t
+random_next()
+{
+  random_state = random_state * 6364136223846793005u + 1442695040888963407u;
+  return (uint32_t) (random_state >> 33);
+}
+
+static char identifiers[IDENTIFIER_COUNT][IDENTIFIER_MAX + 1];
+static int identifier_lengths[IDENTIFIER_COUNT];
+
+// Distinct identifier-like keys: a short lowercase word followed by a numeric
+// or alphabetic suffix, which is where weak hashes tend to cluster.
+static void
+make_identifiers()
+{
+  static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz_";
+  for (int i = 0; i < IDENTIFIER_COUNT; ++i) {
+    int length = 1 + random_next() % 10;
+    for (int j = 0; j < length; ++j)
+      identifiers[i][j] = alphabet[random_next() % (sizeof(alphabet) - 1)];
+    identifiers[i][length++] = '_';
+    if (random_next() % 2 == 0)
+      length += snprintf(identifiers[i] + length, IDENTIFIER_MAX + 1 - length,
+          "%d", i);
+    else {
+      for (int n = i; n > 0; n /= 26)
+        identifiers[i][length++] = alphabet[n % 26];
+      identifiers[i][length] = '\0';
+    }
+    identifier_lengths[i] = length;
+  }
+}
+
+static double
+seconds_since(clock_t start)
+{
+  return (double) (clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void
+bench_identifiers(HashFn hash, const char *name)
+{
+  uint32_t sink = 0;
+  size_t bytes = 0;
+  clock_t start = clock();
+  for (int round = 0; round < 50; ++round) {
+    for (int i = 0; i < IDENTIFIER_COUNT; ++i) {
+      sink += hash(identifiers[i], identifier_lengths[i]);
+      bytes += identifier_lengths[i];
+    }
+  }
+  double elapsed = seconds_since(start);
+  printf("%-12s identifiers  %8.1f Mkeys/s %8.1f MB/s (%08x)\n", name,
+      50.0 * IDENTIFIER_COUNT / elapsed / 1e6, bytes / elapsed / 1e6, sink);
+}
+
+static void
+bench_long(HashFn hash, const char *name, const char *buffer, int length)
+{
+  uint32_t sink = 0;
+  size_t bytes = 0;
+  clock_t start = clock();
+  while (bytes < 512u * 1024 * 1024) {
+    sink += hash(buffer, length);
+    bytes += length;
+  }
+  double elapsed = seconds_since(start);
+  printf("%-12s %6d bytes %8.1f MB/s (%08x)\n", name, length,
+      bytes / elapsed / 1e6, sink);
+}
+
+// Simulates inserting the identifiers into a linear probing table at a load
+// factor of 0.75 and reports the probe lengths.
+static void
+bench_probing(HashFn hash, const char *name)
+{
+  int capacity = 1;
+  while (capacity * 3 < IDENTIFIER_COUNT * 4)
+    capacity *= 2;
+  char *used = calloc(capacity, 1);
+  long total = 0;
+  int longest = 0;
+  for (int i = 0; i < IDENTIFIER_COUNT; ++i) {
+    uint32_t index = hash(identifiers[i], identifier_lengths[i])
+      & (capacity - 1);
+    int probes = 0;
+    while (used[index]) {
+      index = (index + 1) & (capacity - 1);
+      probes++;
+    }
+    used[index] = 1;
+    total += probes;
+    if (probes > longest)
+      longest = probes;
+  }
+  free(used);
+  printf("%-12s probing      %8.3f avg %6d max\n", name,
+      (double) total / IDENTIFIER_COUNT, longest);
+}
+
+// Counts the groups probed past the key's home group to reach its slot.
+static void
+table_probes(Table *table, long *total, int *longest)
+{
+  int group_mask = (table->capacity - 1) / TABLE_GROUP_WIDTH;
+  for (int i = 0; i < table->capacity; ++i) {
+    if (!TABLE_IS_FULL(table, i))
+      continue;
+    int group = ((table->keys[i]->hash >> 7) & (table->capacity - 1))
+      / TABLE_GROUP_WIDTH;
+    int probes = 0;
+    while (group != i / TABLE_GROUP_WIDTH)
+      group = (group + ++probes) & group_mask;
+    *total += probes;
+    if (probes > *longest)
+      *longest = probes;
+  }
+}
+
+// Measures the probe lengths of the real tables: the intern table after
+// interning every identifier, and instance-sized field tables keyed by
+// typical field names. Field tables small enough to be scanned linearly are
+// only counted.
+static void
+bench_tables()
+{
+  VM *vm = malloc(sizeof(VM));
+  if (vm == NULL)
+    exit(1);
+  vm_init(vm);
+  vm->next_gc = (size_t) -1;
+  for (int i = 0; i < IDENTIFIER_COUNT; ++i)
+    copy_string(vm, identifiers[i], identifier_lengths[i]);
+  long total = 0;
+  int longest = 0;
+  table_probes(&vm->strings, &total, &longest);
+  printf("vm.strings   %d keys %d slots %8.3f avg %6d max groups\n",
+      vm->strings.count, vm->strings.capacity,
+      (double) total / vm->strings.count, longest);
+
+  static const char *fields[] = {
+    "x", "y", "z", "w", "name", "value", "next", "prev", "left", "right",
+    "parent", "children", "count", "size", "data", "id", "key", "type",
+  };
+  int field_count = (int) (sizeof(fields) / sizeof(fields[0]));
+  ObjString *names[sizeof(fields) / sizeof(fields[0])];
+  for (int i = 0; i < field_count; ++i)
+    names[i] = copy_string(vm, fields[i], (int) strlen(fields[i]));
+  total = 0;
+  longest = 0;
+  long keys = 0;
+  int small = 0;
+  for (int i = 0; i < INSTANCE_COUNT; ++i) {
+    Table table;
+    table_init(&table);
+    int count = 2 + random_next() % (field_count - 1);
+    int first = random_next() % field_count;
+    for (int j = 0; j < count; ++j)
+      table_set(vm, &table, names[(first + j) % field_count], NIL_VAL);
+    if (TABLE_IS_SMALL(&table))
+      small++;
+    else {
+      table_probes(&table, &total, &longest);
+      keys += table.count;
+    }
+    table_free(vm, &table);
+  }
+  printf("instances    %d small, %ld hashed keys %8.3f avg %6d max groups\n",
+      small, keys, keys > 0 ? (double) total / keys : 0.0, longest);
+  vm_free(vm);
+  free(vm);
+}
+
+int
+main()
+{
+  make_identifiers();
+  static const int long_lengths[] = { 64, 1024, 65536 };
+  char *buffer = malloc(65536);
+  for (int i = 0; i < 65536; ++i)
+    buffer[i] = (char) (' ' + random_next() % 95);
+  for (int i = 0; i < HASH_COUNT; ++i) {
+    bench_identifiers(hashes[i].hash, hashes[i].name);
+    for (int j = 0; j < 3; ++j)
+      bench_long(hashes[i].hash, hashes[i].name, buffer, long_lengths[j]);
+    bench_probing(hashes[i].hash, hashes[i].name);
+  }
+  free(buffer);
+  bench_tables();
+  return 0;
+}
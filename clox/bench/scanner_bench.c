@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/scanner.h"
+
+#define SOURCE_SIZE (8 * 1024 * 1024)
+
+// Two workloads: ordinary code with short runs of blanks, and code dominated
+// by deep indentation, long comments and long string literals.
+static const char *code_snippets[] = {
+  "class Vector%d < Base {\n"
+  "  init(x, y) {\n"
+  "    this.x = x;\n"
+  "    this.y = y;\n"
+  "  }\n"
+  "\n"
+  "  // Returns the sum of both components.\n"
+  "  sum() {\n"
+  "    return this.x + this.y;\n"
+  "  }\n"
+  "}\n\n",
+  "fun compute%d(values, limit) {\n"
+  "  var total = 0;\n"
+  "  for (var i = 0; i < limit; i = i + 1) {\n"
+  "    if (values[i] >= 10.5 and !(values[i] == nil)) {\n"
+  "      total = total + values[i] * 2;\n"
+  "    } else {\n"
+  "      print \"skipping value at index\";\n"
+  "    }\n"
+  "  }\n"
+  "  return total;\n"
+  "}\n\n",
+  "var table%d = {\"alpha\": 1, \"beta\": 2, \"gamma\": [3, 4, 5]};\n"
+  "while (len(table) > 0 or false) {\n"
+  "  delete(table, \"alpha\");\n"
+  "}\n\n",
+  NULL,
+};
+
+static const char *prose_snippets[] = {
+  "// Formats report number %d. The report is assembled from several long\n"
+  "// sections, each of which is described in the comment that precedes it,\n"
+  "// and the sections are joined with blank lines in between them.\n"
+  "fun report(sections) {\n"
+  "                var header = \"This is the header of the generated report, "
+  "which spans a fair number of characters before it ends.\";\n"
+  "                var footer = \"This is the footer of the generated report, "
+  "which also spans a fair number of characters.\";\n"
+  "                return header + sections + footer;\n"
+  "}\n\n",
+  NULL,
+};
+
+static double
+seconds_since(clock_t start)
+{
+  return (double) (clock() - start) / CLOCKS_PER_SEC;
+}
+
+static char *
+generate(const char **snippets, size_t *length)
+{
+  char *source = malloc(SOURCE_SIZE + 1024);
+  *length = 0;
+  for (int i = 0, j = 0; *length < SOURCE_SIZE; ++i, ++j) {
+    if (snippets[j] == NULL)
+      j = 0;
+    *length += sprintf(source + *length, snippets[j], i);
+  }
+  return source;
+}
+
+// Reports the best of several rounds, which filters out noise from the rest
+// of the machine.
+static void
+bench(const char *name, const char **snippets)
+{
+  size_t length;
+  char *source = generate(snippets, &length);
+  long tokens = 0;
+  double best = 0;
+  Scanner scanner;
+  for (int round = 0; round < 20; ++round) {
+    clock_t start = clock();
+    scanner_init(&scanner, source, length, 1);
+    tokens = 0;
+    for (;;) {
+      Token token = scanner_scan_token(&scanner);
+      tokens++;
+      if (token.type == TOKEN_EOF)
+        break;
+      if (token.type == TOKEN_ERROR) {
+        fprintf(stderr, "%.*s\n", token.length, token.start);
+        exit(1);
+      }
+    }
+    double elapsed = seconds_since(start);
+    if (round == 0 || elapsed < best)
+      best = elapsed;
+  }
+  printf("%-6s %zu bytes %8.1f MB/s %8.1f Mtokens/s\n", name, length,
+      length / best / 1e6, tokens / best / 1e6);
+  free(source);
+}
+
+int
+main()
+{
+  bench("code", code_snippets);
+  bench("prose", prose_snippets);
+  return 0;
+}
@@ -0,0 +1,126 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/floats.h"
+#include "../src/vm.h"
+
+#define THREADS_MAX 8
+#define REQUEST_COUNT 20000
+
+// A handler that allocates strings, instances and maps, so that every VM
+// collects garbage while the others run.
+static const char *handler_source =
+  "class Entry {\n"
+  "  init(key, count) {\n"
+  "    this.key = key;\n"
+  "    this.count = count;\n"
+  "  }\n"
+  "}\n"
+  "\n"
+  "var seen = {};\n"
+  "var next = 0;\n"
+  "\n"
+  "fun handle(request) {\n"
+  "  var key = \"user\" + substring(\"0123456789\", next, next + 1);\n"
+  "  next = next + 1;\n"
+  "  if (next == 10) next = 0;\n"
+  "  var entry = seen[key];\n"
+  "  if (entry == nil) {\n"
+  "    entry = Entry(key, 0);\n"
+  "    seen[key] = entry;\n"
+  "  }\n"
+  "  entry.count = entry.count + 1;\n"
+  "  var words = split(\"a b c d e f g h\", \" \");\n"
+  "  return entry.count + len(words) + len(key);\n"
+  "}\n";
+
+typedef struct {
+  pthread_t thread;
+  double sum;
+  bool failed;
+} Worker;
+
+static double
+seconds_now()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Each worker owns a VM and shares nothing with the others.
+static void *
+work(void *argument)
+{
+  Worker *worker = argument;
+  worker->failed = true;
+  VM *vm = malloc(sizeof(VM));
+  if (vm == NULL)
+    return NULL;
+  vm_init(vm);
+  int script = vm_compile(vm, handler_source, strlen(handler_source));
+  if (script != -1 && vm_run(vm, script) == INTERPRET_OK) {
+    int handler = vm_find_global(vm, "handle");
+    worker->sum = 0;
+    worker->failed = false;
+    for (int i = 0; i < REQUEST_COUNT && !worker->failed; ++i) {
+      Value args[1] = { NUMBER_VAL(i) };
+      Value result;
+      if (vm_call(vm, handler, args, 1, &result) != INTERPRET_OK)
+        worker->failed = true;
+      else
+        worker->sum += AS_NUMBER(result);
+    }
+  }
+  vm_free(vm);
+  free(vm);
+  return NULL;
+}
+
+// Runs the same requests on each of the threads. With independent VMs the
+// requests per second grow with the threads, up to the number of cores.
+static bool
+bench(int thread_count, double *expected)
+{
+  Worker workers[THREADS_MAX];
+  double start = seconds_now();
+  for (int i = 0; i < thread_count; ++i) {
+    if (pthread_create(&workers[i].thread, NULL, work, &workers[i]) != 0)
+      return false;
+  }
+  for (int i = 0; i < thread_count; ++i)
+    pthread_join(workers[i].thread, NULL);
+  double elapsed = seconds_now() - start;
+  for (int i = 0; i < thread_count; ++i) {
+    if (workers[i].failed)
+      return false;
+    if (*expected == 0)
+      *expected = workers[i].sum;
+    else if (workers[i].sum != *expected) {
+      fprintf(stderr, "Results differ: %g and %g.\n", workers[i].sum,
+          *expected);
+      return false;
+    }
+  }
+  printf("%d threads %8.2f us/request %8.0f requests/s\n", thread_count,
+      elapsed / REQUEST_COUNT * 1e6,
+      thread_count * REQUEST_COUNT / elapsed);
+  return true;
+}
+
+int
+main()
+{
+  floats_init();
+  double expected = 0;
+  for (int threads = 1; threads <= THREADS_MAX; threads *= 2) {
+    if (!bench(threads, &expected))
+      return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,199 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "heap.h"
+#include "memory.h"
+#include "vm.h"
+
+// The functions to pack, in the order their code is laid out. The list is
+// allocated outside the collector's accounting, so that building it never
+// triggers a collection.
+typedef struct {
+  ObjFunction **functions;
+  int count;
+  int capacity;
+} FunctionList;
+
+static void
+list_add(FunctionList *list, ObjFunction *function)
+{
+  if (list->capacity < list->count + 1) {
+    list->capacity = GROW_CAPACITY(list->capacity);
+    list->functions = realloc(list->functions,
+        sizeof(ObjFunction *) * list->capacity);
+    if (list->functions == NULL)
+      exit(1);
+  }
+  list->functions[list->count++] = function;
+}
+
+static size_t
+page_size()
+{
+  long size = sysconf(_SC_PAGESIZE);
+  return size > 0 ? (size_t) size : 4096;
+}
+
+static CodeArena *
+arena_new(VM *vm, size_t size)
+{
+  size_t page = page_size();
+  CodeArena *arena = malloc(sizeof(CodeArena));
+  void *code;
+  if (arena == NULL
+      || posix_memalign(&code, page, (size + page - 1) / page * page) != 0)
+    exit(1);
+  arena->users = 0;
+  arena->hot_count = 0;
+  arena->next_layout = 1;
+  arena->size = (size + page - 1) / page * page;
+  arena->code = code;
+  vm->bytes_allocated += arena->size;
+  return arena;
+}
+
+void
+arena_release(VM *vm, CodeArena *arena)
+{
+  if (--arena->users > 0)
+    return;
+  mprotect(arena->code, arena->size, PROT_READ | PROT_WRITE);
+  vm->bytes_allocated -= arena->size;
+  free(arena->code);
+  free(arena);
+}
+
+// Moves the code of the functions into a new arena in the order of the list
+// and returns the arena. The code they leave behind is freed, which frees an
+// old arena once all of its users have moved.
+static CodeArena *
+pack(VM *vm, FunctionList *list)
+{
+  size_t size = 0;
+  for (int i = 0; i < list->count; ++i)
+    size += list->functions[i]->chunk.count;
+  if (size == 0)
+    return NULL;
+  CodeArena *arena = arena_new(vm, size);
+  size_t offset = 0;
+  for (int i = 0; i < list->count; ++i) {
+    Chunk *chunk = &list->functions[i]->chunk;
+    memcpy(arena->code + offset, chunk->code, chunk->count);
+    if (chunk->arena != NULL)
+      arena_release(vm, chunk->arena);
+    else
+      FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+    chunk->code = arena->code + offset;
+    chunk->capacity = chunk->count;
+    chunk->arena = arena;
+    arena->users++;
+    offset += chunk->count;
+  }
+  // Failing to protect the code only loses the protection.
+  mprotect(arena->code, arena->size, PROT_READ);
+  return arena;
+}
+
+static void
+collect(FunctionList *list, ObjFunction *function)
+{
+  ValueArray *constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; ++i) {
+    if (IS_FUNCTION(constants->values[i]))
+      collect(list, AS_FUNCTION(constants->values[i]));
+  }
+  if (function->lazy == NULL)
+    list_add(list, function);
+}
+
+void
+arena_pack_script(VM *vm, ObjFunction *script)
+{
+  FunctionList list = { NULL, 0, 0 };
+  collect(&list, script);
+  pack(vm, &list);
+  free(list.functions);
+}
+
+void
+arena_pack_objects(VM *vm, ValueArray *objects)
+{
+  FunctionList list = { NULL, 0, 0 };
+  for (int i = 0; i < objects->count; ++i) {
+    if (IS_FUNCTION(objects->values[i])
+        && AS_FUNCTION(objects->values[i])->lazy == NULL)
+      list_add(&list, AS_FUNCTION(objects->values[i]));
+  }
+  pack(vm, &list);
+  free(list.functions);
+}
+
+// The arena does not know its users, so they are found by walking the heap.
+// Functions that died since the last collection are found as well, which is
+// harmless.
+typedef struct {
+  CodeArena *arena;
+  FunctionList functions;
+} Heated;
+
+static void
+find_heated(Obj *object, void *context)
+{
+  Heated *heated = context;
+  if (object->type == OBJ_FUNCTION
+      && ((ObjFunction *) object)->chunk.arena == heated->arena)
+    list_add(&heated->functions, (ObjFunction *) object);
+}
+
+// Hot functions come first, the hottest first, and the others keep their
+// order.
+static int
+compare_heat(const void *a, const void *b)
+{
+  const ObjFunction *left = *(ObjFunction *const *) a;
+  const ObjFunction *right = *(ObjFunction *const *) b;
+  bool left_hot = left->calls >= ARENA_HOT_CALLS;
+  bool right_hot = right->calls >= ARENA_HOT_CALLS;
+  if (left_hot != right_hot)
+    return left_hot ? -1 : 1;
+  if (left_hot && left->calls != right->calls)
+    return left->calls > right->calls ? -1 : 1;
+  if (left->chunk.code != right->chunk.code)
+    return left->chunk.code < right->chunk.code ? -1 : 1;
+  return 0;
+}
+
+void
+arena_heat(VM *vm, ObjFunction *function)
+{
+  CodeArena *arena = function->chunk.arena;
+  if (arena == NULL || ++arena->hot_count < arena->next_layout)
+    return;
+  int hot_count = arena->hot_count;
+  int next_layout = arena->next_layout * 2;
+  Heated heated = { arena, { NULL, 0, 0 } };
+  heap_visit(&vm->heap, find_heated, &heated);
+  qsort(heated.functions.functions, heated.functions.count,
+      sizeof(ObjFunction *), compare_heat);
+  // The frames running code from the arena carry on at the same offsets.
+  int offsets[FRAMES_MAX];
+  for (int i = 0; i < vm->frame_count; ++i) {
+    Chunk *chunk = &vm->frames[i].closure->function->chunk;
+    offsets[i] = chunk->arena == arena
+      ? (int) (vm->frames[i].ip - chunk->code) : -1;
+  }
+  arena = pack(vm, &heated.functions);
+  free(heated.functions.functions);
+  arena->hot_count = hot_count;
+  arena->next_layout = next_layout;
+  for (int i = 0; i < vm->frame_count; ++i) {
+    if (offsets[i] != -1)
+      vm->frames[i].ip = vm->frames[i].closure->function->chunk.code
+        + offsets[i];
+  }
+}
@@ -0,0 +1,40 @@
+#ifndef CLOX_ARENA_H
+#define CLOX_ARENA_H
+
+#include "common.h"
+#include "object.h"
+
+// Functions called this often are hot and laid out together.
+#define ARENA_HOT_CALLS 1000
+
+// The code of the functions of a compilation unit, packed into one block of
+// read-only pages once they are compiled. Each chunk whose code lives in the
+// arena counts as one of its users, and the last one frees it. Functions
+// compiled lazily keep code of their own.
+typedef struct CodeArena {
+  int users;
+  int hot_count;
+  int next_layout;
+  size_t size;
+  uint8_t *code;
+} CodeArena;
+
+// Packs the code of the script and of every function nested in it, the
+// script last as it runs only once.
+void
+arena_pack_script(VM *vm, ObjFunction *script);
+
+// Packs the code of the functions among the objects.
+void
+arena_pack_objects(VM *vm, ValueArray *objects);
+
+// Called when the function has become hot. Each time the number of hot
+// functions in its arena doubles, the code is laid out again with the hot
+// functions first, ordered by their calls.
+void
+arena_heat(VM *vm, ObjFunction *function);
+
+void
+arena_release(VM *vm, CodeArena *arena);
+
+#endif
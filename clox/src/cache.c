@@ -0,0 +1,123 @@
+#include "arena.h"
+#include "cache.h"
+#include "serial.h"
+#include "vm.h"
+
+// Functions nested deeper than this are not cached, which bounds the
+// recursion of the loader on a damaged file.
+#define CACHE_MAX_DEPTH 64
+
+typedef enum {
+  CONSTANT_NUMBER,
+  CONSTANT_STRING,
+  CONSTANT_FUNCTION,
+} ConstantTag;
+
+static void
+write_function(VM *vm, Writer *writer, ObjFunction *function, int depth)
+{
+  if (depth > CACHE_MAX_DEPTH || function->lazy != NULL) {
+    writer->failed = true;
+    return;
+  }
+  serial_write_byte(writer, function->arity);
+  serial_write_varint(writer, function->upvalue_count);
+  serial_write_byte(writer, function->name != NULL);
+  if (function->name != NULL)
+    serial_write_string(vm, writer, function->name);
+  Chunk *chunk = &function->chunk;
+  serial_write_code(writer, chunk);
+  serial_write_varint(writer, (uint32_t) chunk->constants.count);
+  for (int i = 0; i < chunk->constants.count; ++i) {
+    Value constant = chunk->constants.values[i];
+    if (IS_NUMBER(constant)) {
+      serial_write_byte(writer, CONSTANT_NUMBER);
+      serial_write_number(writer, AS_NUMBER(constant));
+    } else if (IS_STRING(constant)) {
+      serial_write_byte(writer, CONSTANT_STRING);
+      serial_write_string(vm, writer, AS_STRING(constant));
+    } else if (IS_FUNCTION(constant)) {
+      serial_write_byte(writer, CONSTANT_FUNCTION);
+      write_function(vm, writer, AS_FUNCTION(constant), depth + 1);
+    } else
+      writer->failed = true;
+  }
+}
+
+void
+cache_store(VM *vm, const char *path, const char *source, int length,
+    ObjFunction *function)
+{
+  Writer writer;
+  serial_writer_init(&writer);
+  vm_stack_push(vm, OBJ_VAL(function));
+  write_function(vm, &writer, function, 0);
+  vm_stack_pop(vm);
+  serial_store(path, "LOXC", CACHE_VERSION, source, (size_t) length,
+      &writer);
+  serial_writer_free(&writer);
+}
+
+static ObjFunction *
+read_function(VM *vm, Reader *reader, int depth)
+{
+  if (depth > CACHE_MAX_DEPTH) {
+    reader->failed = true;
+    return NULL;
+  }
+  ObjFunction *function = new_function(vm);
+  vm_stack_push(vm, OBJ_VAL(function));
+  function->arity = serial_read_byte(reader);
+  uint32_t upvalue_count = serial_read_varint(reader);
+  if (upvalue_count > UINT8_COUNT)
+    reader->failed = true;
+  function->upvalue_count = (uint16_t) upvalue_count;
+  if (serial_read_byte(reader))
+    function->name = serial_read_string(vm, reader);
+  serial_read_code(vm, reader, &function->chunk);
+  uint32_t constant_count = serial_read_varint(reader);
+  for (uint32_t i = 0; i < constant_count && !reader->failed; ++i) {
+    switch (serial_read_byte(reader)) {
+    case CONSTANT_NUMBER: {
+      double number = serial_read_number(reader);
+      chunk_add_constant(vm, &function->chunk, NUMBER_VAL(number));
+      break;
+    }
+    case CONSTANT_STRING: {
+      ObjString *string = serial_read_string(vm, reader);
+      if (string != NULL)
+        chunk_add_constant(vm, &function->chunk, OBJ_VAL(string));
+      break;
+    }
+    case CONSTANT_FUNCTION: {
+      ObjFunction *nested = read_function(vm, reader, depth + 1);
+      if (nested != NULL)
+        chunk_add_constant(vm, &function->chunk, OBJ_VAL(nested));
+      break;
+    }
+    default:
+      reader->failed = true;
+    }
+  }
+  if (!reader->failed && !serial_check_code(function))
+    reader->failed = true;
+  vm_stack_pop(vm);
+  return reader->failed ? NULL : function;
+}
+
+ObjFunction *
+cache_load(VM *vm, const char *path, const char *source, int length)
+{
+  SerialFile file;
+  Reader reader;
+  if (!serial_open(&file, path, "LOXC", CACHE_VERSION, source,
+        (size_t) length, &reader))
+    return NULL;
+  ObjFunction *function = read_function(vm, &reader, 0);
+  if (reader.current != reader.end)
+    function = NULL;
+  serial_close(&file);
+  if (function != NULL)
+    arena_pack_script(vm, function);
+  return function;
+}
@@ -0,0 +1,21 @@
+#ifndef CLOX_CACHE_H
+#define CLOX_CACHE_H
+
+#include "object.h"
+
+// Compiled scripts are cached in files holding the serialized function tree
+// of the script, keyed on a full copy of the source it was compiled from.
+// Bump CACHE_VERSION whenever the bytecode or the file format changes.
+#define CACHE_VERSION 4
+
+// Returns the script function cached at path for the given source, or NULL if
+// there is no usable cache.
+ObjFunction *
+cache_load(VM *vm, const char *path, const char *source, int length);
+
+// Caches the compiled script. Failing to write the cache is not an error.
+void
+cache_store(VM *vm, const char *path, const char *source, int length,
+    ObjFunction *function);
+
+#endif
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 
+#include "arena.h"
 #include "chunk.h"
 #include "memory.h"
 #include "vm.h"
@@ -10,40 +11,91 @@ chunk_init(Chunk *chunk)
   chunk->count = 0;
   chunk->capacity = 0;
   chunk->code = NULL;
+  chunk->arena = NULL;
+  chunk->line_count = 0;
+  chunk->line_capacity = 0;
   chunk->lines = NULL;
   value_array_init(&chunk->constants);
 }
 
+// Starts a run of instructions compiled from line at offset.
+static void
+add_line(VM *vm, Chunk *chunk, int offset, int line)
+{
+  if (chunk->line_capacity < chunk->line_count + 1) {
+    int old_capacity = chunk->line_capacity;
+    chunk->line_capacity = GROW_CAPACITY(old_capacity);
+    chunk->lines = GROW_ARRAY(vm, LineRun, chunk->lines, old_capacity,
+                              chunk->line_capacity);
+  }
+  chunk->lines[chunk->line_count].offset = offset;
+  chunk->lines[chunk->line_count].line = line;
+  chunk->line_count++;
+}
+
 void
-chunk_write(Chunk *chunk, uint8_t byte, int line)
+chunk_write(VM *vm, Chunk *chunk, uint8_t byte, int line)
 {
   if (chunk->capacity < chunk->count + 1) {
     int old_capacity = chunk->capacity;
     chunk->capacity = GROW_CAPACITY(old_capacity);
-    chunk->code = GROW_ARRAY(uint8_t, chunk->code, old_capacity,
+    chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code, old_capacity,
                              chunk->capacity);
-    chunk->lines = GROW_ARRAY(int, chunk->lines, old_capacity,
-                              chunk->capacity);
   }
+  if (chunk->line_count == 0
+      || chunk->lines[chunk->line_count - 1].line != line)
+    add_line(vm, chunk, chunk->count, line);
   chunk->code[chunk->count] = byte;
-  chunk->lines[chunk->count] = line;
   chunk->count++;
 }
 
+// Finds the last run starting at or before offset.
 int
-chunk_add_constant(Chunk *chunk, Value value)
+chunk_get_line(Chunk *chunk, int offset)
 {
-  vm_stack_push(value);
-  value_array_write(&chunk->constants, value);
-  vm_stack_pop();
+  int low = 0;
+  int high = chunk->line_count - 1;
+  while (low < high) {
+    int middle = low + (high - low + 1) / 2;
+    if (chunk->lines[middle].offset <= offset)
+      low = middle;
+    else
+      high = middle - 1;
+  }
+  return chunk->line_count > 0 ? chunk->lines[low].line : 0;
+}
+
+int
+chunk_add_constant(VM *vm, Chunk *chunk, Value value)
+{
+  vm_stack_push(vm, value);
+  value_array_write(vm, &chunk->constants, value);
+  vm_stack_pop(vm);
   return chunk->constants.count - 1;
 }
 
+// A finished chunk no longer grows, so the slack left by doubling the arrays
+// is given back. Shrinking never triggers a collection.
+void
+chunk_shrink(VM *vm, Chunk *chunk)
+{
+  chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code, chunk->capacity,
+                           chunk->count);
+  chunk->capacity = chunk->count;
+  chunk->lines = GROW_ARRAY(vm, LineRun, chunk->lines, chunk->line_capacity,
+                            chunk->line_count);
+  chunk->line_capacity = chunk->line_count;
+  value_array_shrink(vm, &chunk->constants);
+}
+
 void
-chunk_free(Chunk *chunk)
+chunk_free(VM *vm, Chunk *chunk)
 {
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
-  value_array_free(&chunk->constants);
+  if (chunk->arena != NULL)
+    arena_release(vm, chunk->arena);
+  else
+    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+  FREE_ARRAY(vm, LineRun, chunk->lines, chunk->line_capacity);
+  value_array_free(vm, &chunk->constants);
   chunk_init(chunk);
 }
@@ -4,6 +4,9 @@
 #include "common.h"
 #include "value.h"
 
+// The largest constant index the long forms of the instructions can hold.
+#define CONSTANT_MAX 0xffffff
+
 typedef enum {
   OP_CONSTANT,
   OP_NIL,
@@ -20,6 +23,8 @@ typedef enum {
   OP_GET_PROPERTY,
   OP_SET_PROPERTY,
   OP_GET_SUPER,
+  OP_INDEX_GET,
+  OP_INDEX_SET,
   OP_EQUAL,
   OP_GREATER,
   OP_LESS,
@@ -29,10 +34,18 @@ typedef enum {
   OP_DIVIDE,
   OP_NOT,
   OP_NEGATE,
+  OP_GREATER_NUMBER,
+  OP_LESS_NUMBER,
+  OP_ADD_NUMBER,
+  OP_SUBTRACT_NUMBER,
+  OP_MULTIPLY_NUMBER,
+  OP_DIVIDE_NUMBER,
+  OP_NEGATE_NUMBER,
   OP_PRINT,
   OP_JUMP,
   OP_JUMP_IF_FALSE,
   OP_LOOP,
+  OP_LOOP_SHORT,
   OP_CALL,
   OP_INVOKE,
   OP_SUPER_INVOKE,
@@ -42,13 +55,42 @@ typedef enum {
   OP_CLASS,
   OP_INHERIT,
   OP_METHOD,
+  OP_ARRAY,
+  OP_MAP,
+  // The same as their short forms, but the constant index is 24 bits wide,
+  // most significant byte first.
+  OP_CONSTANT_LONG,
+  OP_GET_GLOBAL_LONG,
+  OP_DEFINE_GLOBAL_LONG,
+  OP_SET_GLOBAL_LONG,
+  OP_GET_PROPERTY_LONG,
+  OP_SET_PROPERTY_LONG,
+  OP_GET_SUPER_LONG,
+  OP_INVOKE_LONG,
+  OP_SUPER_INVOKE_LONG,
+  OP_CLOSURE_LONG,
+  OP_CLASS_LONG,
+  OP_METHOD_LONG,
 } OpCode;
 
+// Lines are only needed to report errors and to disassemble, so they are
+// kept as runs: the instructions from offset up to the next run's offset
+// were all compiled from line.
+typedef struct {
+  int offset;
+  int line;
+} LineRun;
+
+// Once compiled, the code of a chunk may move into a shared arena, which it
+// then points into instead of owning its code.
 typedef struct {
   int count;
   int capacity;
   uint8_t *code;
-  int *lines;
+  struct CodeArena *arena;
+  int line_count;
+  int line_capacity;
+  LineRun *lines;
   ValueArray constants;
 } Chunk;
 
@@ -56,12 +98,18 @@ void
 chunk_init(Chunk *chunk);
 
 void
-chunk_write(Chunk *chunk, uint8_t byte, int line);
+chunk_write(VM *vm, Chunk *chunk, uint8_t byte, int line);
 
 int
-chunk_add_constant(Chunk *chunk, Value value);
+chunk_get_line(Chunk *chunk, int offset);
+
+int
+chunk_add_constant(VM *vm, Chunk *chunk, Value value);
+
+void
+chunk_shrink(VM *vm, Chunk *chunk);
 
 void
-chunk_free(Chunk *chunk);
+chunk_free(VM *vm, Chunk *chunk);
 
 #endif
@@ -9,4 +9,8 @@
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// An interpreter. Everything it runs and allocates belongs to it, so any
+// number of them can run side by side, one per thread.
+typedef struct VM VM;
+
 #endif
@@ -2,8 +2,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
 #include "common.h"
 #include "compiler.h"
+#include "map.h"
 #include "memory.h"
 #include "scanner.h"
 
@@ -11,12 +13,7 @@
 #include "debug.h"
 #endif
 
-typedef struct {
-  Token previous;
-  Token current;
-  bool had_error;
-  bool panic_mode;
-} Parser;
+typedef struct Parser Parser;
 
 typedef enum {
   PREC_NONE,
@@ -28,11 +25,19 @@ typedef enum {
   PREC_TERM,        // + -
   PREC_FACTOR,      // * /
   PREC_UNARY,       // ! -
-  PREC_CALL,        // . ()
+  PREC_CALL,        // . () []
   PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(bool can_assign);
+// What the compiler can prove about the value of an expression. A number is
+// only proven under the assumption that every local marked as a number still
+// holds one; see types_forget.
+typedef enum {
+  EXPR_ANY,
+  EXPR_NUMBER,
+} ExprType;
+
+typedef void (*ParseFn)(Parser *parser, bool can_assign);
 
 typedef struct {
   ParseFn prefix;
@@ -44,6 +49,7 @@ typedef struct {
   Token name;
   int depth;
   bool is_captured;
+  bool is_number;
 } Local;
 
 typedef struct {
@@ -66,172 +72,334 @@ typedef struct Compiler {
   int local_count;
   Upvalue upvalues[UINT8_COUNT];
   int scope_depth;
+  ExprType expr_type;
+  int *unchecked;
+  int unchecked_count;
+  int unchecked_capacity;
+  ValueArray *captured;
+  Map constants;
 } Compiler;
 
+// The names a skipped body has resolved so far, hashed by name.
+#define CAPTURE_CACHE_SIZE 256
+
+typedef struct {
+  const char *start;
+  int length;
+  int upvalue;
+} CapturedName;
+
+typedef struct {
+  CapturedName names[CAPTURE_CACHE_SIZE];
+  int count;
+} CaptureCache;
+
 typedef struct ClassCompiler {
   struct ClassCompiler *enclosing;
   bool has_superclass;
 } ClassCompiler;
 
-Parser parser;
-Compiler *current = NULL;
-ClassCompiler *current_class = NULL;
+// The state of one compilation. The VM points at it while it runs, so that
+// the functions being compiled are roots.
+struct Parser {
+  VM *vm;
+  Scanner scanner;
+  Token previous;
+  Token current;
+  bool had_error;
+  bool panic_mode;
+  Compiler *compiler;
+  ClassCompiler *class_compiler;
+  // When functions are compiled lazily, the source is copied into this
+  // string and scanned from there, so that bodies skipped now can be compiled
+  // from it later.
+  ObjString *lazy_source;
+};
 
 static Chunk *
-current_chunk()
+current_chunk(Parser *parser)
 {
-  return &current->function->chunk;
+  return &parser->compiler->function->chunk;
 }
 
 static void
-error_at(Token *token, const char *message)
+error_at(Parser *parser, Token *token, const char *message)
 {
-  if (parser.panic_mode)
+  if (parser->panic_mode)
     return;
-  parser.panic_mode = true;
+  parser->panic_mode = true;
   fprintf(stderr, "[line %d] Error", token->line);
   if (token->type == TOKEN_EOF)
     fprintf(stderr, " at end");
   else if (token->type != TOKEN_ERROR)
     fprintf(stderr, " at '%.*s'", token->length, token->start);
   fprintf(stderr, ": %s\n", message);
-  parser.had_error = true;
+  parser->had_error = true;
 }
 
 static void
-error(const char *message)
+error(Parser *parser, const char *message)
 {
-  error_at(&parser.previous, message);
+  error_at(parser, &parser->previous, message);
 }
 
 static void
-error_at_current(const char *message)
+error_at_current(Parser *parser, const char *message)
 {
-  error_at(&parser.current, message);
+  error_at(parser, &parser->current, message);
 }
 
 static void
-advance()
+advance(Parser *parser)
 {
-  parser.previous = parser.current;
+  parser->previous = parser->current;
   for (;;) {
-    parser.current = scanner_scan_token();
-    if (parser.current.type != TOKEN_ERROR)
+    parser->current = scanner_scan_token(&parser->scanner);
+    if (parser->current.type != TOKEN_ERROR)
       break;
-    error_at_current(parser.current.start);
+    error_at_current(parser, parser->current.start);
   }
 }
 
 static void
-consume(TokenType type, const char *message)
+consume(Parser *parser, TokenType type, const char *message)
 {
-  if (parser.current.type == type)
-    advance();
+  if (parser->current.type == type)
+    advance(parser);
   else
-    error_at_current(message);
+    error_at_current(parser, message);
 }
 
 static bool
-check(TokenType type)
+check(Parser *parser, TokenType type)
 {
-  return parser.current.type == type;
+  return parser->current.type == type;
 }
 
 static bool
-match(TokenType type)
+match(Parser *parser, TokenType type)
 {
-  if (!check(type))
+  if (!check(parser, type))
     return false;
-  advance();
+  advance(parser);
   return true;
 }
 
 static void
-emit_byte(uint8_t byte)
+emit_byte(Parser *parser, uint8_t byte)
 {
-  chunk_write(current_chunk(), byte, parser.previous.line);
+  chunk_write(parser->vm, current_chunk(parser), byte, parser->previous.line);
 }
 
 static void
-emit_bytes(uint8_t byte1, uint8_t byte2)
+emit_bytes(Parser *parser, uint8_t byte1, uint8_t byte2)
 {
-  emit_byte(byte1);
-  emit_byte(byte2);
+  emit_byte(parser, byte1);
+  emit_byte(parser, byte2);
 }
 
+// Most loops are short enough to jump back over with a single byte.
 static void
-emit_loop(int loop_start)
+emit_loop(Parser *parser, int loop_start)
 {
-  emit_byte(OP_LOOP);
-  int offset = current_chunk()->count - loop_start + 2;
+  int short_offset = current_chunk(parser)->count - loop_start + 2;
+  if (short_offset <= UINT8_MAX) {
+    emit_bytes(parser, OP_LOOP_SHORT, (uint8_t) short_offset);
+    return;
+  }
+  emit_byte(parser, OP_LOOP);
+  int offset = current_chunk(parser)->count - loop_start + 2;
   if (offset > UINT16_MAX)
-    error("Loop body too large.");
-  emit_byte((offset >> 8) & 0xff);
-  emit_byte(offset & 0xff);
+    error(parser, "Loop body too large.");
+  emit_byte(parser, (offset >> 8) & 0xff);
+  emit_byte(parser, offset & 0xff);
 }
 
 static int
-emit_jump(uint8_t instruction)
+emit_jump(Parser *parser, uint8_t instruction)
 {
-  emit_byte(instruction);
-  emit_byte(0xff);
-  emit_byte(0xff);
-  return current_chunk()->count - 2;
+  emit_byte(parser, instruction);
+  emit_byte(parser, 0xff);
+  emit_byte(parser, 0xff);
+  return current_chunk(parser)->count - 2;
 }
 
 static void
-emit_return()
+emit_return(Parser *parser)
 {
-  if (current->type == TYPE_INITIALIZER)
-    emit_bytes(OP_GET_LOCAL, 0);
+  if (parser->compiler->type == TYPE_INITIALIZER)
+    emit_bytes(parser, OP_GET_LOCAL, 0);
   else
-    emit_byte(OP_NIL);
-  emit_byte(OP_RETURN);
+    emit_byte(parser, OP_NIL);
+  emit_byte(parser, OP_RETURN);
+}
+
+// Emits an opcode that skips the operand type checks and remembers where, in
+// case the locals it relies on turn out not to be numbers after all.
+static void
+emit_unchecked(Parser *parser, uint8_t instruction)
+{
+  emit_byte(parser, instruction);
+  Compiler *current = parser->compiler;
+  if (current->unchecked_capacity < current->unchecked_count + 1) {
+    int old_capacity = current->unchecked_capacity;
+    current->unchecked_capacity = GROW_CAPACITY(old_capacity);
+    current->unchecked = GROW_ARRAY(parser->vm, int, current->unchecked,
+        old_capacity, current->unchecked_capacity);
+  }
+  current->unchecked[current->unchecked_count++] =
+    current_chunk(parser)->count - 1;
 }
 
 static uint8_t
-make_constant(Value value)
+checked_opcode(uint8_t instruction)
+{
+  switch (instruction) {
+  case OP_GREATER_NUMBER:
+    return OP_GREATER;
+  case OP_LESS_NUMBER:
+    return OP_LESS;
+  case OP_ADD_NUMBER:
+    return OP_ADD;
+  case OP_SUBTRACT_NUMBER:
+    return OP_SUBTRACT;
+  case OP_MULTIPLY_NUMBER:
+    return OP_MULTIPLY;
+  case OP_DIVIDE_NUMBER:
+    return OP_DIVIDE;
+  case OP_NEGATE_NUMBER:
+    return OP_NEGATE;
+  default:
+    return instruction;
+  }
+}
+
+// Called when a local marked as a number may be assigned something else. The
+// compiler is single pass, so code already emitted for a loop body may have
+// relied on the local before the assignment was seen. Every unchecked opcode
+// emitted so far goes back to its checked form and no local in scope is
+// trusted any more, which also covers numbers copied from the local.
+static void
+types_forget(Compiler *compiler)
 {
-  int constant = chunk_add_constant(current_chunk(), value);
-  if (constant > UINT8_MAX) {
-    error("Too many constants in one chunk.");
+  Chunk *chunk = &compiler->function->chunk;
+  for (int i = 0; i < compiler->unchecked_count; ++i) {
+    int offset = compiler->unchecked[i];
+    chunk->code[offset] = checked_opcode(chunk->code[offset]);
+  }
+  compiler->unchecked_count = 0;
+  for (int i = 0; i < compiler->local_count; ++i)
+    compiler->locals[i].is_number = false;
+}
+
+// Numbers and strings already in the chunk are found in the compiler's map
+// of constants and reused. Numbers are keyed by their bits, so that -0 and 0
+// stay apart; strings from the compiler are always interned.
+static uint32_t
+make_constant(Parser *parser, Value value)
+{
+  bool shared = IS_NUMBER(value) || IS_STRING(value);
+  Value index;
+  if (shared && map_get(&parser->compiler->constants, value, &index))
+    return (uint32_t) AS_NUMBER(index);
+  int constant = chunk_add_constant(parser->vm, current_chunk(parser), value);
+  if (constant > CONSTANT_MAX) {
+    error(parser, "Too many constants in one chunk.");
     return 0;
   }
-  return (uint8_t) constant;
+  if (shared)
+    map_set(parser->vm, &parser->compiler->constants, value,
+        NUMBER_VAL(constant));
+  return (uint32_t) constant;
 }
 
+static uint8_t
+long_opcode(uint8_t instruction)
+{
+  switch (instruction) {
+  case OP_CONSTANT:
+    return OP_CONSTANT_LONG;
+  case OP_GET_GLOBAL:
+    return OP_GET_GLOBAL_LONG;
+  case OP_DEFINE_GLOBAL:
+    return OP_DEFINE_GLOBAL_LONG;
+  case OP_SET_GLOBAL:
+    return OP_SET_GLOBAL_LONG;
+  case OP_GET_PROPERTY:
+    return OP_GET_PROPERTY_LONG;
+  case OP_SET_PROPERTY:
+    return OP_SET_PROPERTY_LONG;
+  case OP_GET_SUPER:
+    return OP_GET_SUPER_LONG;
+  case OP_INVOKE:
+    return OP_INVOKE_LONG;
+  case OP_SUPER_INVOKE:
+    return OP_SUPER_INVOKE_LONG;
+  case OP_CLOSURE:
+    return OP_CLOSURE_LONG;
+  case OP_CLASS:
+    return OP_CLASS_LONG;
+  case OP_METHOD:
+    return OP_METHOD_LONG;
+  default:
+    return instruction;
+  }
+}
+
+// Emits an instruction taking a constant, in its long form when the index
+// does not fit in a byte.
 static void
-emit_constant(Value value)
+emit_constant_op(Parser *parser, uint8_t instruction, uint32_t constant)
 {
-  emit_bytes(OP_CONSTANT, make_constant(value));
+  if (constant <= UINT8_MAX) {
+    emit_bytes(parser, instruction, (uint8_t) constant);
+    return;
+  }
+  emit_byte(parser, long_opcode(instruction));
+  emit_byte(parser, (constant >> 16) & 0xff);
+  emit_byte(parser, (constant >> 8) & 0xff);
+  emit_byte(parser, constant & 0xff);
 }
 
 static void
-patch_jump(int offset)
+emit_constant(Parser *parser, Value value)
 {
-  int jump = current_chunk()->count - offset - 2;
+  emit_constant_op(parser, OP_CONSTANT, make_constant(parser, value));
+}
+
+static void
+patch_jump(Parser *parser, int offset)
+{
+  int jump = current_chunk(parser)->count - offset - 2;
   if (jump > UINT16_MAX)
-    error("Too much code to jump over");
-  current_chunk()->code[offset] = (jump >> 8) & 0xff;
-  current_chunk()->code[offset + 1] = jump & 0xff;
+    error(parser, "Too much code to jump over");
+  current_chunk(parser)->code[offset] = (jump >> 8) & 0xff;
+  current_chunk(parser)->code[offset + 1] = jump & 0xff;
 }
 
 static void
-compiler_init(Compiler *compiler, FunctionType type)
+compiler_init(Parser *parser, Compiler *compiler, FunctionType type)
 {
-  compiler->enclosing = current;
+  compiler->enclosing = parser->compiler;
   compiler->function = NULL;
   compiler->type = type;
   compiler->local_count = 0;
   compiler->scope_depth = 0;
-  compiler->function = new_function();
-  current = compiler;
+  compiler->expr_type = EXPR_ANY;
+  compiler->unchecked = NULL;
+  compiler->unchecked_count = 0;
+  compiler->unchecked_capacity = 0;
+  compiler->captured = NULL;
+  map_init(&compiler->constants);
+  compiler->function = new_function(parser->vm);
+  parser->compiler = compiler;
   if (type != TYPE_SCRIPT)
-    current->function->name = copy_string(parser.previous.start,
-                                          parser.previous.length);
-  Local *local = &current->locals[current->local_count++];
+    compiler->function->name = copy_string(parser->vm,
+        parser->previous.start, parser->previous.length);
+  Local *local = &parser->compiler->locals[parser->compiler->local_count++];
   local->depth = 0;
   local->is_captured = false;
+  local->is_number = false;
   if (type != TYPE_FUNCTION) {
     local->name.start = "this";
     local->name.length = 4;
@@ -242,59 +410,64 @@ compiler_init(Compiler *compiler, FunctionType type)
 }
 
 static ObjFunction *
-compiler_end()
-{
-  emit_return();
-  ObjFunction *function = current->function;
+compiler_end(Parser *parser)
+{
+  emit_return(parser);
+  ObjFunction *function = parser->compiler->function;
+  FREE_ARRAY(parser->vm, int, parser->compiler->unchecked,
+      parser->compiler->unchecked_capacity);
+  map_free(parser->vm, &parser->compiler->constants);
+  chunk_shrink(parser->vm, current_chunk(parser));
   #ifdef DEBUG_PRINT_CODE
-  if (!parser.had_error)
-    disassemble_chunk(current_chunk(), function->name != NULL
+  if (!parser->had_error)
+    disassemble_chunk(current_chunk(parser), function->name != NULL
         ? function->name->chars : "<script>");
   #endif
-  current = current->enclosing;
+  parser->compiler = parser->compiler->enclosing;
   return function;
 }
 
 static void
-scope_begin()
+scope_begin(Parser *parser)
 {
-  current->scope_depth++;
+  parser->compiler->scope_depth++;
 }
 
 static void
-scope_end()
-{
-  current->scope_depth--;
-  while (current->local_count > 0
-      && current->locals[current->local_count - 1].depth
-      > current->scope_depth) {
-    if (current->locals[current->local_count - 1].is_captured)
-      emit_byte(OP_CLOSE_UPVALUE);
+scope_end(Parser *parser)
+{
+  parser->compiler->scope_depth--;
+  while (parser->compiler->local_count > 0
+      && parser->compiler->locals[parser->compiler->local_count - 1].depth
+      > parser->compiler->scope_depth) {
+    if (parser->compiler->locals[parser->compiler->local_count - 1].is_captured)
+      emit_byte(parser, OP_CLOSE_UPVALUE);
     else
-      emit_byte(OP_POP);
-    current->local_count--;
+      emit_byte(parser, OP_POP);
+    parser->compiler->local_count--;
   }
 }
 
 static void
-expression();
+expression(Parser *parser);
 
 static void
-declaration();
+declaration(Parser *parser);
 
 static void
-statement();
+statement(Parser *parser);
 
 static ParseRule *
 get_rule(TokenType type);
 
 static void
-parse_precedence(Precedence precedence);
+parse_precedence(Parser *parser, Precedence precedence);
 
-static uint8_t
-identifier_constant(Token *name)
+static uint32_t
+identifier_constant(Parser *parser, Token *name)
 {
-  return make_constant(OBJ_VAL(copy_string(name->start, name->length)));
+  return make_constant(parser,
+      OBJ_VAL(copy_string(parser->vm, name->start, name->length)));
 }
 
 static bool
@@ -306,13 +479,13 @@ identifiers_equal(Token *a, Token *b)
 }
 
 static int
-resolve_local(Compiler *compiler, Token *name)
+resolve_local(Parser *parser, Compiler *compiler, Token *name)
 {
   for (int i = compiler->local_count - 1; i >= 0; --i) {
     Local *local = &compiler->locals[i];
     if (identifiers_equal(name, &local->name)) {
       if (local->depth == -1)
-        error("Can't read local variable in its own initializer.");
+        error(parser, "Can't read local variable in its own initializer.");
       return i;
     }
   }
@@ -320,7 +493,7 @@ resolve_local(Compiler *compiler, Token *name)
 }
 
 static int
-add_upvalue(Compiler *compiler, uint8_t index, bool is_local)
+add_upvalue(Parser *parser, Compiler *compiler, uint8_t index, bool is_local)
 {
   int upvalue_count = compiler->function->upvalue_count;
   for (int i = 0; i < upvalue_count; ++i) {
@@ -329,7 +502,7 @@ add_upvalue(Compiler *compiler, uint8_t index, bool is_local)
       return i;
   }
   if (upvalue_count == UINT8_COUNT) {
-    error("Too many closure variables in function.");
+    error(parser, "Too many closure variables in function.");
     return 0;
   }
   compiler->upvalues[upvalue_count].is_local = is_local;
@@ -337,140 +510,197 @@ add_upvalue(Compiler *compiler, uint8_t index, bool is_local)
   return compiler->function->upvalue_count++;
 }
 
+// A function compiled lazily has no enclosing compiler, so it looks up the
+// variables it captured by name.
+static int
+resolve_captured(Compiler *compiler, Token *name)
+{
+  for (int i = 0; i < compiler->captured->count; ++i) {
+    ObjString *captured = AS_STRING(compiler->captured->values[i]);
+    if (captured->length == name->length
+        && memcmp(captured->chars, name->start, name->length) == 0)
+      return i;
+  }
+  return -1;
+}
+
 static int
-resolve_upvalue(Compiler *compiler, Token *name)
+resolve_upvalue(Parser *parser, Compiler *compiler, Token *name)
 {
   if (compiler->enclosing == NULL)
-    return -1;
-  int local = resolve_local(compiler->enclosing, name);
+    return compiler->captured != NULL
+      ? resolve_captured(compiler, name) : -1;
+  int local = resolve_local(parser, compiler->enclosing, name);
   if (local != -1) {
     compiler->enclosing->locals[local].is_captured = true;
-    return add_upvalue(compiler, (uint8_t) local, true);
+    return add_upvalue(parser, compiler, (uint8_t) local, true);
   }
-  int upvalue = resolve_upvalue(compiler->enclosing, name);
+  int upvalue = resolve_upvalue(parser, compiler->enclosing, name);
   if (upvalue != -1)
-    return add_upvalue(compiler, (uint8_t) upvalue, false);
+    return add_upvalue(parser, compiler, (uint8_t) upvalue, false);
   return -1;
 }
 
 static void
-add_local(Token name)
+add_local(Parser *parser, Token name)
 {
-  if (current->local_count == UINT8_COUNT) {
-    error("Too many local variables in function.");
+  if (parser->compiler->local_count == UINT8_COUNT) {
+    error(parser, "Too many local variables in function.");
     return;
   }
-  Local *local = &current->locals[current->local_count++];
+  Local *local = &parser->compiler->locals[parser->compiler->local_count++];
   local->name = name;
   local->depth = -1;
   local->is_captured = false;
+  local->is_number = false;
 }
 
 static void
-declare_variable()
+declare_variable(Parser *parser)
 {
-  if (current->scope_depth == 0)
+  if (parser->compiler->scope_depth == 0)
     return;
-  Token *name = &parser.previous;
-  for (int i = current->local_count - 1; i >= 0; --i) {
-    Local *local = &current->locals[i];
-    if (local->depth != -1 && local->depth < current->scope_depth)
+  Token *name = &parser->previous;
+  for (int i = parser->compiler->local_count - 1; i >= 0; --i) {
+    Local *local = &parser->compiler->locals[i];
+    if (local->depth != -1 && local->depth < parser->compiler->scope_depth)
       break;
     if (identifiers_equal(name, &local->name))
-      error("Already a variable with this name in this scope.");
+      error(parser, "Already a variable with this name in this scope.");
   }
-  add_local(*name);
+  add_local(parser, *name);
 }
 
-static uint8_t
-parse_variable(const char *error_message)
+static uint32_t
+parse_variable(Parser *parser, const char *error_message)
 {
-  consume(TOKEN_IDENTIFIER, error_message);
-  declare_variable();
-  if (current->scope_depth > 0)
+  consume(parser, TOKEN_IDENTIFIER, error_message);
+  declare_variable(parser);
+  if (parser->compiler->scope_depth > 0)
     return 0;
-  return identifier_constant(&parser.previous);
+  return identifier_constant(parser, &parser->previous);
 }
 
 static void
-mark_initialized()
+mark_initialized(Parser *parser)
 {
-  if (current->scope_depth == 0)
+  if (parser->compiler->scope_depth == 0)
     return;
+  Compiler *current = parser->compiler;
   current->locals[current->local_count - 1].depth = current->scope_depth;
 }
 
 static void
-define_variable(uint8_t global)
+define_variable(Parser *parser, uint32_t global)
 {
-  if (current->scope_depth > 0) {
-    mark_initialized();
+  if (parser->compiler->scope_depth > 0) {
+    mark_initialized(parser);
     return;
   }
-  emit_bytes(OP_DEFINE_GLOBAL, global);
+  emit_constant_op(parser, OP_DEFINE_GLOBAL, global);
 }
 
 static uint8_t
-argument_list()
+argument_list(Parser *parser)
 {
   uint8_t arg_count = 0;
-  if (!check(TOKEN_RIGHT_PAREN)) {
+  if (!check(parser, TOKEN_RIGHT_PAREN)) {
     do {
-      expression();
+      expression(parser);
       if (arg_count == 255)
-        error("Can't have more than 255 arguments.");
+        error(parser, "Can't have more than 255 arguments.");
       arg_count++;
-    } while (match(TOKEN_COMMA));
+    } while (match(parser, TOKEN_COMMA));
   }
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
   return arg_count;
 }
 
 static void
-and_(bool can_assign)
+and_(Parser *parser, bool can_assign)
+{
+  int end_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+  emit_byte(parser, OP_POP);
+  parse_precedence(parser, PREC_AND);
+  patch_jump(parser, end_jump);
+  parser->compiler->expr_type = EXPR_ANY;
+}
+
+static void
+array(Parser *parser, bool can_assign)
 {
-  int end_jump = emit_jump(OP_JUMP_IF_FALSE);
-  emit_byte(OP_POP);
-  parse_precedence(PREC_AND);
-  patch_jump(end_jump);
+  uint8_t element_count = 0;
+  if (!check(parser, TOKEN_RIGHT_BRACKET)) {
+    do {
+      expression(parser);
+      if (element_count == 255)
+        error(parser, "Can't have more than 255 elements in an array literal.");
+      element_count++;
+    } while (match(parser, TOKEN_COMMA));
+  }
+  consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after array elements.");
+  emit_bytes(parser, OP_ARRAY, element_count);
 }
 
 static void
-binary(bool can_assign)
+emit_numeric(Parser *parser, uint8_t checked, uint8_t unchecked, bool is_proven)
 {
-  TokenType operator_type = parser.previous.type;
+  if (is_proven)
+    emit_unchecked(parser, unchecked);
+  else
+    emit_byte(parser, checked);
+}
+
+// The checked arithmetic opcodes fail unless they produce a number, and so
+// does addition with a number on either side, so their results are numbers
+// even when the operands are not proven.
+static void
+binary(Parser *parser, bool can_assign)
+{
+  TokenType operator_type = parser->previous.type;
+  ExprType left = parser->compiler->expr_type;
   ParseRule *rule = get_rule(operator_type);
-  parse_precedence((Precedence) (rule->precedence + 1));
+  parse_precedence(parser, (Precedence) (rule->precedence + 1));
+  ExprType right = parser->compiler->expr_type;
+  bool numbers = left == EXPR_NUMBER && right == EXPR_NUMBER;
+  parser->compiler->expr_type = EXPR_ANY;
   switch (operator_type) {
   case TOKEN_BANG_EQUAL:
-    emit_bytes(OP_EQUAL, OP_NOT);
+    emit_bytes(parser, OP_EQUAL, OP_NOT);
     break;
   case TOKEN_EQUAL_EQUAL:
-    emit_byte(OP_EQUAL);
+    emit_byte(parser, OP_EQUAL);
     break;
   case TOKEN_GREATER:
-    emit_byte(OP_GREATER);
+    emit_numeric(parser, OP_GREATER, OP_GREATER_NUMBER, numbers);
     break;
   case TOKEN_GREATER_EQUAL:
-    emit_bytes(OP_LESS, OP_NOT);
+    emit_numeric(parser, OP_LESS, OP_LESS_NUMBER, numbers);
+    emit_byte(parser, OP_NOT);
     break;
   case TOKEN_LESS:
-    emit_byte(OP_LESS);
+    emit_numeric(parser, OP_LESS, OP_LESS_NUMBER, numbers);
     break;
   case TOKEN_LESS_EQUAL:
-    emit_bytes(OP_GREATER, OP_NOT);
+    emit_numeric(parser, OP_GREATER, OP_GREATER_NUMBER, numbers);
+    emit_byte(parser, OP_NOT);
     break;
   case TOKEN_PLUS:
-    emit_byte(OP_ADD);
+    emit_numeric(parser, OP_ADD, OP_ADD_NUMBER, numbers);
+    if (left == EXPR_NUMBER || right == EXPR_NUMBER)
+      parser->compiler->expr_type = EXPR_NUMBER;
     break;
   case TOKEN_MINUS:
-    emit_byte(OP_SUBTRACT);
+    emit_numeric(parser, OP_SUBTRACT, OP_SUBTRACT_NUMBER, numbers);
+    parser->compiler->expr_type = EXPR_NUMBER;
     break;
   case TOKEN_STAR:
-    emit_byte(OP_MULTIPLY);
+    emit_numeric(parser, OP_MULTIPLY, OP_MULTIPLY_NUMBER, numbers);
+    parser->compiler->expr_type = EXPR_NUMBER;
     break;
   case TOKEN_SLASH:
-    emit_byte(OP_DIVIDE);
+    emit_numeric(parser, OP_DIVIDE, OP_DIVIDE_NUMBER, numbers);
+    parser->compiler->expr_type = EXPR_NUMBER;
     break;
   default:
     // Unreachable.
@@ -479,40 +709,55 @@ binary(bool can_assign)
 }
 
 static void
-call(bool can_assign)
+call(Parser *parser, bool can_assign)
 {
-  uint8_t arg_count = argument_list();
-  emit_bytes(OP_CALL, arg_count);
+  uint8_t arg_count = argument_list(parser);
+  emit_bytes(parser, OP_CALL, arg_count);
+  parser->compiler->expr_type = EXPR_ANY;
+}
+
+static void
+dot(Parser *parser, bool can_assign)
+{
+  consume(parser, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+  uint32_t name = identifier_constant(parser, &parser->previous);
+  if (can_assign && match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    emit_constant_op(parser, OP_SET_PROPERTY, name);
+  } else if (match(parser, TOKEN_LEFT_PAREN)) {
+    uint8_t arg_count = argument_list(parser);
+    emit_constant_op(parser, OP_INVOKE, name);
+    emit_byte(parser, arg_count);
+  } else
+    emit_constant_op(parser, OP_GET_PROPERTY, name);
+  parser->compiler->expr_type = EXPR_ANY;
 }
 
 static void
-dot(bool can_assign)
+index_(Parser *parser, bool can_assign)
 {
-  consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-  uint8_t name = identifier_constant(&parser.previous);
-  if (can_assign && match(TOKEN_EQUAL)) {
-    expression();
-    emit_bytes(OP_SET_PROPERTY, name);
-  } else if (match(TOKEN_LEFT_PAREN)) {
-    uint8_t arg_count = argument_list();
-    emit_bytes(OP_INVOKE, name);
-    emit_byte(arg_count);
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+  if (can_assign && match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    emit_byte(parser, OP_INDEX_SET);
   } else
-    emit_bytes(OP_GET_PROPERTY, name);
+    emit_byte(parser, OP_INDEX_GET);
+  parser->compiler->expr_type = EXPR_ANY;
 }
 
 static void
-literal(bool can_assign)
+literal(Parser *parser, bool can_assign)
 {
-  switch (parser.previous.type) {
+  switch (parser->previous.type) {
   case TOKEN_FALSE:
-    emit_byte(OP_FALSE);
+    emit_byte(parser, OP_FALSE);
     break;
   case TOKEN_NIL:
-    emit_byte(OP_NIL);
+    emit_byte(parser, OP_NIL);
     break;
   case TOKEN_TRUE:
-    emit_byte(OP_TRUE);
+    emit_byte(parser, OP_TRUE);
     break;
   default:
     // Unreachable.
@@ -521,64 +766,107 @@ literal(bool can_assign)
 }
 
 static void
-grouping(bool can_assign)
+grouping(Parser *parser, bool can_assign)
 {
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
 static void
-number(bool can_assign)
+number(Parser *parser, bool can_assign)
+{
+  // The source is not terminated, so strtod gets a copy of the token.
+  char buffer[64];
+  int length = parser->previous.length;
+  char *text = length < (int) sizeof(buffer) ? buffer : malloc(length + 1);
+  if (text == NULL)
+    exit(1);
+  memcpy(text, parser->previous.start, length);
+  text[length] = '\0';
+  double value = strtod(text, NULL);
+  if (text != buffer)
+    free(text);
+  emit_constant(parser, NUMBER_VAL(value));
+  parser->compiler->expr_type = EXPR_NUMBER;
+}
+
+static void
+or_(Parser *parser, bool can_assign)
 {
-  double value = strtod(parser.previous.start, NULL);
-  emit_constant(NUMBER_VAL(value));
+  int else_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+  int end_jump = emit_jump(parser, OP_JUMP);
+  patch_jump(parser, else_jump);
+  emit_byte(parser, OP_POP);
+  parse_precedence(parser, PREC_OR);
+  patch_jump(parser, end_jump);
+  parser->compiler->expr_type = EXPR_ANY;
 }
 
 static void
-or_(bool can_assign)
+string(Parser *parser, bool can_assign)
 {
-  int else_jump = emit_jump(OP_JUMP_IF_FALSE);
-  int end_jump = emit_jump(OP_JUMP);
-  patch_jump(else_jump);
-  emit_byte(OP_POP);
-  parse_precedence(PREC_OR);
-  patch_jump(end_jump);
+  emit_constant(parser, OBJ_VAL(copy_string(parser->vm,
+          parser->previous.start + 1, parser->previous.length - 2)));
 }
 
 static void
-string(bool can_assign)
+map(Parser *parser, bool can_assign)
 {
-  emit_constant(OBJ_VAL(copy_string(parser.previous.start + 1,
-                                    parser.previous.length - 2)));
+  uint8_t entry_count = 0;
+  if (!check(parser, TOKEN_RIGHT_BRACE)) {
+    do {
+      expression(parser);
+      consume(parser, TOKEN_COLON, "Expect ':' after map key.");
+      expression(parser);
+      if (entry_count == 255)
+        error(parser, "Can't have more than 255 entries in a map literal.");
+      entry_count++;
+    } while (match(parser, TOKEN_COMMA));
+  }
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+  emit_bytes(parser, OP_MAP, entry_count);
 }
 
 static void
-named_variable(Token name, bool can_assign)
+named_variable(Parser *parser, Token name, bool can_assign)
 {
   uint8_t get_op, set_op;
-  int arg = resolve_local(current, &name);
+  int arg = resolve_local(parser, parser->compiler, &name);
   if (arg != -1) {
     get_op = OP_GET_LOCAL;
     set_op = OP_SET_LOCAL;
-  } else if ((arg = resolve_upvalue(current, &name)) != -1) {
+  } else if ((arg = resolve_upvalue(parser, parser->compiler, &name)) != -1) {
     get_op = OP_GET_UPVALUE;
     set_op = OP_SET_UPVALUE;
   } else {
-    arg = identifier_constant(&name);
+    arg = identifier_constant(parser, &name);
     get_op = OP_GET_GLOBAL;
     set_op = OP_SET_GLOBAL;
   }
-  if (can_assign && match(TOKEN_EQUAL)) {
-    expression();
-    emit_bytes(set_op, (uint8_t) arg);
-  } else
-    emit_bytes(get_op, (uint8_t) arg);
+  if (can_assign && match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    if (set_op == OP_SET_LOCAL) {
+      if (parser->compiler->locals[arg].is_number
+          && parser->compiler->expr_type != EXPR_NUMBER)
+        types_forget(parser->compiler);
+    } else if (set_op == OP_SET_UPVALUE) {
+      // The enclosing functions cannot tell when the closure runs.
+      for (Compiler *compiler = parser->compiler->enclosing; compiler != NULL;
+          compiler = compiler->enclosing)
+        types_forget(compiler);
+    }
+    emit_constant_op(parser, set_op, (uint32_t) arg);
+  } else {
+    emit_constant_op(parser, get_op, (uint32_t) arg);
+    if (get_op == OP_GET_LOCAL && parser->compiler->locals[arg].is_number)
+      parser->compiler->expr_type = EXPR_NUMBER;
+  }
 }
 
 static void
-variable(bool can_assign)
+variable(Parser *parser, bool can_assign)
 {
-  named_variable(parser.previous, can_assign);
+  named_variable(parser, parser->previous, can_assign);
 }
 
 static Token
@@ -591,48 +879,51 @@ synthetic_token(const char *text)
 }
 
 static void
-super(bool can_assign)
-{
-  if (current_class == NULL)
-    error("Can't use 'super' outside of a class.");
-  else if (!current_class->has_superclass)
-    error("Can't use 'super' in a class with no superclass.");
-  consume(TOKEN_DOT, "Expect '.' after 'super'.");
-  consume(TOKEN_IDENTIFIER, "Expect superclass method name,");
-  uint8_t name = identifier_constant(&parser.previous);
-  named_variable(synthetic_token("this"), false);
-  if (match(TOKEN_LEFT_PAREN)) {
-    uint8_t arg_count = argument_list();
-    named_variable(synthetic_token("super"), false);
-    emit_bytes(OP_SUPER_INVOKE, name);
-    emit_byte(arg_count);
+super(Parser *parser, bool can_assign)
+{
+  if (parser->class_compiler == NULL)
+    error(parser, "Can't use 'super' outside of a class.");
+  else if (!parser->class_compiler->has_superclass)
+    error(parser, "Can't use 'super' in a class with no superclass.");
+  consume(parser, TOKEN_DOT, "Expect '.' after 'super'.");
+  consume(parser, TOKEN_IDENTIFIER, "Expect superclass method name,");
+  uint32_t name = identifier_constant(parser, &parser->previous);
+  named_variable(parser, synthetic_token("this"), false);
+  if (match(parser, TOKEN_LEFT_PAREN)) {
+    uint8_t arg_count = argument_list(parser);
+    named_variable(parser, synthetic_token("super"), false);
+    emit_constant_op(parser, OP_SUPER_INVOKE, name);
+    emit_byte(parser, arg_count);
   } else {
-    named_variable(synthetic_token("super"), false);
-    emit_bytes(OP_GET_SUPER, name);
+    named_variable(parser, synthetic_token("super"), false);
+    emit_constant_op(parser, OP_GET_SUPER, name);
   }
 }
 
 static void
-this(bool can_assign)
+this(Parser *parser, bool can_assign)
 {
-  if (current_class == NULL) {
-    error("Can't use 'this' outside of a class.");
+  if (parser->class_compiler == NULL) {
+    error(parser, "Can't use 'this' outside of a class.");
     return;
   }
-  variable(false);
+  variable(parser, false);
 }
 
 static void
-unary(bool can_assign)
+unary(Parser *parser, bool can_assign)
 {
-  TokenType operator_type = parser.previous.type;
-  parse_precedence(PREC_UNARY);
+  TokenType operator_type = parser->previous.type;
+  parse_precedence(parser, PREC_UNARY);
   switch (operator_type) {
   case TOKEN_BANG:
-    emit_byte(OP_NOT);
+    emit_byte(parser, OP_NOT);
+    parser->compiler->expr_type = EXPR_ANY;
     break;
   case TOKEN_MINUS:
-    emit_byte(OP_NEGATE);
+    emit_numeric(parser, OP_NEGATE, OP_NEGATE_NUMBER,
+        parser->compiler->expr_type == EXPR_NUMBER);
+    parser->compiler->expr_type = EXPR_NUMBER;
     break;
   default:
     // Unreachable.
@@ -644,8 +935,11 @@ ParseRule rules[] = {
   // Token                 prefix    infix   precedence.
   [TOKEN_LEFT_PAREN]    = {grouping, call,   PREC_CALL},
   [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,   PREC_NONE},
-  [TOKEN_LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_LEFT_BRACE]    = {map,      NULL,   PREC_NONE},
   [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_LEFT_BRACKET]  = {array,    index_, PREC_CALL},
+  [TOKEN_RIGHT_BRACKET] = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_COLON]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_COMMA]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_DOT]           = {NULL,     dot,    PREC_CALL},
   [TOKEN_MINUS]         = {unary,    binary, PREC_TERM},
@@ -685,23 +979,24 @@ ParseRule rules[] = {
 };
 
 static void
-parse_precedence(Precedence precedence)
+parse_precedence(Parser *parser, Precedence precedence)
 {
-  advance();
-  ParseFn prefix_rule = get_rule(parser.previous.type)->prefix;
+  advance(parser);
+  ParseFn prefix_rule = get_rule(parser->previous.type)->prefix;
   if (prefix_rule == NULL) {
-    error("Expect expression.");
+    error(parser, "Expect expression.");
     return;
   }
   bool can_assign = precedence <= PREC_ASSIGNMENT;
-  prefix_rule(can_assign);
-  while (precedence <= get_rule(parser.current.type)->precedence) {
-    advance();
-    ParseFn infix_rule = get_rule(parser.previous.type)->infix;
-    infix_rule(can_assign);
+  parser->compiler->expr_type = EXPR_ANY;
+  prefix_rule(parser, can_assign);
+  while (precedence <= get_rule(parser->current.type)->precedence) {
+    advance(parser);
+    ParseFn infix_rule = get_rule(parser->previous.type)->infix;
+    infix_rule(parser, can_assign);
   }
-  if (can_assign && match(TOKEN_EQUAL))
-    error("Invalid assignment target.");
+  if (can_assign && match(parser, TOKEN_EQUAL))
+    error(parser, "Invalid assignment target.");
 }
 
 static ParseRule *
@@ -711,226 +1006,383 @@ get_rule(TokenType type)
 }
 
 static void
-expression()
+expression(Parser *parser)
 {
-  parse_precedence(PREC_ASSIGNMENT);
+  parse_precedence(parser, PREC_ASSIGNMENT);
 }
 
 static void
-block()
+block(Parser *parser)
 {
-  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
-    declaration();
-  consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+  while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF))
+    declaration(parser);
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
 static void
-function(FunctionType type)
+parameters(Parser *parser)
 {
-  Compiler compiler;
-  compiler_init(&compiler, type);
-  scope_begin();
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
-  if (!check(TOKEN_RIGHT_PAREN)) {
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+  if (!check(parser, TOKEN_RIGHT_PAREN)) {
     do {
-      current->function->arity++;
-      if (current->function->arity > 255)
-        error_at_current("Can't have more than 255 parameters.");
-      uint8_t constant = parse_variable("Expect parameter name.");
-      define_variable(constant);
-    } while (match(TOKEN_COMMA));
-  }
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
-  consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-  block();
-  ObjFunction *function = compiler_end();
-  emit_bytes(OP_CLOSURE, make_constant(OBJ_VAL(function)));
+      if (parser->compiler->function->arity == 255)
+        error_at_current(parser, "Can't have more than 255 parameters.");
+      else
+        parser->compiler->function->arity++;
+      uint32_t constant = parse_variable(parser, "Expect parameter name.");
+      define_variable(parser, constant);
+    } while (match(parser, TOKEN_COMMA));
+  }
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+  consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+}
+
+// Adds the upvalue a skipped body needs for name, if name is a variable of
+// an enclosing function, and returns its index or -1.
+static int
+capture(Parser *parser, Token *name)
+{
+  if (resolve_local(parser, parser->compiler, name) != -1)
+    return -1;
+  LazyBody *lazy = parser->compiler->function->lazy;
+  int upvalue = resolve_upvalue(parser, parser->compiler, name);
+  if (upvalue == lazy->upvalue_names.count) {
+    ObjString *string = copy_string(parser->vm, name->start, name->length);
+    vm_stack_push(parser->vm, OBJ_VAL(string));
+    value_array_write(parser->vm, &lazy->upvalue_names, OBJ_VAL(string));
+    vm_stack_pop(parser->vm);
+  }
+  return upvalue;
+}
+
+// A body names the same few variables over and over, so each of the first
+// CAPTURE_CACHE_SIZE / 2 names is only resolved once.
+static int
+capture_cached(Parser *parser, Token *name, CaptureCache *cache)
+{
+  if (cache->count == CAPTURE_CACHE_SIZE / 2)
+    return capture(parser, name);
+  uint32_t slot = hash_string(name->start, name->length);
+  for (;;) {
+    CapturedName *entry = &cache->names[slot & (CAPTURE_CACHE_SIZE - 1)];
+    if (entry->start == NULL) {
+      entry->start = name->start;
+      entry->length = name->length;
+      entry->upvalue = capture(parser, name);
+      cache->count++;
+      return entry->upvalue;
+    }
+    if (entry->length == name->length
+        && memcmp(entry->start, name->start, name->length) == 0)
+      return entry->upvalue;
+    slot++;
+  }
+}
+
+// Whether the enclosing functions have any variable a body could capture.
+static bool
+can_capture(Parser *parser)
+{
+  for (Compiler *compiler = parser->compiler->enclosing; compiler != NULL;
+      compiler = compiler->enclosing) {
+    if (compiler->local_count > 1
+        || compiler->type == TYPE_METHOD
+        || compiler->type == TYPE_INITIALIZER
+        || (compiler->captured != NULL && compiler->captured->count > 0))
+      return true;
+  }
+  return false;
+}
+
+// Without variables to capture, the body only needs its braces matched,
+// which the scanner does without making tokens.
+static void
+block_skip(Parser *parser)
+{
+  int depth = 1;
+  if (check(parser, TOKEN_LEFT_BRACE))
+    depth++;
+  else if (check(parser, TOKEN_RIGHT_BRACE)) {
+    advance(parser);
+    return;
+  } else if (check(parser, TOKEN_EOF)) {
+    error_at_current(parser, "Expect '}' after block.");
+    return;
+  }
+  parser->current = scanner_skip_block(&parser->scanner, depth);
+  if (parser->current.type == TOKEN_ERROR)
+    error_at_current(parser, parser->current.start);
+  else if (parser->current.type == TOKEN_EOF)
+    error_at_current(parser, "Expect '}' after block.");
+  else
+    advance(parser);
+}
+
+// Skips the body of the function being compiled and records where it is to
+// compile it on the first call. Every variable of the enclosing functions
+// named in the body is captured, which costs an extra upvalue when the body
+// declares a local of the same name.
+static void
+body_skip(Parser *parser, FunctionType type, const char *start, int line)
+{
+  LazyBody *lazy = ALLOCATE(parser->vm, LazyBody, 1);
+  lazy->source = parser->lazy_source;
+  lazy->start = (int) (start - parser->lazy_source->chars);
+  lazy->length = 0;
+  lazy->line = line;
+  lazy->type = (uint8_t) type;
+  lazy->in_class = parser->class_compiler != NULL;
+  lazy->has_superclass = parser->class_compiler != NULL
+    && parser->class_compiler->has_superclass;
+  lazy->failed = false;
+  value_array_init(&lazy->upvalue_names);
+  parser->compiler->function->lazy = lazy;
+  if (!can_capture(parser)) {
+    block_skip(parser);
+    lazy->length = (int) (parser->previous.start + parser->previous.length
+        - start);
+    return;
+  }
+  CaptureCache cache;
+  memset(&cache, 0, sizeof(cache));
+  for (int depth = 1; depth > 0;) {
+    if (check(parser, TOKEN_EOF)) {
+      error_at_current(parser, "Expect '}' after block.");
+      return;
+    }
+    TokenType before = parser->previous.type;
+    Token token = parser->current;
+    advance(parser);
+    if (token.type == TOKEN_LEFT_BRACE)
+      depth++;
+    else if (token.type == TOKEN_RIGHT_BRACE)
+      depth--;
+    else if ((token.type == TOKEN_IDENTIFIER || token.type == TOKEN_THIS
+          || token.type == TOKEN_SUPER) && before != TOKEN_DOT
+        && capture_cached(parser, &token, &cache) != -1
+        && check(parser, TOKEN_EQUAL)) {
+      // The enclosing functions cannot tell when the closure runs.
+      for (Compiler *compiler = parser->compiler->enclosing; compiler != NULL;
+          compiler = compiler->enclosing)
+        types_forget(compiler);
+    }
+  }
+  lazy->length = (int) (parser->previous.start + parser->previous.length
+      - start);
+}
+
+static void
+function(Parser *parser, FunctionType type)
+{
+  const char *start = parser->previous.start;
+  int line = parser->previous.line;
+  Compiler compiler;
+  compiler_init(parser, &compiler, type);
+  scope_begin(parser);
+  parameters(parser);
+  ObjFunction *function;
+  if (parser->lazy_source != NULL) {
+    body_skip(parser, type, start, line);
+    function = parser->compiler->function;
+    map_free(parser->vm, &parser->compiler->constants);
+    parser->compiler = parser->compiler->enclosing;
+  } else {
+    block(parser);
+    function = compiler_end(parser);
+  }
+  emit_constant_op(parser, OP_CLOSURE,
+      make_constant(parser, OBJ_VAL(function)));
   for (int i = 0; i < function->upvalue_count; ++i) {
-    emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
-    emit_byte(compiler.upvalues[i].index);
+    emit_byte(parser, compiler.upvalues[i].is_local ? 1 : 0);
+    emit_byte(parser, compiler.upvalues[i].index);
   }
 }
 
 static void
-method()
+method(Parser *parser)
 {
-  consume(TOKEN_IDENTIFIER, "Expect method name.");
-  uint8_t constant = identifier_constant(&parser.previous);
+  consume(parser, TOKEN_IDENTIFIER, "Expect method name.");
+  uint32_t constant = identifier_constant(parser, &parser->previous);
   FunctionType type = TYPE_METHOD;
-  if (parser.previous.length == 4
-      && memcmp(parser.previous.start, "init", 4) == 0)
+  if (parser->previous.length == 4
+      && memcmp(parser->previous.start, "init", 4) == 0)
     type = TYPE_INITIALIZER;
-  function(type);
-  emit_bytes(OP_METHOD, constant);
+  function(parser, type);
+  emit_constant_op(parser, OP_METHOD, constant);
 }
 
 static void
-class_declaration()
-{
-  consume(TOKEN_IDENTIFIER, "Expect class name.");
-  Token class_name = parser.previous;
-  uint8_t name_constant = identifier_constant(&parser.previous);
-  declare_variable();
-  emit_bytes(OP_CLASS, name_constant);
-  define_variable(name_constant);
+class_declaration(Parser *parser)
+{
+  consume(parser, TOKEN_IDENTIFIER, "Expect class name.");
+  Token class_name = parser->previous;
+  uint32_t name_constant = identifier_constant(parser, &parser->previous);
+  declare_variable(parser);
+  emit_constant_op(parser, OP_CLASS, name_constant);
+  define_variable(parser, name_constant);
   ClassCompiler class_compiler;
-  class_compiler.enclosing = current_class;
+  class_compiler.enclosing = parser->class_compiler;
   class_compiler.has_superclass = false;
-  current_class = &class_compiler;
-  if (match(TOKEN_LESS)) {
-    consume(TOKEN_IDENTIFIER, "Expect superclass name.");
-    variable(false);
-    if (identifiers_equal(&class_name, &parser.previous))
-      error("A class can't inherit from itself.");
-    scope_begin();
-    add_local(synthetic_token("super"));
-    define_variable(0);
-    named_variable(class_name, false);
-    emit_byte(OP_INHERIT);
+  parser->class_compiler = &class_compiler;
+  if (match(parser, TOKEN_LESS)) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect superclass name.");
+    variable(parser, false);
+    if (identifiers_equal(&class_name, &parser->previous))
+      error(parser, "A class can't inherit from itself.");
+    scope_begin(parser);
+    add_local(parser, synthetic_token("super"));
+    define_variable(parser, 0);
+    named_variable(parser, class_name, false);
+    emit_byte(parser, OP_INHERIT);
     class_compiler.has_superclass = true;
   }
-  named_variable(class_name, false);
-  consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
-  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
-    method();
-  consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
-  emit_byte(OP_POP);
+  named_variable(parser, class_name, false);
+  consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+  while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF))
+    method(parser);
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+  emit_byte(parser, OP_POP);
   if (class_compiler.has_superclass)
-    scope_end();
-  current_class = current_class->enclosing;
+    scope_end(parser);
+  parser->class_compiler = parser->class_compiler->enclosing;
 }
 
 static void
-fun_declaration()
+fun_declaration(Parser *parser)
 {
-  uint8_t global = parse_variable("Expect function name.");
-  mark_initialized();
-  function(TYPE_FUNCTION);
-  define_variable(global);
+  uint32_t global = parse_variable(parser, "Expect function name.");
+  mark_initialized(parser);
+  function(parser, TYPE_FUNCTION);
+  define_variable(parser, global);
 }
 
 static void
-var_declaration()
+var_declaration(Parser *parser)
 {
-  uint8_t global = parse_variable("Expect variable name.");
-  if (match(TOKEN_EQUAL))
-    expression();
-  else
-    emit_byte(OP_NIL);
-  consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
-  define_variable(global);
+  uint32_t global = parse_variable(parser, "Expect variable name.");
+  if (match(parser, TOKEN_EQUAL))
+    expression(parser);
+  else {
+    emit_byte(parser, OP_NIL);
+    parser->compiler->expr_type = EXPR_ANY;
+  }
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+  if (parser->compiler->scope_depth > 0)
+    parser->compiler->locals[parser->compiler->local_count - 1].is_number =
+      parser->compiler->expr_type == EXPR_NUMBER;
+  define_variable(parser, global);
 }
 
 static void
-expression_statement()
+expression_statement(Parser *parser)
 {
-  expression();
-  consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-  emit_byte(OP_POP);
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+  emit_byte(parser, OP_POP);
 }
 
 static void
-for_statement()
+for_statement(Parser *parser)
 {
-  scope_begin();
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-  if (match(TOKEN_SEMICOLON)) {
+  scope_begin(parser);
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+  if (match(parser, TOKEN_SEMICOLON)) {
     // No initializer.
-  } else if (match(TOKEN_VAR))
-    var_declaration();
+  } else if (match(parser, TOKEN_VAR))
+    var_declaration(parser);
   else
-    expression_statement();
-  int loop_start = current_chunk()->count;
+    expression_statement(parser);
+  int loop_start = current_chunk(parser)->count;
   int exit_jump = -1;
-  if (!match(TOKEN_SEMICOLON)) {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
-    exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
-  }
-  if (!match(TOKEN_RIGHT_PAREN)) {
-    int body_jump = emit_jump(OP_JUMP);
-    int increment_start = current_chunk()->count;
-    expression();
-    emit_byte(OP_POP);
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
-    emit_loop(loop_start);
+  if (!match(parser, TOKEN_SEMICOLON)) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+    exit_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+    emit_byte(parser, OP_POP);
+  }
+  if (!match(parser, TOKEN_RIGHT_PAREN)) {
+    int body_jump = emit_jump(parser, OP_JUMP);
+    int increment_start = current_chunk(parser)->count;
+    expression(parser);
+    emit_byte(parser, OP_POP);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+    emit_loop(parser, loop_start);
     loop_start = increment_start;
-    patch_jump(body_jump);
+    patch_jump(parser, body_jump);
   }
-  statement();
-  emit_loop(loop_start);
+  statement(parser);
+  emit_loop(parser, loop_start);
   if (exit_jump != -1) {
-    patch_jump(exit_jump);
-    emit_byte(OP_POP);
+    patch_jump(parser, exit_jump);
+    emit_byte(parser, OP_POP);
   }
-  scope_end();
+  scope_end(parser);
 }
 
 static void
-if_statement()
-{
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
-  int then_jump = emit_jump(OP_JUMP_IF_FALSE);
-  emit_byte(OP_POP);
-  statement();
-  int else_jump = emit_jump(OP_JUMP);
-  patch_jump(then_jump);
-  emit_byte(OP_POP);
-  if (match(TOKEN_ELSE))
-    statement();
-  patch_jump(else_jump);
+if_statement(Parser *parser)
+{
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+  int then_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+  emit_byte(parser, OP_POP);
+  statement(parser);
+  int else_jump = emit_jump(parser, OP_JUMP);
+  patch_jump(parser, then_jump);
+  emit_byte(parser, OP_POP);
+  if (match(parser, TOKEN_ELSE))
+    statement(parser);
+  patch_jump(parser, else_jump);
 }
 
 static void
-print_statement()
+print_statement(Parser *parser)
 {
-  expression();
-  consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-  emit_byte(OP_PRINT);
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+  emit_byte(parser, OP_PRINT);
 }
 
 static void
-return_statement()
+return_statement(Parser *parser)
 {
-  if (current->type == TYPE_SCRIPT)
-    error("Can't return from top-level code.");
-  if (match(TOKEN_SEMICOLON))
-    emit_return();
+  if (parser->compiler->type == TYPE_SCRIPT)
+    error(parser, "Can't return from top-level code.");
+  if (match(parser, TOKEN_SEMICOLON))
+    emit_return(parser);
   else {
-    if (current->type == TYPE_INITIALIZER)
-      error("Can't return a value from an initializer.");
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-    emit_byte(OP_RETURN);
+    if (parser->compiler->type == TYPE_INITIALIZER)
+      error(parser, "Can't return a value from an initializer.");
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+    emit_byte(parser, OP_RETURN);
   }
 }
 
 static void
-while_statement()
+while_statement(Parser *parser)
 {
-  int loop_start = current_chunk()->count;
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
-  int exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-  emit_byte(OP_POP);
-  statement();
-  emit_loop(loop_start);
-  patch_jump(exit_jump);
-  emit_byte(OP_POP);
+  int loop_start = current_chunk(parser)->count;
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+  int exit_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+  emit_byte(parser, OP_POP);
+  statement(parser);
+  emit_loop(parser, loop_start);
+  patch_jump(parser, exit_jump);
+  emit_byte(parser, OP_POP);
 }
 
 static void
-synchronize()
+synchronize(Parser *parser)
 {
-  parser.panic_mode = false;
-  while (parser.current.type != TOKEN_EOF) {
-    if (parser.previous.type == TOKEN_SEMICOLON)
+  parser->panic_mode = false;
+  while (parser->current.type != TOKEN_EOF) {
+    if (parser->previous.type == TOKEN_SEMICOLON)
       return;
-    switch (parser.current.type) {
+    switch (parser->current.type) {
     case TOKEN_CLASS:
     case TOKEN_FUN:
     case TOKEN_VAR:
@@ -943,67 +1395,133 @@ synchronize()
     default:
       ; // Do nothing.
     }
-    advance();
+    advance(parser);
   }
 }
 
 static void
-declaration()
-{
-  if (match(TOKEN_CLASS))
-    class_declaration();
-  else if (match(TOKEN_FUN))
-    fun_declaration();
-  else if (match(TOKEN_VAR))
-    var_declaration();
+declaration(Parser *parser)
+{
+  if (match(parser, TOKEN_CLASS))
+    class_declaration(parser);
+  else if (match(parser, TOKEN_FUN))
+    fun_declaration(parser);
+  else if (match(parser, TOKEN_VAR))
+    var_declaration(parser);
   else
-    statement();
-  if (parser.panic_mode)
-    synchronize();
-}
-
-static void
-statement()
-{
-  if (match(TOKEN_PRINT))
-    print_statement();
-  else if (match(TOKEN_FOR))
-    for_statement();
-  else if (match(TOKEN_IF))
-    if_statement();
-  else if (match(TOKEN_RETURN))
-    return_statement();
-  else if (match(TOKEN_WHILE))
-    while_statement();
-  else if (match(TOKEN_LEFT_BRACE)) {
-    scope_begin();
-    block();
-    scope_end();
+    statement(parser);
+  if (parser->panic_mode)
+    synchronize(parser);
+}
+
+static void
+statement(Parser *parser)
+{
+  if (match(parser, TOKEN_PRINT))
+    print_statement(parser);
+  else if (match(parser, TOKEN_FOR))
+    for_statement(parser);
+  else if (match(parser, TOKEN_IF))
+    if_statement(parser);
+  else if (match(parser, TOKEN_RETURN))
+    return_statement(parser);
+  else if (match(parser, TOKEN_WHILE))
+    while_statement(parser);
+  else if (match(parser, TOKEN_LEFT_BRACE)) {
+    scope_begin(parser);
+    block(parser);
+    scope_end(parser);
   } else
-    expression_statement();
+    expression_statement(parser);
+}
+
+// Starts a compilation of the source and makes its functions roots.
+static void
+parser_begin(Parser *parser, VM *vm, const char *source, size_t length,
+    int line)
+{
+  parser->vm = vm;
+  scanner_init(&parser->scanner, source, length, line);
+  parser->had_error = false;
+  parser->panic_mode = false;
+  parser->compiler = NULL;
+  parser->class_compiler = NULL;
+  parser->lazy_source = NULL;
+  vm->parser = parser;
 }
 
 ObjFunction *
-compile(const char *source)
+compile(VM *vm, const char *source, size_t length)
+{
+  Parser parser;
+  parser_begin(&parser, vm, source, length, 1);
+  if (vm->lazy_compile && length <= INT32_MAX) {
+    parser.lazy_source = allocate_string(vm, (int) length);
+    memcpy(parser.lazy_source->chars, source, length);
+    scanner_init(&parser.scanner, parser.lazy_source->chars, length, 1);
+  }
+  Compiler compiler;
+  compiler_init(&parser, &compiler, TYPE_SCRIPT);
+  advance(&parser);
+  while (!match(&parser, TOKEN_EOF))
+    declaration(&parser);
+  ObjFunction *function = compiler_end(&parser);
+  vm->parser = NULL;
+  if (parser.had_error)
+    return NULL;
+  arena_pack_script(vm, function);
+  return function;
+}
+
+// Compiles a function skipped by body_skip from its recorded source. The
+// name and parameters are parsed again, and the chunk compiled into a new
+// function replaces the empty one. Once a body has failed, later calls fail
+// without reporting its errors again.
+bool
+compile_function(VM *vm, ObjFunction *function)
 {
-  scanner_init(source);
+  LazyBody *lazy = function->lazy;
+  if (lazy->failed)
+    return false;
+  Parser parser;
+  parser_begin(&parser, vm, lazy->source->chars + lazy->start, lazy->length,
+      lazy->line);
+  parser.lazy_source = lazy->source;
+  ClassCompiler class_compiler;
+  class_compiler.enclosing = NULL;
+  class_compiler.has_superclass = lazy->has_superclass;
+  parser.class_compiler = lazy->in_class ? &class_compiler : NULL;
+  advance(&parser);
+  advance(&parser);
   Compiler compiler;
-  compiler_init(&compiler, TYPE_SCRIPT);
-  parser.had_error = false;
-  parser.panic_mode = false;
-  advance();
-  while (!match(TOKEN_EOF))
-    declaration();
-  ObjFunction *function = compiler_end();
-  return parser.had_error ? NULL : function;
+  compiler_init(&parser, &compiler, (FunctionType) lazy->type);
+  compiler.captured = &lazy->upvalue_names;
+  scope_begin(&parser);
+  parameters(&parser);
+  block(&parser);
+  ObjFunction *compiled = compiler_end(&parser);
+  vm->parser = NULL;
+  if (parser.had_error) {
+    lazy->failed = true;
+    return false;
+  }
+  function->chunk = compiled->chunk;
+  chunk_init(&compiled->chunk);
+  value_array_free(vm, &lazy->upvalue_names);
+  FREE(vm, LazyBody, lazy);
+  function->lazy = NULL;
+  return true;
 }
 
 void
-compiler_mark_roots()
+compiler_mark_roots(VM *vm)
 {
-  Compiler *compiler = current;
+  if (vm->parser == NULL)
+    return;
+  object_mark(vm, (Obj *) vm->parser->lazy_source);
+  Compiler *compiler = vm->parser->compiler;
   while (compiler != NULL) {
-    object_mark((Obj *) compiler->function);
+    object_mark(vm, (Obj *) compiler->function);
     compiler = compiler->enclosing;
   }
 }
@@ -5,9 +5,12 @@
 #include "vm.h"
 
 ObjFunction *
-compile(const char *source);
+compile(VM *vm, const char *source, size_t length);
+
+bool
+compile_function(VM *vm, ObjFunction *function);
 
 void
-compiler_mark_roots();
+compiler_mark_roots(VM *vm);
 
 #endif
@@ -33,6 +33,50 @@ invoke_instruction(const char *name, Chunk *chunk, int offset)
   return offset + 3;
 }
 
+static uint32_t
+read_long(Chunk *chunk, int offset)
+{
+  return (uint32_t) ((chunk->code[offset] << 16)
+      | (chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+}
+
+static int
+constant_long_instruction(const char *name, Chunk *chunk, int offset)
+{
+  uint32_t constant = read_long(chunk, offset + 1);
+  printf("%-16s %4u '", name, constant);
+  value_print(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 4;
+}
+
+static int
+invoke_long_instruction(const char *name, Chunk *chunk, int offset)
+{
+  uint32_t constant = read_long(chunk, offset + 1);
+  uint8_t arg_count = chunk->code[offset + 4];
+  printf("%-16s (%u args) %4u '", name, arg_count, constant);
+  value_print(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 5;
+}
+
+static int
+closure_instruction(const char *name, uint32_t constant, Chunk *chunk,
+    int offset)
+{
+  printf("%-16s %4u ", name, constant);
+  value_print(chunk->constants.values[constant]);
+  printf("\n");
+  ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+  for (int i = 0; i < function->upvalue_count; ++i) {
+    uint8_t is_local = chunk->code[offset++];
+    uint8_t index = chunk->code[offset++];
+    printf("%04d | %s %d\n", offset - 2, is_local ? "local" : "upvalue", index);
+  }
+  return offset;
+}
+
 static int
 simple_instruction(const char *name, int offset)
 {
@@ -57,14 +101,23 @@ jump_instruction(const char *name, int sign, Chunk *chunk, int offset)
   return offset + 3;
 }
 
+static int
+loop_short_instruction(const char *name, Chunk *chunk, int offset)
+{
+  uint8_t jump = chunk->code[offset + 1];
+  printf("%-16s %4d -> %d\n", name, offset, offset + 2 - jump);
+  return offset + 2;
+}
+
 int
 disassemble_instruction(Chunk *chunk, int offset)
 {
   printf("%04d ", offset);
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
+  int line = chunk_get_line(chunk, offset);
+  if (offset > 0 && line == chunk_get_line(chunk, offset - 1))
     printf("   | ");
   else
-    printf("%4d ", chunk->lines[offset]);
+    printf("%4d ", line);
   uint8_t instruction = chunk->code[offset];
   switch (instruction) {
   case OP_CONSTANT:
@@ -97,6 +150,10 @@ disassemble_instruction(Chunk *chunk, int offset)
     return constant_instruction("OP_SET_PROPERTY", chunk, offset);
   case OP_GET_SUPER:
     return constant_instruction("OP_GET_SUPER", chunk, offset);
+  case OP_INDEX_GET:
+    return simple_instruction("OP_INDEX_GET", offset);
+  case OP_INDEX_SET:
+    return simple_instruction("OP_INDEX_SET", offset);
   case OP_EQUAL:
     return simple_instruction("OP_EQUAL", offset);
   case OP_GREATER:
@@ -115,6 +172,20 @@ disassemble_instruction(Chunk *chunk, int offset)
     return simple_instruction("OP_NOT", offset);
   case OP_NEGATE:
     return simple_instruction("OP_NEGATE", offset);
+  case OP_GREATER_NUMBER:
+    return simple_instruction("OP_GREATER_NUMBER", offset);
+  case OP_LESS_NUMBER:
+    return simple_instruction("OP_LESS_NUMBER", offset);
+  case OP_ADD_NUMBER:
+    return simple_instruction("OP_ADD_NUMBER", offset);
+  case OP_SUBTRACT_NUMBER:
+    return simple_instruction("OP_SUBTRACT_NUMBER", offset);
+  case OP_MULTIPLY_NUMBER:
+    return simple_instruction("OP_MULTIPLY_NUMBER", offset);
+  case OP_DIVIDE_NUMBER:
+    return simple_instruction("OP_DIVIDE_NUMBER", offset);
+  case OP_NEGATE_NUMBER:
+    return simple_instruction("OP_NEGATE_NUMBER", offset);
   case OP_PRINT:
     return simple_instruction("OP_PRINT", offset);
   case OP_JUMP:
@@ -123,26 +194,17 @@ disassemble_instruction(Chunk *chunk, int offset)
     return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
   case OP_LOOP:
     return jump_instruction("OP_LOOP", -1, chunk, offset);
+  case OP_LOOP_SHORT:
+    return loop_short_instruction("OP_LOOP_SHORT", chunk, offset);
   case OP_CALL:
     return byte_instruction("OP_CALL", chunk, offset);
   case OP_INVOKE:
     return invoke_instruction("OP_INVOKE", chunk, offset);
   case OP_SUPER_INVOKE:
     return invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
-  case OP_CLOSURE: {
-    offset++;
-    uint8_t constant = chunk->code[offset++];
-    printf("%-16s %4d ", "OP_CLOSURE", constant);
-    value_print(chunk->constants.values[constant]);
-    printf("\n");
-    ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
-    for (int i = 0; i < function->upvalue_count; ++i) {
-      uint8_t is_local = chunk->code[offset++];
-      uint8_t index = chunk->code[offset++];
-      printf("%04d | %s %d\n", offset - 2, is_local ? "local" : "upvalue", index);
-    }
-    return offset;
-  }
+  case OP_CLOSURE:
+    return closure_instruction("OP_CLOSURE", chunk->code[offset + 1], chunk,
+        offset + 2);
   case OP_CLOSE_UPVALUE:
     return simple_instruction("OP_CLOSE_UPVALUE", offset);
   case OP_RETURN:
@@ -153,6 +215,35 @@ disassemble_instruction(Chunk *chunk, int offset)
     return simple_instruction("OP_INHERIT", offset);
   case OP_METHOD:
     return constant_instruction("OP_METHOD", chunk, offset);
+  case OP_ARRAY:
+    return byte_instruction("OP_ARRAY", chunk, offset);
+  case OP_MAP:
+    return byte_instruction("OP_MAP", chunk, offset);
+  case OP_CONSTANT_LONG:
+    return constant_long_instruction("OP_CONSTANT_LONG", chunk, offset);
+  case OP_GET_GLOBAL_LONG:
+    return constant_long_instruction("OP_GET_GLOBAL_LONG", chunk, offset);
+  case OP_DEFINE_GLOBAL_LONG:
+    return constant_long_instruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+  case OP_SET_GLOBAL_LONG:
+    return constant_long_instruction("OP_SET_GLOBAL_LONG", chunk, offset);
+  case OP_GET_PROPERTY_LONG:
+    return constant_long_instruction("OP_GET_PROPERTY_LONG", chunk, offset);
+  case OP_SET_PROPERTY_LONG:
+    return constant_long_instruction("OP_SET_PROPERTY_LONG", chunk, offset);
+  case OP_GET_SUPER_LONG:
+    return constant_long_instruction("OP_GET_SUPER_LONG", chunk, offset);
+  case OP_INVOKE_LONG:
+    return invoke_long_instruction("OP_INVOKE_LONG", chunk, offset);
+  case OP_SUPER_INVOKE_LONG:
+    return invoke_long_instruction("OP_SUPER_INVOKE_LONG", chunk, offset);
+  case OP_CLOSURE_LONG:
+    return closure_instruction("OP_CLOSURE_LONG", read_long(chunk, offset + 1),
+        chunk, offset + 4);
+  case OP_CLASS_LONG:
+    return constant_long_instruction("OP_CLASS_LONG", chunk, offset);
+  case OP_METHOD_LONG:
+    return constant_long_instruction("OP_METHOD_LONG", chunk, offset);
   default:
     printf("Unknown opcode %u\n", instruction);
     return offset + 1;
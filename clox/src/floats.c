@@ -0,0 +1,459 @@
+#include "floats.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FLOATS_AVX2
+#include <immintrin.h>
+#define AVX2 __attribute__((target("avx2")))
+#endif
+
+typedef struct {
+  void (*fill)(double *dest, int count, double value);
+  void (*add)(double *dest, const double *src, int count);
+  void (*mul)(double *dest, const double *src, int count);
+  void (*scale)(double *dest, int count, double factor);
+  double (*dot)(const double *a, const double *b, int count);
+  double (*sum)(const double *src, int count);
+  double (*min)(const double *src, int count);
+  double (*max)(const double *src, int count);
+  void (*prefix_sum)(double *dest, int count);
+} Kernels;
+
+static void
+fill_scalar(double *dest, int count, double value)
+{
+  for (int i = 0; i < count; ++i)
+    dest[i] = value;
+}
+
+static void
+add_scalar(double *dest, const double *src, int count)
+{
+  for (int i = 0; i < count; ++i)
+    dest[i] += src[i];
+}
+
+static void
+mul_scalar(double *dest, const double *src, int count)
+{
+  for (int i = 0; i < count; ++i)
+    dest[i] *= src[i];
+}
+
+static void
+scale_scalar(double *dest, int count, double factor)
+{
+  for (int i = 0; i < count; ++i)
+    dest[i] *= factor;
+}
+
+static double
+dot_scalar(const double *a, const double *b, int count)
+{
+  double result = 0;
+  for (int i = 0; i < count; ++i)
+    result += a[i] * b[i];
+  return result;
+}
+
+static double
+sum_scalar(const double *src, int count)
+{
+  double result = 0;
+  for (int i = 0; i < count; ++i)
+    result += src[i];
+  return result;
+}
+
+// The comparisons match those of the vector min and max instructions.
+static double
+min_scalar(const double *src, int count)
+{
+  double result = src[0];
+  for (int i = 1; i < count; ++i)
+    result = src[i] < result ? src[i] : result;
+  return result;
+}
+
+static double
+max_scalar(const double *src, int count)
+{
+  double result = src[0];
+  for (int i = 1; i < count; ++i)
+    result = src[i] > result ? src[i] : result;
+  return result;
+}
+
+// Without SSE2 the scalar kernels are the only ones. Otherwise the SSE2 and
+// AVX2 kernels only use them for their tails.
+#ifndef __SSE2__
+static void
+prefix_sum_scalar(double *dest, int count)
+{
+  for (int i = 1; i < count; ++i)
+    dest[i] += dest[i - 1];
+}
+
+static const Kernels scalar_kernels = {
+  fill_scalar, add_scalar, mul_scalar, scale_scalar, dot_scalar, sum_scalar,
+  min_scalar, max_scalar, prefix_sum_scalar,
+};
+#endif
+
+#ifdef __SSE2__
+
+static void
+fill_sse2(double *dest, int count, double value)
+{
+  __m128d v = _mm_set1_pd(value);
+  int i = 0;
+  for (; i + 2 <= count; i += 2)
+    _mm_storeu_pd(dest + i, v);
+  fill_scalar(dest + i, count - i, value);
+}
+
+static void
+add_sse2(double *dest, const double *src, int count)
+{
+  int i = 0;
+  for (; i + 2 <= count; i += 2)
+    _mm_storeu_pd(dest + i,
+        _mm_add_pd(_mm_loadu_pd(dest + i), _mm_loadu_pd(src + i)));
+  add_scalar(dest + i, src + i, count - i);
+}
+
+static void
+mul_sse2(double *dest, const double *src, int count)
+{
+  int i = 0;
+  for (; i + 2 <= count; i += 2)
+    _mm_storeu_pd(dest + i,
+        _mm_mul_pd(_mm_loadu_pd(dest + i), _mm_loadu_pd(src + i)));
+  mul_scalar(dest + i, src + i, count - i);
+}
+
+static void
+scale_sse2(double *dest, int count, double factor)
+{
+  __m128d f = _mm_set1_pd(factor);
+  int i = 0;
+  for (; i + 2 <= count; i += 2)
+    _mm_storeu_pd(dest + i, _mm_mul_pd(_mm_loadu_pd(dest + i), f));
+  scale_scalar(dest + i, count - i, factor);
+}
+
+static double
+horizontal_sum_sse2(__m128d v)
+{
+  return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+// Two accumulators hide the latency of the additions.
+static double
+dot_sse2(const double *a, const double *b, int count)
+{
+  __m128d acc0 = _mm_setzero_pd();
+  __m128d acc1 = _mm_setzero_pd();
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    acc0 = _mm_add_pd(acc0,
+        _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    acc1 = _mm_add_pd(acc1,
+        _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+  }
+  return horizontal_sum_sse2(_mm_add_pd(acc0, acc1))
+    + dot_scalar(a + i, b + i, count - i);
+}
+
+static double
+sum_sse2(const double *src, int count)
+{
+  __m128d acc0 = _mm_setzero_pd();
+  __m128d acc1 = _mm_setzero_pd();
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    acc0 = _mm_add_pd(acc0, _mm_loadu_pd(src + i));
+    acc1 = _mm_add_pd(acc1, _mm_loadu_pd(src + i + 2));
+  }
+  return horizontal_sum_sse2(_mm_add_pd(acc0, acc1))
+    + sum_scalar(src + i, count - i);
+}
+
+static double
+min_sse2(const double *src, int count)
+{
+  if (count < 2)
+    return min_scalar(src, count);
+  __m128d acc = _mm_loadu_pd(src);
+  int i = 2;
+  for (; i + 2 <= count; i += 2)
+    acc = _mm_min_pd(_mm_loadu_pd(src + i), acc);
+  double lanes[2];
+  _mm_storeu_pd(lanes, acc);
+  double result = min_scalar(lanes, 2);
+  for (; i < count; ++i)
+    result = src[i] < result ? src[i] : result;
+  return result;
+}
+
+static double
+max_sse2(const double *src, int count)
+{
+  if (count < 2)
+    return max_scalar(src, count);
+  __m128d acc = _mm_loadu_pd(src);
+  int i = 2;
+  for (; i + 2 <= count; i += 2)
+    acc = _mm_max_pd(_mm_loadu_pd(src + i), acc);
+  double lanes[2];
+  _mm_storeu_pd(lanes, acc);
+  double result = max_scalar(lanes, 2);
+  for (; i < count; ++i)
+    result = src[i] > result ? src[i] : result;
+  return result;
+}
+
+// Each pair is scanned in the register, [a, b] becoming [a, a + b], and the
+// running total is added to both lanes.
+static void
+prefix_sum_sse2(double *dest, int count)
+{
+  __m128d carry = _mm_setzero_pd();
+  int i = 0;
+  for (; i + 2 <= count; i += 2) {
+    __m128d v = _mm_loadu_pd(dest + i);
+    v = _mm_add_pd(v, _mm_unpacklo_pd(_mm_setzero_pd(), v));
+    v = _mm_add_pd(v, carry);
+    _mm_storeu_pd(dest + i, v);
+    carry = _mm_unpackhi_pd(v, v);
+  }
+  if (i < count)
+    dest[i] += _mm_cvtsd_f64(carry);
+}
+
+static const Kernels sse2_kernels = {
+  fill_sse2, add_sse2, mul_sse2, scale_sse2, dot_sse2, sum_sse2, min_sse2,
+  max_sse2, prefix_sum_sse2,
+};
+
+#endif
+
+#ifdef FLOATS_AVX2
+
+AVX2 static void
+fill_avx2(double *dest, int count, double value)
+{
+  __m256d v = _mm256_set1_pd(value);
+  int i = 0;
+  for (; i + 4 <= count; i += 4)
+    _mm256_storeu_pd(dest + i, v);
+  fill_scalar(dest + i, count - i, value);
+}
+
+AVX2 static void
+add_avx2(double *dest, const double *src, int count)
+{
+  int i = 0;
+  for (; i + 4 <= count; i += 4)
+    _mm256_storeu_pd(dest + i,
+        _mm256_add_pd(_mm256_loadu_pd(dest + i), _mm256_loadu_pd(src + i)));
+  add_scalar(dest + i, src + i, count - i);
+}
+
+AVX2 static void
+mul_avx2(double *dest, const double *src, int count)
+{
+  int i = 0;
+  for (; i + 4 <= count; i += 4)
+    _mm256_storeu_pd(dest + i,
+        _mm256_mul_pd(_mm256_loadu_pd(dest + i), _mm256_loadu_pd(src + i)));
+  mul_scalar(dest + i, src + i, count - i);
+}
+
+AVX2 static void
+scale_avx2(double *dest, int count, double factor)
+{
+  __m256d f = _mm256_set1_pd(factor);
+  int i = 0;
+  for (; i + 4 <= count; i += 4)
+    _mm256_storeu_pd(dest + i, _mm256_mul_pd(_mm256_loadu_pd(dest + i), f));
+  scale_scalar(dest + i, count - i, factor);
+}
+
+AVX2 static double
+horizontal_sum_avx2(__m256d v)
+{
+  __m128d pair = _mm_add_pd(_mm256_castpd256_pd128(v),
+      _mm256_extractf128_pd(v, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(pair, _mm_unpackhi_pd(pair, pair)));
+}
+
+// Multiplications and additions are kept separate rather than fused, so that
+// the result does not depend on whether the processor has FMA.
+AVX2 static double
+dot_avx2(const double *a, const double *b, int count)
+{
+  __m256d acc0 = _mm256_setzero_pd();
+  __m256d acc1 = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    acc0 = _mm256_add_pd(acc0,
+        _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    acc1 = _mm256_add_pd(acc1,
+        _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+  }
+  return horizontal_sum_avx2(_mm256_add_pd(acc0, acc1))
+    + dot_scalar(a + i, b + i, count - i);
+}
+
+AVX2 static double
+sum_avx2(const double *src, int count)
+{
+  __m256d acc0 = _mm256_setzero_pd();
+  __m256d acc1 = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(src + i));
+    acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(src + i + 4));
+  }
+  return horizontal_sum_avx2(_mm256_add_pd(acc0, acc1))
+    + sum_scalar(src + i, count - i);
+}
+
+AVX2 static double
+min_avx2(const double *src, int count)
+{
+  if (count < 4)
+    return min_scalar(src, count);
+  __m256d acc = _mm256_loadu_pd(src);
+  int i = 4;
+  for (; i + 4 <= count; i += 4)
+    acc = _mm256_min_pd(_mm256_loadu_pd(src + i), acc);
+  double lanes[4];
+  _mm256_storeu_pd(lanes, acc);
+  double result = min_scalar(lanes, 4);
+  for (; i < count; ++i)
+    result = src[i] < result ? src[i] : result;
+  return result;
+}
+
+AVX2 static double
+max_avx2(const double *src, int count)
+{
+  if (count < 4)
+    return max_scalar(src, count);
+  __m256d acc = _mm256_loadu_pd(src);
+  int i = 4;
+  for (; i + 4 <= count; i += 4)
+    acc = _mm256_max_pd(_mm256_loadu_pd(src + i), acc);
+  double lanes[4];
+  _mm256_storeu_pd(lanes, acc);
+  double result = max_scalar(lanes, 4);
+  for (; i < count; ++i)
+    result = src[i] > result ? src[i] : result;
+  return result;
+}
+
+// Scans four lanes in the register by adding the vector shifted up by one
+// lane and then by two, before adding the running total.
+AVX2 static void
+prefix_sum_avx2(double *dest, int count)
+{
+  __m256d zero = _mm256_setzero_pd();
+  __m256d carry = zero;
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m256d v = _mm256_loadu_pd(dest + i);
+    v = _mm256_add_pd(v, _mm256_blend_pd(
+        _mm256_permute4x64_pd(v, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0x1));
+    v = _mm256_add_pd(v, _mm256_blend_pd(
+        _mm256_permute4x64_pd(v, _MM_SHUFFLE(1, 0, 0, 0)), zero, 0x3));
+    v = _mm256_add_pd(v, carry);
+    _mm256_storeu_pd(dest + i, v);
+    carry = _mm256_permute4x64_pd(v, _MM_SHUFFLE(3, 3, 3, 3));
+  }
+  double total = _mm256_cvtsd_f64(carry);
+  for (; i < count; ++i)
+    total = dest[i] += total;
+}
+
+static const Kernels avx2_kernels = {
+  fill_avx2, add_avx2, mul_avx2, scale_avx2, dot_avx2, sum_avx2, min_avx2,
+  max_avx2, prefix_sum_avx2,
+};
+
+#endif
+
+// Every SSE2 target has the SSE2 kernels, so only AVX2 is left to detect.
+#ifdef __SSE2__
+static const Kernels *kernels = &sse2_kernels;
+#else
+static const Kernels *kernels = &scalar_kernels;
+#endif
+
+void
+floats_init()
+{
+  #ifdef FLOATS_AVX2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    kernels = &avx2_kernels;
+  #endif
+}
+
+void
+floats_fill(double *dest, int count, double value)
+{
+  kernels->fill(dest, count, value);
+}
+
+void
+floats_add(double *dest, const double *src, int count)
+{
+  kernels->add(dest, src, count);
+}
+
+void
+floats_mul(double *dest, const double *src, int count)
+{
+  kernels->mul(dest, src, count);
+}
+
+void
+floats_scale(double *dest, int count, double factor)
+{
+  kernels->scale(dest, count, factor);
+}
+
+double
+floats_dot(const double *a, const double *b, int count)
+{
+  return kernels->dot(a, b, count);
+}
+
+double
+floats_sum(const double *src, int count)
+{
+  return kernels->sum(src, count);
+}
+
+double
+floats_min(const double *src, int count)
+{
+  return kernels->min(src, count);
+}
+
+double
+floats_max(const double *src, int count)
+{
+  return kernels->max(src, count);
+}
+
+void
+floats_prefix_sum(double *dest, int count)
+{
+  kernels->prefix_sum(dest, count);
+}
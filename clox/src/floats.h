@@ -0,0 +1,43 @@
+#ifndef CLOX_FLOATS_H
+#define CLOX_FLOATS_H
+
+#include "common.h"
+
+// Bulk operations over buffers of raw doubles. Each one has a scalar, an SSE2
+// and an AVX2 version. The SSE2 ones are used wherever the compiler targets
+// SSE2, and floats_init, called once by the program before any VM runs,
+// switches to the AVX2 ones where the processor supports them. Sums are
+// accumulated in several lanes at once, so they may round differently from
+// a sequential loop. Min and max do not treat NaNs specially and need at
+// least one element.
+void
+floats_init();
+
+void
+floats_fill(double *dest, int count, double value);
+
+void
+floats_add(double *dest, const double *src, int count);
+
+void
+floats_mul(double *dest, const double *src, int count);
+
+void
+floats_scale(double *dest, int count, double factor);
+
+double
+floats_dot(const double *a, const double *b, int count);
+
+double
+floats_sum(const double *src, int count);
+
+double
+floats_min(const double *src, int count);
+
+double
+floats_max(const double *src, int count);
+
+void
+floats_prefix_sum(double *dest, int count);
+
+#endif
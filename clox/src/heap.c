@@ -0,0 +1,448 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+#include "memory.h"
+#include "vm.h"
+
+// The live and mark bitmaps follow the page header, sized for the number of
+// slots the page can hold.
+#define BITMAP_WORDS(slot_count) (((slot_count) + 63) / 64)
+#define PAGE_HEADER_SIZE(slot_count) \
+  (sizeof(Page) + 2 * sizeof(uint64_t) * BITMAP_WORDS(slot_count))
+
+static Page *
+page_of(Obj *object)
+{
+  return (Page *) ((uintptr_t) object & ~(uintptr_t) (HEAP_PAGE_SIZE - 1));
+}
+
+static size_t
+slot_index(Page *page, Obj *object)
+{
+  return (size_t) ((char *) object - page->slots) / page->slot_size;
+}
+
+static int
+count_bits(uint64_t word)
+{
+  #ifdef __GNUC__
+  return __builtin_popcountll(word);
+  #else
+  int count = 0;
+  for (; word != 0; word &= word - 1)
+    count++;
+  return count;
+  #endif
+}
+
+static int
+lowest_bit(uint64_t word)
+{
+  #ifdef __GNUC__
+  return __builtin_ctzll(word);
+  #else
+  int bit = 0;
+  while ((word & 1) == 0) {
+    word >>= 1;
+    bit++;
+  }
+  return bit;
+  #endif
+}
+
+static Page *
+page_new(size_t slot_size, int slot_count)
+{
+  size_t header_size = PAGE_HEADER_SIZE(slot_count);
+  void *memory;
+  if (posix_memalign(&memory, HEAP_PAGE_SIZE,
+        header_size + slot_size * slot_count) != 0)
+    exit(1);
+  Page *page = (Page *) memory;
+  page->next = NULL;
+  page->slot_size = slot_size;
+  page->slot_count = slot_count;
+  page->live_count = 0;
+  page->bump = 0;
+  page->is_swept = true;
+  page->is_evacuating = false;
+  page->free = NULL;
+  page->slots = (char *) memory + header_size;
+  page->marks = page->live + BITMAP_WORDS(slot_count);
+  for (int i = 0; i < BITMAP_WORDS(slot_count); ++i) {
+    page->live[i] = 0;
+    page->marks[i] = 0;
+  }
+  return page;
+}
+
+static void *
+page_take(Heap *heap, Page *page)
+{
+  void *slot;
+  if (page->free != NULL) {
+    slot = page->free;
+    page->free = *(void **) slot;
+  } else if (page->bump < page->slot_count)
+    slot = page->slots + page->bump++ * page->slot_size;
+  else
+    return NULL;
+  size_t index = slot_index(page, (Obj *) slot);
+  page->live[index / 64] |= (uint64_t) 1 << (index % 64);
+  page->live_count++;
+  heap->vm->bytes_allocated += page->slot_size;
+  return slot;
+}
+
+static void
+page_release(Heap *heap, Page *page, Obj *object)
+{
+  free_object(heap->vm, object);
+  *(void **) object = page->free;
+  page->free = object;
+  page->live_count--;
+  heap->vm->bytes_allocated -= page->slot_size;
+}
+
+// Frees every object the last collection left unmarked and clears the marks,
+// so that the page can be reused for allocation.
+static void
+page_sweep(Heap *heap, Page *page)
+{
+  int words = (page->bump + 63) / 64;
+  for (int i = 0; i < words; ++i) {
+    uint64_t dead = page->live[i] & ~page->marks[i];
+    while (dead != 0) {
+      int bit = lowest_bit(dead);
+      dead &= dead - 1;
+      page_release(heap, page, (Obj *) (page->slots
+          + (size_t) (i * 64 + bit) * page->slot_size));
+    }
+    page->live[i] &= page->marks[i];
+    page->marks[i] = 0;
+  }
+  page->is_swept = true;
+}
+
+static void
+page_free(Heap *heap, Page *page)
+{
+  int words = (page->bump + 63) / 64;
+  for (int i = 0; i < words; ++i) {
+    uint64_t live = page->live[i];
+    while (live != 0) {
+      int bit = lowest_bit(live);
+      live &= live - 1;
+      page_release(heap, page, (Obj *) (page->slots
+          + (size_t) (i * 64 + bit) * page->slot_size));
+    }
+  }
+  free(page);
+}
+
+void
+heap_init(Heap *heap, VM *vm)
+{
+  heap->vm = vm;
+  for (int i = 0; i < HEAP_SIZE_CLASSES; ++i) {
+    heap->classes[i].pages = NULL;
+    heap->classes[i].tail = NULL;
+    heap->classes[i].cursor = NULL;
+  }
+  heap->large = NULL;
+  heap->evacuating = NULL;
+}
+
+static void *
+allocate_large(Heap *heap, size_t size)
+{
+  size_t slot_size = (size + HEAP_GRANULE - 1) / HEAP_GRANULE * HEAP_GRANULE;
+  Page *page = page_new(slot_size, 1);
+  page->next = heap->large;
+  heap->large = page;
+  return page_take(heap, page);
+}
+
+static int
+size_class(size_t size, size_t *slot_size)
+{
+  if (size <= HEAP_GRANULE * HEAP_GRANULE_CLASSES) {
+    int index = (int) ((size - 1) / HEAP_GRANULE);
+    *slot_size = (size_t) (index + 1) * HEAP_GRANULE;
+    return index;
+  }
+  int index = HEAP_GRANULE_CLASSES;
+  size_t step = HEAP_GRANULE * HEAP_GRANULE_CLASSES / 4;
+  size_t slot = HEAP_GRANULE * HEAP_GRANULE_CLASSES + step;
+  while (slot < size) {
+    if (slot == step * 8)
+      step *= 2;
+    slot += step;
+    index++;
+  }
+  *slot_size = slot;
+  return index;
+}
+
+// Pages are handed out in list order. A page that has not been swept since the
+// last collection is swept only once the allocator reaches it, which spreads
+// the sweeping cost over the allocations of the following cycle.
+void *
+heap_allocate(Heap *heap, size_t size)
+{
+  if (size > HEAP_MAX_SMALL)
+    return allocate_large(heap, size);
+  size_t slot_size;
+  SizeClass *class = &heap->classes[size_class(size, &slot_size)];
+  while (class->cursor != NULL) {
+    Page *page = class->cursor;
+    if (!page->is_swept)
+      page_sweep(heap, page);
+    void *slot = page_take(heap, page);
+    if (slot != NULL)
+      return slot;
+    class->cursor = page->next;
+  }
+  int slot_count = (int) ((HEAP_PAGE_SIZE - sizeof(Page)) / slot_size);
+  while (PAGE_HEADER_SIZE(slot_count) + slot_size * slot_count
+      > HEAP_PAGE_SIZE)
+    slot_count--;
+  Page *page = page_new(slot_size, slot_count);
+  if (class->tail != NULL)
+    class->tail->next = page;
+  else
+    class->pages = page;
+  class->tail = page;
+  class->cursor = page;
+  return page_take(heap, page);
+}
+
+bool
+heap_mark(Obj *object)
+{
+  Page *page = page_of(object);
+  size_t index = slot_index(page, object);
+  uint64_t bit = (uint64_t) 1 << (index % 64);
+  if ((page->marks[index / 64] & bit) != 0)
+    return false;
+  page->marks[index / 64] |= bit;
+  return true;
+}
+
+bool
+heap_is_marked(Obj *object)
+{
+  Page *page = page_of(object);
+  size_t index = slot_index(page, object);
+  return (page->marks[index / 64] & ((uint64_t) 1 << (index % 64))) != 0;
+}
+
+size_t
+heap_object_size(Obj *object)
+{
+  return page_of(object)->slot_size;
+}
+
+// Finishes the sweep left over from the previous collection and releases the
+// pages that ended up empty. Must run before new marks are set.
+void
+heap_sweep_all(Heap *heap)
+{
+  for (int i = 0; i < HEAP_SIZE_CLASSES; ++i) {
+    SizeClass *class = &heap->classes[i];
+    Page *previous = NULL;
+    Page *page = class->pages;
+    while (page != NULL) {
+      Page *next = page->next;
+      if (!page->is_swept)
+        page_sweep(heap, page);
+      if (page->live_count == 0) {
+        if (previous != NULL)
+          previous->next = next;
+        else
+          class->pages = next;
+        page_free(heap, page);
+      } else
+        previous = page;
+      page = next;
+    }
+    class->tail = previous;
+    class->cursor = class->pages;
+  }
+}
+
+// Called once marking is done. Small pages are left to be swept lazily by the
+// allocator, large objects are freed right away.
+void
+heap_begin_sweep(Heap *heap)
+{
+  for (int i = 0; i < HEAP_SIZE_CLASSES; ++i) {
+    SizeClass *class = &heap->classes[i];
+    for (Page *page = class->pages; page != NULL; page = page->next)
+      page->is_swept = false;
+    class->cursor = class->pages;
+  }
+  Page *previous = NULL;
+  Page *page = heap->large;
+  while (page != NULL) {
+    Page *next = page->next;
+    page_sweep(heap, page);
+    if (page->live_count == 0) {
+      if (previous != NULL)
+        previous->next = next;
+      else
+        heap->large = next;
+      page_free(heap, page);
+    } else
+      previous = page;
+    page = next;
+  }
+}
+
+// Returns the fraction of small page memory that the sweep will leave free
+// and the next cycle will not fill again, or zero while the heap is too small
+// for compaction to pay off. Each size class is expected to reuse headroom
+// bytes of free slots per marked byte, and at least one page's worth. Pages
+// without marked objects are released by the sweep and do not count.
+double
+heap_fragmentation(Heap *heap, double headroom)
+{
+  size_t page_count = 0;
+  size_t capacity = 0;
+  double excess = 0;
+  for (int i = 0; i < HEAP_SIZE_CLASSES; ++i) {
+    size_t class_capacity = 0;
+    size_t class_marked = 0;
+    size_t page_capacity = 0;
+    for (Page *page = heap->classes[i].pages; page != NULL;
+        page = page->next) {
+      int count = 0;
+      for (int j = 0; j < (page->bump + 63) / 64; ++j)
+        count += count_bits(page->marks[j]);
+      if (count == 0)
+        continue;
+      page_count++;
+      page_capacity = page->slot_count * page->slot_size;
+      class_capacity += page_capacity;
+      class_marked += count * page->slot_size;
+    }
+    double reusable = class_marked * headroom;
+    if (reusable < page_capacity)
+      reusable = page_capacity;
+    if (class_capacity - class_marked > reusable)
+      excess += class_capacity - class_marked - reusable;
+    capacity += class_capacity;
+  }
+  if (page_count < HEAP_COMPACT_MIN_PAGES)
+    return 0.0;
+  return excess / capacity;
+}
+
+// Moves the survivors of sparsely occupied pages into the remaining pages of
+// their size class. Must run on a fully swept heap. The evacuated pages are
+// kept around, each moved slot holding the address of its new copy, until
+// heap_release_evacuated is called.
+void
+heap_evacuate(Heap *heap)
+{
+  for (int i = 0; i < HEAP_SIZE_CLASSES; ++i) {
+    SizeClass *class = &heap->classes[i];
+    Page *previous = NULL;
+    Page *page = class->pages;
+    while (page != NULL) {
+      Page *next = page->next;
+      if (page->live_count < page->slot_count * HEAP_EVACUATE_OCCUPANCY) {
+        if (previous != NULL)
+          previous->next = next;
+        else
+          class->pages = next;
+        page->is_evacuating = true;
+        page->next = heap->evacuating;
+        heap->evacuating = page;
+      } else
+        previous = page;
+      page = next;
+    }
+    class->tail = previous;
+    class->cursor = class->pages;
+  }
+  for (Page *page = heap->evacuating; page != NULL; page = page->next) {
+    for (int i = 0; i < (page->bump + 63) / 64; ++i) {
+      uint64_t live = page->live[i];
+      while (live != 0) {
+        int bit = lowest_bit(live);
+        live &= live - 1;
+        char *from = page->slots + (size_t) (i * 64 + bit) * page->slot_size;
+        void *to = heap_allocate(heap, page->slot_size);
+        memcpy(to, from, page->slot_size);
+        *(void **) from = to;
+      }
+    }
+  }
+}
+
+Obj *
+heap_forward(Obj *object)
+{
+  if (object == NULL || !page_of(object)->is_evacuating)
+    return object;
+  return *(Obj **) object;
+}
+
+void
+heap_visit(Heap *heap, void (*visit)(Obj *object, void *context),
+    void *context)
+{
+  for (int i = 0; i < HEAP_SIZE_CLASSES + 1; ++i) {
+    Page *page = i < HEAP_SIZE_CLASSES ? heap->classes[i].pages : heap->large;
+    for (; page != NULL; page = page->next) {
+      for (int j = 0; j < (page->bump + 63) / 64; ++j) {
+        uint64_t live = page->live[j];
+        while (live != 0) {
+          int bit = lowest_bit(live);
+          live &= live - 1;
+          visit((Obj *) (page->slots
+              + (size_t) (j * 64 + bit) * page->slot_size), context);
+        }
+      }
+    }
+  }
+}
+
+// Frees the evacuated pages. Their objects now live elsewhere, so nothing is
+// finalized.
+void
+heap_release_evacuated(Heap *heap)
+{
+  Page *page = heap->evacuating;
+  while (page != NULL) {
+    Page *next = page->next;
+    heap->vm->bytes_allocated -= page->live_count * page->slot_size;
+    free(page);
+    page = next;
+  }
+  heap->evacuating = NULL;
+}
+
+void
+heap_free(Heap *heap)
+{
+  for (int i = 0; i < HEAP_SIZE_CLASSES; ++i) {
+    Page *page = heap->classes[i].pages;
+    while (page != NULL) {
+      Page *next = page->next;
+      page_free(heap, page);
+      page = next;
+    }
+  }
+  Page *page = heap->large;
+  while (page != NULL) {
+    Page *next = page->next;
+    page_free(heap, page);
+    page = next;
+  }
+  heap_init(heap, heap->vm);
+}
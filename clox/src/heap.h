@@ -0,0 +1,94 @@
+#ifndef CLOX_HEAP_H
+#define CLOX_HEAP_H
+
+#include "common.h"
+#include "value.h"
+
+// Objects live in aligned pages carved into equally sized slots. Size classes
+// step by HEAP_GRANULE up to HEAP_GRANULE * HEAP_GRANULE_CLASSES, then by a
+// quarter of the next power of two up to HEAP_MAX_SMALL. Mark bits are kept
+// in a bitmap in the page header rather than in the objects, so marking never
+// writes to object memory. Objects larger than HEAP_MAX_SMALL get a page of
+// their own.
+#define HEAP_PAGE_SIZE (64 * 1024)
+#define HEAP_GRANULE 8
+#define HEAP_GRANULE_CLASSES 32
+#define HEAP_SIZE_CLASSES (HEAP_GRANULE_CLASSES + 24)
+#define HEAP_MAX_SMALL (16 * 1024)
+
+// Fragmentation is only worth fighting once the small object heap spans this
+// many pages. Pages whose survivors fill less than HEAP_EVACUATE_OCCUPANCY of
+// their slots are evacuated by a compacting collection.
+#define HEAP_COMPACT_MIN_PAGES 16
+#define HEAP_EVACUATE_OCCUPANCY 0.5
+
+typedef struct Page {
+  struct Page *next;
+  size_t slot_size;
+  int slot_count;
+  int live_count;
+  int bump;
+  bool is_swept;
+  bool is_evacuating;
+  void *free;
+  char *slots;
+  uint64_t *marks;
+  uint64_t live[];
+} Page;
+
+typedef struct {
+  Page *pages;
+  Page *tail;
+  Page *cursor;
+} SizeClass;
+
+// The heap counts the bytes it hands out against its VM, and frees dead
+// objects through it.
+typedef struct {
+  VM *vm;
+  SizeClass classes[HEAP_SIZE_CLASSES];
+  Page *large;
+  Page *evacuating;
+} Heap;
+
+void
+heap_init(Heap *heap, VM *vm);
+
+void *
+heap_allocate(Heap *heap, size_t size);
+
+bool
+heap_mark(Obj *object);
+
+bool
+heap_is_marked(Obj *object);
+
+size_t
+heap_object_size(Obj *object);
+
+void
+heap_sweep_all(Heap *heap);
+
+void
+heap_begin_sweep(Heap *heap);
+
+double
+heap_fragmentation(Heap *heap, double headroom);
+
+void
+heap_evacuate(Heap *heap);
+
+Obj *
+heap_forward(Obj *object);
+
+void
+heap_visit(Heap *heap, void (*visit)(Obj *object, void *context),
+    void *context);
+
+void
+heap_release_evacuated(Heap *heap);
+
+void
+heap_free(Heap *heap);
+
+#endif
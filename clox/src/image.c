@@ -0,0 +1,542 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "image.h"
+#include "memory.h"
+#include "serial.h"
+#include "vm.h"
+
+typedef enum {
+  VALUE_NIL,
+  VALUE_FALSE,
+  VALUE_TRUE,
+  VALUE_NUMBER,
+  VALUE_OBJECT,
+} ValueTag;
+
+// Numbers the objects in the order they are found. The ids are looked up in
+// an open addressing table keyed by address.
+typedef struct {
+  Obj **objects;
+  int count;
+  int capacity;
+  Obj **keys;
+  int *ids;
+  int key_capacity;
+} ObjectIds;
+
+static uint32_t
+hash_address(Obj *object)
+{
+  uint64_t bits = (uint64_t) (uintptr_t) object;
+  return (uint32_t) ((bits * UINT64_C(0x9e3779b97f4a7c15)) >> 32);
+}
+
+static void
+ids_insert(ObjectIds *ids, Obj *object, int id)
+{
+  uint32_t index = hash_address(object) & (ids->key_capacity - 1);
+  while (ids->keys[index] != NULL)
+    index = (index + 1) & (ids->key_capacity - 1);
+  ids->keys[index] = object;
+  ids->ids[index] = id;
+}
+
+static int
+object_id(ObjectIds *ids, Obj *object)
+{
+  if (ids->key_capacity > 0) {
+    uint32_t index = hash_address(object) & (ids->key_capacity - 1);
+    while (ids->keys[index] != NULL) {
+      if (ids->keys[index] == object)
+        return ids->ids[index];
+      index = (index + 1) & (ids->key_capacity - 1);
+    }
+  }
+  if (ids->capacity < ids->count + 1) {
+    ids->capacity = GROW_CAPACITY(ids->capacity);
+    ids->objects = realloc(ids->objects, sizeof(Obj *) * ids->capacity);
+    if (ids->objects == NULL)
+      exit(1);
+  }
+  if (ids->key_capacity * 3 < (ids->count + 1) * 4) {
+    Obj **old_keys = ids->keys;
+    int *old_ids = ids->ids;
+    int old_capacity = ids->key_capacity;
+    ids->key_capacity = old_capacity < 64 ? 64 : old_capacity * 2;
+    ids->keys = calloc(ids->key_capacity, sizeof(Obj *));
+    ids->ids = malloc(sizeof(int) * ids->key_capacity);
+    if (ids->keys == NULL || ids->ids == NULL)
+      exit(1);
+    for (int i = 0; i < old_capacity; ++i)
+      if (old_keys[i] != NULL)
+        ids_insert(ids, old_keys[i], old_ids[i]);
+    free(old_keys);
+    free(old_ids);
+  }
+  ids->objects[ids->count] = object;
+  ids_insert(ids, object, ids->count);
+  return ids->count++;
+}
+
+static void
+write_object_id(Writer *writer, ObjectIds *ids, Obj *object)
+{
+  serial_write_varint(writer, (uint32_t) object_id(ids, object));
+}
+
+static void
+write_value(Writer *writer, ObjectIds *ids, Value value)
+{
+  if (IS_NUMBER(value)) {
+    serial_write_byte(writer, VALUE_NUMBER);
+    serial_write_number(writer, AS_NUMBER(value));
+  } else if (IS_BOOL(value))
+    serial_write_byte(writer, AS_BOOL(value) ? VALUE_TRUE : VALUE_FALSE);
+  else if (IS_OBJ(value)) {
+    serial_write_byte(writer, VALUE_OBJECT);
+    write_object_id(writer, ids, AS_OBJ(value));
+  } else
+    serial_write_byte(writer, VALUE_NIL);
+}
+
+static void
+write_table(Writer *writer, ObjectIds *ids, Table *table)
+{
+  serial_write_varint(writer, (uint32_t) table->count);
+  for (int i = 0; i < table->capacity; ++i) {
+    if (!TABLE_IS_FULL(table, i))
+      continue;
+    write_object_id(writer, ids, (Obj *) table->keys[i]);
+    write_value(writer, ids, table->values[i]);
+  }
+}
+
+// Writes the fields of an object, numbering the objects it refers to. The
+// fields needed to allocate the object come first.
+static void
+write_object(VM *vm, Writer *writer, ObjectIds *ids, Obj *object)
+{
+  switch (object->type) {
+  case OBJ_ARRAY: {
+    ValueArray *elements = &((ObjArray *) object)->elements;
+    serial_write_varint(writer, (uint32_t) elements->count);
+    for (int i = 0; i < elements->count; ++i)
+      write_value(writer, ids, elements->values[i]);
+    break;
+  }
+  case OBJ_BOUND_METHOD: {
+    ObjBoundMethod *bound = (ObjBoundMethod *) object;
+    write_object_id(writer, ids, (Obj *) bound->method);
+    write_value(writer, ids, bound->receiver);
+    break;
+  }
+  case OBJ_CLASS: {
+    ObjClass *class = (ObjClass *) object;
+    write_object_id(writer, ids, (Obj *) class->name);
+    write_table(writer, ids, &class->methods);
+    break;
+  }
+  case OBJ_CLOSURE: {
+    ObjClosure *closure = (ObjClosure *) object;
+    write_object_id(writer, ids, (Obj *) closure->function);
+    serial_write_varint(writer, (uint32_t) closure->upvalue_count);
+    for (int i = 0; i < closure->upvalue_count; ++i) {
+      if (closure->upvalues[i] == NULL)
+        writer->failed = true;
+      else
+        write_object_id(writer, ids, (Obj *) closure->upvalues[i]);
+    }
+    break;
+  }
+  case OBJ_FLOAT_ARRAY: {
+    ObjFloatArray *array = (ObjFloatArray *) object;
+    serial_write_varint(writer, (uint32_t) array->count);
+    serial_write_bytes(writer, array->values, sizeof(double) * array->count);
+    break;
+  }
+  case OBJ_FUNCTION: {
+    ObjFunction *function = (ObjFunction *) object;
+    // Bodies not compiled yet refer to a source the image does not hold.
+    if (function->lazy != NULL)
+      writer->failed = true;
+    serial_write_byte(writer, function->arity);
+    serial_write_varint(writer, function->upvalue_count);
+    write_value(writer, ids, function->name != NULL
+        ? OBJ_VAL(function->name) : NIL_VAL);
+    serial_write_code(writer, &function->chunk);
+    ValueArray *constants = &function->chunk.constants;
+    serial_write_varint(writer, (uint32_t) constants->count);
+    for (int i = 0; i < constants->count; ++i)
+      write_value(writer, ids, constants->values[i]);
+    break;
+  }
+  case OBJ_INSTANCE: {
+    ObjInstance *instance = (ObjInstance *) object;
+    write_object_id(writer, ids, (Obj *) instance->class);
+    write_table(writer, ids, &instance->fields);
+    break;
+  }
+  case OBJ_MAP: {
+    Map *entries = &((ObjMap *) object)->entries;
+    serial_write_varint(writer, (uint32_t) entries->count);
+    for (int i = 0; i < entries->capacity; ++i) {
+      if (!MAP_IS_FULL(entries, i))
+        continue;
+      write_value(writer, ids, entries->keys[i]);
+      write_value(writer, ids, entries->values[i]);
+    }
+    break;
+  }
+  case OBJ_NATIVE: {
+    const char *name = vm_native_name(((ObjNative *) object)->function);
+    if (name == NULL) {
+      writer->failed = true;
+      break;
+    }
+    serial_write_varint(writer, (uint32_t) strlen(name));
+    serial_write_bytes(writer, name, strlen(name));
+    break;
+  }
+  case OBJ_STRING:
+    serial_write_string(vm, writer, (ObjString *) object);
+    break;
+  case OBJ_UPVALUE: {
+    ObjUpvalue *upvalue = (ObjUpvalue *) object;
+    write_value(writer, ids, *upvalue->location);
+    break;
+  }
+  }
+}
+
+// The payload is the object count, the objects, each as its type, the length
+// of its fields and the fields, and finally the globals.
+bool
+image_save(VM *vm, const char *path)
+{
+  ObjectIds ids = { NULL, 0, 0, NULL, NULL, 0 };
+  Writer globals, objects, fields, payload;
+  serial_writer_init(&globals);
+  serial_writer_init(&objects);
+  serial_writer_init(&fields);
+  serial_writer_init(&payload);
+  write_table(&globals, &ids, &vm->globals);
+  for (int i = 0; i < ids.count; ++i) {
+    fields.count = 0;
+    write_object(vm, &fields, &ids, ids.objects[i]);
+    serial_write_byte(&objects, ids.objects[i]->type);
+    serial_write_varint(&objects, (uint32_t) fields.count);
+    serial_write_bytes(&objects, fields.bytes, fields.count);
+    objects.failed |= fields.failed;
+  }
+  serial_write_varint(&payload, (uint32_t) ids.count);
+  serial_write_bytes(&payload, objects.bytes, objects.count);
+  serial_write_bytes(&payload, globals.bytes, globals.count);
+  payload.failed |= objects.failed || globals.failed;
+  bool saved = serial_store(path, "LOXI", IMAGE_VERSION, NULL, 0, &payload);
+  serial_writer_free(&globals);
+  serial_writer_free(&objects);
+  serial_writer_free(&fields);
+  serial_writer_free(&payload);
+  free(ids.objects);
+  free(ids.keys);
+  free(ids.ids);
+  return saved;
+}
+
+typedef struct {
+  uint8_t type;
+  const uint8_t *fields;
+  uint32_t length;
+} Record;
+
+// The objects are kept in an array on the VM stack while they are loaded, so
+// that they stay reachable.
+typedef struct {
+  Record *records;
+  uint32_t count;
+  ObjArray *objects;
+} Loader;
+
+static Value
+read_id(Reader *reader, Loader *loader)
+{
+  uint32_t id = serial_read_varint(reader);
+  if (id < loader->count && !IS_NIL(loader->objects->elements.values[id]))
+    return loader->objects->elements.values[id];
+  reader->failed = true;
+  return NIL_VAL;
+}
+
+static Value
+read_value(Reader *reader, Loader *loader)
+{
+  switch (serial_read_byte(reader)) {
+  case VALUE_NIL:
+    return NIL_VAL;
+  case VALUE_FALSE:
+    return BOOL_VAL(false);
+  case VALUE_TRUE:
+    return BOOL_VAL(true);
+  case VALUE_NUMBER:
+    return NUMBER_VAL(serial_read_number(reader));
+  case VALUE_OBJECT:
+    return read_id(reader, loader);
+  default:
+    reader->failed = true;
+    return NIL_VAL;
+  }
+}
+
+// Reads a reference to an object of the given type that already exists.
+static Obj *
+read_object(Reader *reader, Loader *loader, ObjType type)
+{
+  Value value = read_id(reader, loader);
+  if (IS_OBJ(value) && OBJ_TYPE(value) == type)
+    return AS_OBJ(value);
+  reader->failed = true;
+  return NULL;
+}
+
+static void
+read_table(VM *vm, Reader *reader, Loader *loader, Table *table)
+{
+  uint32_t count = serial_read_varint(reader);
+  for (uint32_t i = 0; i < count && !reader->failed; ++i) {
+    ObjString *key = (ObjString *) read_object(reader, loader, OBJ_STRING);
+    Value value = read_value(reader, loader);
+    if (!reader->failed)
+      table_set(vm, table, key, value);
+  }
+}
+
+// Objects are allocated in three rounds, so that every object can be
+// allocated complete enough to be marked and printed: closures need their
+// function and classes their name, instances need their class and bound
+// methods their closure. Fields that may refer to any object are filled in
+// once all objects exist.
+static int
+object_round(uint8_t type)
+{
+  switch (type) {
+  case OBJ_CLOSURE:
+  case OBJ_CLASS:
+    return 1;
+  case OBJ_INSTANCE:
+  case OBJ_BOUND_METHOD:
+    return 2;
+  default:
+    return 0;
+  }
+}
+
+static Obj *
+allocate_object_shell(VM *vm, Reader *reader, Loader *loader, uint8_t type)
+{
+  switch (type) {
+  case OBJ_ARRAY:
+    return (Obj *) new_array(vm);
+  case OBJ_BOUND_METHOD: {
+    Obj *method = read_object(reader, loader, OBJ_CLOSURE);
+    return reader->failed ? NULL
+      : (Obj *) new_bound_method(vm, NIL_VAL, (ObjClosure *) method);
+  }
+  case OBJ_CLASS: {
+    Obj *name = read_object(reader, loader, OBJ_STRING);
+    return reader->failed ? NULL : (Obj *) new_class(vm, (ObjString *) name);
+  }
+  case OBJ_CLOSURE: {
+    Obj *function = read_object(reader, loader, OBJ_FUNCTION);
+    return reader->failed ? NULL
+      : (Obj *) new_closure(vm, (ObjFunction *) function);
+  }
+  case OBJ_FLOAT_ARRAY: {
+    uint32_t count = serial_read_varint(reader);
+    const uint8_t *values = serial_read_bytes(reader,
+        sizeof(double) * (size_t) count);
+    if (values == NULL)
+      return NULL;
+    ObjFloatArray *array = new_float_array(vm, (int) count);
+    memcpy(array->values, values, sizeof(double) * count);
+    return (Obj *) array;
+  }
+  case OBJ_FUNCTION: {
+    ObjFunction *function = new_function(vm);
+    function->arity = serial_read_byte(reader);
+    uint32_t upvalue_count = serial_read_varint(reader);
+    if (upvalue_count > UINT8_COUNT)
+      reader->failed = true;
+    function->upvalue_count = (uint16_t) upvalue_count;
+    return (Obj *) function;
+  }
+  case OBJ_INSTANCE: {
+    Obj *class = read_object(reader, loader, OBJ_CLASS);
+    return reader->failed ? NULL : (Obj *) new_instance(vm, (ObjClass *) class);
+  }
+  case OBJ_MAP:
+    return (Obj *) new_map(vm);
+  case OBJ_NATIVE: {
+    uint32_t length = serial_read_varint(reader);
+    const uint8_t *name = serial_read_bytes(reader, length);
+    return name == NULL ? NULL
+      : (Obj *) vm_native_new(vm, (const char *) name, (int) length);
+  }
+  case OBJ_STRING:
+    return (Obj *) serial_read_string(vm, reader);
+  case OBJ_UPVALUE: {
+    ObjUpvalue *upvalue = new_upvalue(vm, NULL);
+    upvalue->location = &upvalue->closed;
+    return (Obj *) upvalue;
+  }
+  default:
+    return NULL;
+  }
+}
+
+static void
+fill_object(VM *vm, Reader *reader, Loader *loader, Obj *object)
+{
+  switch (object->type) {
+  case OBJ_ARRAY: {
+    ValueArray *elements = &((ObjArray *) object)->elements;
+    uint32_t count = serial_read_varint(reader);
+    for (uint32_t i = 0; i < count && !reader->failed; ++i)
+      value_array_write(vm, elements, read_value(reader, loader));
+    break;
+  }
+  case OBJ_BOUND_METHOD:
+    read_id(reader, loader);
+    ((ObjBoundMethod *) object)->receiver = read_value(reader, loader);
+    break;
+  case OBJ_CLASS:
+    read_id(reader, loader);
+    read_table(vm, reader, loader, &((ObjClass *) object)->methods);
+    break;
+  case OBJ_CLOSURE: {
+    ObjClosure *closure = (ObjClosure *) object;
+    read_id(reader, loader);
+    if (serial_read_varint(reader) != (uint32_t) closure->upvalue_count) {
+      reader->failed = true;
+      break;
+    }
+    for (int i = 0; i < closure->upvalue_count; ++i)
+      closure->upvalues[i] = (ObjUpvalue *) read_object(reader, loader,
+          OBJ_UPVALUE);
+    break;
+  }
+  case OBJ_FUNCTION: {
+    ObjFunction *function = (ObjFunction *) object;
+    serial_read_byte(reader);
+    serial_read_varint(reader);
+    Value name = read_value(reader, loader);
+    if (IS_STRING(name))
+      function->name = AS_STRING(name);
+    else if (!IS_NIL(name))
+      reader->failed = true;
+    serial_read_code(vm, reader, &function->chunk);
+    uint32_t count = serial_read_varint(reader);
+    for (uint32_t i = 0; i < count && !reader->failed; ++i)
+      chunk_add_constant(vm, &function->chunk, read_value(reader, loader));
+    if (!reader->failed && !serial_check_code(function))
+      reader->failed = true;
+    break;
+  }
+  case OBJ_INSTANCE:
+    read_id(reader, loader);
+    read_table(vm, reader, loader, &((ObjInstance *) object)->fields);
+    break;
+  case OBJ_MAP: {
+    Map *entries = &((ObjMap *) object)->entries;
+    uint32_t count = serial_read_varint(reader);
+    for (uint32_t i = 0; i < count && !reader->failed; ++i) {
+      Value key = read_value(reader, loader);
+      Value value = read_value(reader, loader);
+      if (!reader->failed)
+        map_set(vm, entries, key, value);
+    }
+    break;
+  }
+  case OBJ_UPVALUE:
+    ((ObjUpvalue *) object)->closed = read_value(reader, loader);
+    break;
+  case OBJ_FLOAT_ARRAY:
+  case OBJ_NATIVE:
+  case OBJ_STRING:
+    reader->current = reader->end;
+    break;
+  }
+}
+
+static bool
+load_objects(VM *vm, Reader *reader, Loader *loader)
+{
+  for (uint32_t i = 0; i < loader->count && !reader->failed; ++i) {
+    Record *record = &loader->records[i];
+    record->type = serial_read_byte(reader);
+    record->length = serial_read_varint(reader);
+    record->fields = serial_read_bytes(reader, record->length);
+    value_array_write(vm, &loader->objects->elements, NIL_VAL);
+  }
+  for (int round = 0; round < 3 && !reader->failed; ++round) {
+    for (uint32_t i = 0; i < loader->count; ++i) {
+      Record *record = &loader->records[i];
+      if (object_round(record->type) != round)
+        continue;
+      Reader fields = { record->fields, record->fields + record->length,
+        false };
+      Obj *object = allocate_object_shell(vm, &fields, loader, record->type);
+      if (object == NULL || fields.failed)
+        return false;
+      loader->objects->elements.values[i] = OBJ_VAL(object);
+    }
+  }
+  for (uint32_t i = 0; i < loader->count && !reader->failed; ++i) {
+    Record *record = &loader->records[i];
+    Reader fields = { record->fields, record->fields + record->length,
+      false };
+    fill_object(vm, &fields, loader,
+        AS_OBJ(loader->objects->elements.values[i]));
+    if (fields.failed || fields.current != fields.end)
+      return false;
+  }
+  return !reader->failed;
+}
+
+bool
+image_load(VM *vm, const char *path)
+{
+  SerialFile file;
+  Reader reader;
+  if (!serial_open(&file, path, "LOXI", IMAGE_VERSION, NULL, 0, &reader))
+    return false;
+  Loader loader;
+  loader.count = serial_read_varint(&reader);
+  // Every object takes at least two bytes.
+  if (loader.count > (size_t) (reader.end - reader.current) / 2) {
+    serial_close(&file);
+    return false;
+  }
+  loader.records = malloc(sizeof(Record) * (loader.count + 1));
+  if (loader.records == NULL)
+    exit(1);
+  loader.objects = new_array(vm);
+  vm_stack_push(vm, OBJ_VAL(loader.objects));
+  bool loaded = load_objects(vm, &reader, &loader);
+  if (loaded) {
+    Table globals;
+    table_init(&globals);
+    read_table(vm, &reader, &loader, &globals);
+    loaded = !reader.failed && reader.current == reader.end;
+    if (loaded) {
+      arena_pack_objects(vm, &loader.objects->elements);
+      table_add_all(vm, &globals, &vm->globals);
+    }
+    table_free(vm, &globals);
+  }
+  vm_stack_pop(vm);
+  free(loader.records);
+  serial_close(&file);
+  return loaded;
+}
@@ -0,0 +1,21 @@
+#ifndef CLOX_IMAGE_H
+#define CLOX_IMAGE_H
+
+#include "common.h"
+
+// A heap image holds the globals and every object reachable from them. The
+// objects refer to each other by their index in the image, so the image can
+// be loaded into any VM. Strings come back interned, which restores the
+// string table along with them. Bump IMAGE_VERSION whenever the bytecode,
+// the object layout or the file format changes.
+#define IMAGE_VERSION 4
+
+bool
+image_save(VM *vm, const char *path);
+
+// Loads the image into a freshly initialized VM, replacing globals of the
+// same name.
+bool
+image_load(VM *vm, const char *path);
+
+#endif
@@ -1,12 +1,22 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "cache.h"
 #include "chunk.h"
+#include "compiler.h"
+#include "floats.h"
+#include "image.h"
 #include "vm.h"
 
 static void
-repl()
+repl(VM *vm)
 {
   char line[1024];
   for (;;) {
@@ -15,45 +25,134 @@ repl()
       printf("\n");
       break;
     }
-    vm_interpret(line);
+    vm_interpret(vm, line);
+  }
+}
+
+// A script's source, mapped from a regular file or read from a pipe or
+// standard input. It is not NUL terminated.
+typedef struct {
+  const char *chars;
+  size_t length;
+  void *mapping;
+  char *buffer;
+} Source;
+
+static bool
+read_stream(FILE *file, Source *source)
+{
+  size_t capacity = 64 * 1024;
+  size_t length = 0;
+  char *buffer = malloc(capacity);
+  for (;;) {
+    if (buffer == NULL)
+      return false;
+    size_t bytes_read = fread(buffer + length, 1, capacity - length, file);
+    length += bytes_read;
+    if (bytes_read == 0)
+      break;
+    if (length == capacity) {
+      capacity *= 2;
+      char *grown = realloc(buffer, capacity);
+      if (grown == NULL)
+        free(buffer);
+      buffer = grown;
+    }
   }
+  if (ferror(file)) {
+    free(buffer);
+    return false;
+  }
+  source->chars = buffer;
+  source->length = length;
+  source->buffer = buffer;
+  return true;
 }
 
-static char *
-read_file(const char *path)
+// Regular files are mapped and scanned in place. Anything else, including
+// the standard input given as "-", is read to its end.
+static bool
+source_open(const char *path, Source *source)
 {
-  FILE *file = fopen(path, "rb");
-  if (file == NULL) {
+  source->chars = "";
+  source->length = 0;
+  source->mapping = NULL;
+  source->buffer = NULL;
+  if (strcmp(path, "-") == 0) {
+    if (read_stream(stdin, source))
+      return true;
+    fprintf(stderr, "Could not read standard input.\n");
+    return false;
+  }
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
     fprintf(stderr, "Could not open file \"%s\".\n", path);
-    return NULL;
+    return false;
   }
-  fseek(file, 0L, SEEK_END);
-  size_t file_size = ftell(file);
-  rewind(file);
-  char *buffer = malloc(file_size + 1);
-  if (buffer == NULL) {
-    fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-    return NULL;
+  struct stat status;
+  if (fstat(fd, &status) == 0 && S_ISREG(status.st_mode)) {
+    size_t size = (size_t) status.st_size;
+    void *mapping = size > 0
+      ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (mapping == MAP_FAILED) {
+      fprintf(stderr, "Could not read file \"%s\".\n", path);
+      return false;
+    }
+    if (mapping != NULL) {
+      source->chars = mapping;
+      source->length = size;
+      source->mapping = mapping;
+    }
+    return true;
   }
-  size_t bytes_read = fread(buffer, sizeof(char), file_size, file);
-  if (bytes_read < file_size) {
-    free(buffer);
+  FILE *file = fdopen(fd, "rb");
+  if (file == NULL || !read_stream(file, source)) {
+    if (file != NULL)
+      fclose(file);
+    else
+      close(fd);
     fprintf(stderr, "Could not read file \"%s\".\n", path);
-    return NULL;
+    return false;
   }
-  buffer[bytes_read] = '\0';
   fclose(file);
-  return buffer;
+  return true;
+}
+
+static void
+source_close(Source *source)
+{
+  if (source->mapping != NULL)
+    munmap(source->mapping, source->length);
+  free(source->buffer);
 }
 
 static int
-run_file(const char *path)
+run_file(VM *vm, const char *path)
 {
-  char *source = read_file(path);
-  if (source == NULL)
+  Source source;
+  if (!source_open(path, &source))
     return 74;
-  InterpretResult result = vm_interpret(source);
-  free(source);
+  // The bytecode of script.lox is cached in script.loxc. Scripts read from
+  // the standard input are not cached.
+  char *cache_path = NULL;
+  ObjFunction *function = NULL;
+  if (strcmp(path, "-") != 0 && source.length <= INT32_MAX
+      && (cache_path = malloc(strlen(path) + 2)) != NULL) {
+    strcpy(cache_path, path);
+    strcat(cache_path, "c");
+    function = cache_load(vm, cache_path, source.chars, (int) source.length);
+  }
+  // Lazily compiled functions still need the source, so they are not cached.
+  if (function == NULL
+      && (function = compile(vm, source.chars, source.length)) != NULL
+      && cache_path != NULL && !vm->lazy_compile)
+    cache_store(vm, cache_path, source.chars, (int) source.length, function);
+  // The compiled function holds no references into the source.
+  source_close(&source);
+  free(cache_path);
+  InterpretResult result = function != NULL
+    ? vm_interpret_function(vm, function) : INTERPRET_COMPILE_ERROR;
   if (result == INTERPRET_COMPILE_ERROR)
     return 65;
   else if (result == INTERPRET_RUNTIME_ERROR)
@@ -62,19 +161,57 @@ run_file(const char *path)
     return 0;
 }
 
+// With --image the VM starts from a heap image instead of an empty heap. With
+// --snapshot the heap left behind by the script is saved as an image. With
+// --lazy function bodies are compiled when they are first called, so errors
+// in them are only reported then.
 int
 main(int argc, const char **argv)
 {
+  const char *image = NULL;
+  const char *snapshot = NULL;
+  const char *path = NULL;
+  bool lazy = false;
+  bool usage = false;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--image") == 0 && i + 1 < argc)
+      image = argv[++i];
+    else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc)
+      snapshot = argv[++i];
+    else if (strcmp(argv[i], "--lazy") == 0)
+      lazy = true;
+    else if (path == NULL)
+      path = argv[i];
+    else
+      usage = true;
+  }
+  if (usage || (lazy && snapshot != NULL)) {
+    fprintf(stderr, "Usage: clox [--image image] [--snapshot image | --lazy] "
+        "[path | -]\n");
+    return 64;
+  }
+  // The VM is too large for the stack.
+  VM *vm = malloc(sizeof(VM));
+  if (vm == NULL) {
+    fprintf(stderr, "Not enough memory.\n");
+    return 74;
+  }
+  floats_init();
   int return_code = 0;
-  vm_init();
-  if (argc == 1)
-    repl();
-  else if (argc == 2)
-    return_code = run_file(argv[1]);
-  else {
-    fprintf(stderr, "Usage: clox [path]\n");
-    return_code = 64;
+  vm_init(vm);
+  vm->lazy_compile = lazy;
+  if (image != NULL && !image_load(vm, image)) {
+    fprintf(stderr, "Could not load image \"%s\".\n", image);
+    return_code = 74;
+  } else if (path != NULL)
+    return_code = run_file(vm, path);
+  else if (snapshot == NULL)
+    repl(vm);
+  if (return_code == 0 && snapshot != NULL && !image_save(vm, snapshot)) {
+    fprintf(stderr, "Could not write image \"%s\".\n", snapshot);
+    return_code = 74;
   }
-  vm_free();
+  vm_free(vm);
+  free(vm);
   return return_code;
 }
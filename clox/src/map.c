@@ -0,0 +1,265 @@
+#include <string.h>
+
+#include "map.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+
+#define MAP_MIN_CAPACITY TABLE_GROUP_WIDTH
+
+#define SLOT_SIZE (1 + 2 * sizeof(Value))
+
+void
+map_init(Map *map)
+{
+  map->count = 0;
+  map->tombstones = 0;
+  map->capacity = 0;
+  map->control = NULL;
+  map->keys = NULL;
+  map->values = NULL;
+}
+
+void
+map_free(VM *vm, Map *map)
+{
+  reallocate(vm, map->control, map_size(map), 0);
+  map_init(map);
+}
+
+size_t
+map_size(Map *map)
+{
+  return SLOT_SIZE * map->capacity;
+}
+
+// Mixes the bits of a key so that every bit affects the home slot and tag,
+// after the finalizer of MurmurHash3.
+static uint32_t
+hash_bits(uint64_t bits)
+{
+  bits ^= bits >> 33;
+  bits *= UINT64_C(0xff51afd7ed558ccd);
+  bits ^= bits >> 33;
+  bits *= UINT64_C(0xc4ceb9fe1a85ec53);
+  bits ^= bits >> 33;
+  return (uint32_t) bits;
+}
+
+static uint32_t
+hash_key(Value key)
+{
+  if (IS_STRING(key))
+    return AS_STRING(key)->hash;
+  #ifdef NAN_BOXING
+  return hash_bits(key);
+  #else
+  switch (key.type) {
+  case VAL_BOOL:
+    return hash_bits(AS_BOOL(key) ? 3 : 2);
+  case VAL_NIL:
+    return hash_bits(1);
+  case VAL_NUMBER: {
+    uint64_t bits;
+    double number = AS_NUMBER(key);
+    memcpy(&bits, &number, sizeof(bits));
+    return hash_bits(bits);
+  }
+  case VAL_OBJ:
+    return hash_bits((uint64_t) (uintptr_t) AS_OBJ(key));
+  default:
+    // Unreachable.
+    return 0;
+  }
+  #endif
+}
+
+static bool
+keys_equal(Value a, Value b)
+{
+  #ifdef NAN_BOXING
+  return a == b;
+  #else
+  if (a.type != b.type)
+    return false;
+  switch (a.type) {
+  case VAL_BOOL:
+    return AS_BOOL(a) == AS_BOOL(b);
+  case VAL_NIL:
+    return true;
+  case VAL_NUMBER:
+    return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+  case VAL_OBJ:
+    return AS_OBJ(a) == AS_OBJ(b);
+  default:
+    // Unreachable.
+    return false;
+  }
+  #endif
+}
+
+// Strings are flattened and interned, so the key may be a different object.
+// It has to be kept reachable by the caller, as interned strings are only
+// held weakly.
+Value
+map_key(VM *vm, Value key)
+{
+  if (IS_STRING(key))
+    return OBJ_VAL(intern_string(vm, string_flatten(vm, AS_STRING(key))));
+  if (IS_NUMBER(key) && AS_NUMBER(key) == 0)
+    return NUMBER_VAL(0);
+  return key;
+}
+
+// The map must not be empty.
+static int
+find_slot(Map *map, Value key, uint32_t hash)
+{
+  int home = HASH_SLOT(hash) & (map->capacity - 1);
+  uint8_t tag = HASH_TAG(hash);
+  if (map->control[home] == tag && keys_equal(map->keys[home], key))
+    return home;
+  if (map->control[home] == CONTROL_EMPTY)
+    return -1;
+  int group_mask = (map->capacity - 1) / TABLE_GROUP_WIDTH;
+  int group = home / TABLE_GROUP_WIDTH;
+  for (int step = 1;; ++step) {
+    const uint8_t *control = map->control + group * TABLE_GROUP_WIDTH;
+    GroupMask match = group_match(control, tag);
+    while (match != 0) {
+      int index = group * TABLE_GROUP_WIDTH + group_lowest_bit(match);
+      if (keys_equal(map->keys[index], key))
+        return index;
+      match &= match - 1;
+    }
+    if (group_match(control, CONTROL_EMPTY) != 0)
+      return -1;
+    group = (group + step) & group_mask;
+  }
+}
+
+static void
+adjust_capacity(VM *vm, Map *map, int capacity)
+{
+  Map resized;
+  resized.count = 0;
+  resized.tombstones = 0;
+  resized.capacity = capacity;
+  resized.control = reallocate(vm, NULL, 0, SLOT_SIZE * capacity);
+  resized.keys = (Value *) (resized.control + capacity);
+  resized.values = resized.keys + capacity;
+  memset(resized.control, CONTROL_EMPTY, capacity);
+  for (int i = 0; i < map->capacity; ++i) {
+    if (!MAP_IS_FULL(map, i))
+      continue;
+    uint32_t hash = hash_key(map->keys[i]);
+    int index = table_find_free(resized.control, capacity, hash);
+    resized.control[index] = HASH_TAG(hash);
+    resized.keys[index] = map->keys[i];
+    resized.values[index] = map->values[i];
+    resized.count++;
+  }
+  map_free(vm, map);
+  *map = resized;
+}
+
+bool
+map_get(Map *map, Value key, Value *value)
+{
+  if (map->count == 0)
+    return false;
+  int index = find_slot(map, key, hash_key(key));
+  if (index < 0)
+    return false;
+  *value = map->values[index];
+  return true;
+}
+
+// Rebuilds the map within its own allocation with freshly computed hashes,
+// the same way Table drops its tombstones. Used after a compaction has moved
+// some of the keys, so it may not allocate.
+void
+map_rehash(Map *map)
+{
+  for (int i = 0; i < map->capacity; ++i)
+    map->control[i] = MAP_IS_FULL(map, i) ? CONTROL_DELETED : CONTROL_EMPTY;
+  for (int i = 0; i < map->capacity; ++i) {
+    while (map->control[i] == CONTROL_DELETED) {
+      Value key = map->keys[i];
+      uint32_t hash = hash_key(key);
+      int index = table_find_free(map->control, map->capacity, hash);
+      if (index == i) {
+        map->control[i] = HASH_TAG(hash);
+        break;
+      }
+      Value value = map->values[i];
+      if (map->control[index] == CONTROL_EMPTY)
+        map->control[i] = CONTROL_EMPTY;
+      else {
+        map->keys[i] = map->keys[index];
+        map->values[i] = map->values[index];
+      }
+      map->control[index] = HASH_TAG(hash);
+      map->keys[index] = key;
+      map->values[index] = value;
+    }
+  }
+  map->tombstones = 0;
+}
+
+bool
+map_set(VM *vm, Map *map, Value key, Value value)
+{
+  uint32_t hash = hash_key(key);
+  if (map->count > 0) {
+    int index = find_slot(map, key, hash);
+    if (index >= 0) {
+      map->values[index] = value;
+      return false;
+    }
+  }
+  if (map->count + map->tombstones + 1 > map->capacity * TABLE_MAX_LOAD) {
+    if (map->capacity == 0)
+      adjust_capacity(vm, map, MAP_MIN_CAPACITY);
+    else if (map->count + 1 > map->capacity * TABLE_MAX_LOAD / 2)
+      adjust_capacity(vm, map, map->capacity * 2);
+    else
+      map_rehash(map);
+  }
+  int index = table_find_free(map->control, map->capacity, hash);
+  if (map->control[index] == CONTROL_DELETED)
+    map->tombstones--;
+  map->control[index] = HASH_TAG(hash);
+  map->keys[index] = key;
+  map->values[index] = value;
+  map->count++;
+  return true;
+}
+
+bool
+map_delete(Map *map, Value key)
+{
+  if (map->count == 0)
+    return false;
+  int index = find_slot(map, key, hash_key(key));
+  if (index < 0)
+    return false;
+  map->control[index] = CONTROL_DELETED;
+  map->keys[index] = NIL_VAL;
+  map->values[index] = NIL_VAL;
+  map->count--;
+  map->tombstones++;
+  return true;
+}
+
+void
+map_mark(VM *vm, Map *map)
+{
+  for (int i = 0; i < map->capacity; ++i) {
+    if (MAP_IS_FULL(map, i)) {
+      value_mark(vm, map->keys[i]);
+      value_mark(vm, map->values[i]);
+    }
+  }
+}
@@ -0,0 +1,50 @@
+#ifndef CLOX_MAP_H
+#define CLOX_MAP_H
+
+#include "common.h"
+#include "value.h"
+
+// A hash table keyed by any value, laid out and probed like a Table. Keys must
+// be normalized with map_key first, which makes keys that are equal also
+// identical: strings are interned and negative zero becomes zero. Numbers are
+// then hashed by their bits, strings by their contents and other objects by
+// their address, so a map holding objects must be rehashed once they move.
+#define MAP_IS_FULL(map, index) (((map)->control[index] & 0x80) == 0)
+
+typedef struct {
+  int count;
+  int tombstones;
+  int capacity;
+  uint8_t *control;
+  Value *keys;
+  Value *values;
+} Map;
+
+void
+map_init(Map *map);
+
+void
+map_free(VM *vm, Map *map);
+
+size_t
+map_size(Map *map);
+
+Value
+map_key(VM *vm, Value key);
+
+bool
+map_get(Map *map, Value key, Value *value);
+
+bool
+map_set(VM *vm, Map *map, Value key, Value value);
+
+bool
+map_delete(Map *map, Value key);
+
+void
+map_rehash(Map *map);
+
+void
+map_mark(VM *vm, Map *map);
+
+#endif
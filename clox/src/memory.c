@@ -1,6 +1,7 @@
 #include <stdlib.h>
 
 #include "compiler.h"
+#include "heap.h"
 #include "memory.h"
 #include "vm.h"
 
@@ -10,17 +11,20 @@
 #endif
 
 #define GC_HEAP_GROW_FACTOR 2
+#define GC_HEAP_MIN (1024 * 1024)
+#define GC_COMPACT_THRESHOLD 0.5
 
 void *
-reallocate(void *pointer, size_t old_size, size_t new_size)
+reallocate(VM *vm, void *pointer, size_t old_size, size_t new_size)
 {
-  vm.bytes_allocated += new_size - old_size;
+  vm->bytes_allocated += new_size - old_size;
   if (new_size > old_size) {
+    vm->bytes_since_gc += new_size - old_size;
     #ifdef DEBUG_STRESS_GC
-    collect_garbage();
+    collect_garbage(vm);
     #endif
-    if (vm.bytes_allocated > vm.next_gc)
-      collect_garbage();
+    if (vm->bytes_marked + vm->bytes_since_gc > vm->next_gc)
+      collect_garbage(vm);
   }
   if (new_size == 0) {
     free(pointer);
@@ -32,45 +36,57 @@ reallocate(void *pointer, size_t old_size, size_t new_size)
   return result;
 }
 
+void *
+allocate_slot(VM *vm, size_t size)
+{
+  #ifdef DEBUG_STRESS_GC
+  collect_garbage(vm);
+  #endif
+  if (vm->bytes_marked + vm->bytes_since_gc + size > vm->next_gc)
+    collect_garbage(vm);
+  vm->bytes_since_gc += size;
+  return heap_allocate(&vm->heap, size);
+}
+
 void
-object_mark(Obj *object)
+object_mark(VM *vm, Obj *object)
 {
   if (object == NULL)
     return;
-  if (object->is_marked)
+  if (!heap_mark(object))
     return;
   #ifdef DEBUG_LOG_GC
   printf("%p mark ", (void *) object);
   value_print(OBJ_VAL(object));
   printf("\n");
   #endif
-  object->is_marked = true;
-  if (vm.gray_capacity < vm.gray_count + 1) {
-    vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
-    vm.gray_stack = (Obj **) realloc(vm.gray_stack,
-        sizeof(Obj *) * vm.gray_capacity);
-    if (vm.gray_stack == NULL)
+  vm->bytes_marked += heap_object_size(object);
+  if (vm->gray_capacity < vm->gray_count + 1) {
+    vm->gray_capacity = GROW_CAPACITY(vm->gray_capacity);
+    vm->gray_stack = (Obj **) realloc(vm->gray_stack,
+        sizeof(Obj *) * vm->gray_capacity);
+    if (vm->gray_stack == NULL)
       exit(1);
   }
-  vm.gray_stack[vm.gray_count++] = object;
+  vm->gray_stack[vm->gray_count++] = object;
 }
 
 void
-value_mark(Value value)
+value_mark(VM *vm, Value value)
 {
   if (IS_OBJ(value))
-    object_mark(AS_OBJ(value));
+    object_mark(vm, AS_OBJ(value));
 }
 
 static void
-array_mark(ValueArray *array)
+array_mark(VM *vm, ValueArray *array)
 {
   for (int i = 0; i < array->count; ++i)
-    value_mark(array->values[i]);
+    value_mark(vm, array->values[i]);
 }
 
 static void
-object_blacken(Obj *object)
+object_blacken(VM *vm, Obj *object)
 {
   #ifdef DEBUG_LOG_GC
   printf("%p blacken ", (void *) object);
@@ -78,169 +94,352 @@ object_blacken(Obj *object)
   printf("\n");
   #endif
   switch (object->type) {
+  case OBJ_ARRAY: {
+    ObjArray *array = (ObjArray *) object;
+    array_mark(vm, &array->elements);
+    vm->bytes_marked += sizeof(Value) * array->elements.capacity;
+    break;
+  }
   case OBJ_BOUND_METHOD: {
     ObjBoundMethod *bound = (ObjBoundMethod *) object;
-    value_mark(bound->receiver);
-    object_mark((Obj *) bound->method);
+    value_mark(vm, bound->receiver);
+    object_mark(vm, (Obj *) bound->method);
     break;
   }
   case OBJ_CLASS: {
     ObjClass *class = (ObjClass *) object;
-    object_mark((Obj *) class->name);
-    table_mark(&class->methods);
+    object_mark(vm, (Obj *) class->name);
+    table_mark(vm, &class->methods);
+    vm->bytes_marked += table_size(&class->methods);
     break;
   }
   case OBJ_CLOSURE: {
     ObjClosure *closure = (ObjClosure *) object;
-    object_mark((Obj *) closure->function);
+    object_mark(vm, (Obj *) closure->function);
     for (int i = 0; i < closure->upvalue_count; ++i)
-      object_mark((Obj *) closure->upvalues[i]);
+      object_mark(vm, (Obj *) closure->upvalues[i]);
+    vm->bytes_marked += sizeof(ObjUpvalue *) * closure->upvalue_count;
     break;
   }
   case OBJ_FUNCTION: {
     ObjFunction *function = (ObjFunction *) object;
-    object_mark((Obj *) function->name);
-    array_mark(&function->chunk.constants);
+    object_mark(vm, (Obj *) function->name);
+    array_mark(vm, &function->chunk.constants);
+    if (function->lazy != NULL) {
+      object_mark(vm, (Obj *) function->lazy->source);
+      array_mark(vm, &function->lazy->upvalue_names);
+    }
+    vm->bytes_marked += sizeof(uint8_t) * function->chunk.capacity
+        + sizeof(LineRun) * function->chunk.line_capacity
+        + sizeof(Value) * function->chunk.constants.capacity;
     break;
   }
   case OBJ_INSTANCE: {
     ObjInstance *instance = (ObjInstance *) object;
-    object_mark((Obj *) instance->class);
-    table_mark(&instance->fields);
+    object_mark(vm, (Obj *) instance->class);
+    table_mark(vm, &instance->fields);
+    vm->bytes_marked += table_size(&instance->fields);
+    break;
+  }
+  case OBJ_MAP: {
+    ObjMap *map = (ObjMap *) object;
+    map_mark(vm, &map->entries);
+    vm->bytes_marked += map_size(&map->entries);
     break;
   }
   case OBJ_UPVALUE:
-    value_mark(((ObjUpvalue *) object)->closed);
+    value_mark(vm, ((ObjUpvalue *) object)->closed);
     break;
-  case OBJ_NATIVE:
   case OBJ_STRING:
+    if (((ObjString *) object)->kind == STRING_ROPE) {
+      ObjRope *rope = (ObjRope *) object;
+      object_mark(vm, (Obj *) rope->left);
+      object_mark(vm, (Obj *) rope->right);
+    } else if (((ObjString *) object)->kind == STRING_SLICE)
+      object_mark(vm, (Obj *) ((ObjSlice *) object)->parent);
+    break;
+  case OBJ_FLOAT_ARRAY:
+  case OBJ_NATIVE:
     break;
   }
 }
 
-static void
-free_object(Obj *object)
+void
+free_object(VM *vm, Obj *object)
 {
   #ifdef DEBUG_LOG_GC
   printf("%p free type %d\n", (void *) object, object->type);
   #endif
   switch (object->type) {
-  case OBJ_BOUND_METHOD:
-    FREE(ObjBoundMethod, object);
+  case OBJ_ARRAY:
+    value_array_free(vm, &((ObjArray *) object)->elements);
     break;
-  case OBJ_CLASS: {
-    ObjClass *class = (ObjClass *) object;
-    table_free(&class->methods);
-    FREE(ObjClass, object);
+  case OBJ_CLASS:
+    table_free(vm, &((ObjClass *) object)->methods);
     break;
-  }
   case OBJ_CLOSURE: {
     ObjClosure *closure = (ObjClosure *) object;
-    FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalue_count);
-    FREE(ObjClosure, object);
+    FREE_ARRAY(vm, ObjUpvalue *, closure->upvalues, closure->upvalue_count);
     break;
   }
   case OBJ_FUNCTION: {
     ObjFunction *function = (ObjFunction *) object;
-    chunk_free(&function->chunk);
-    FREE(ObjFunction, object);
-    break;
-  }
-  case OBJ_INSTANCE: {
-    ObjInstance *instance = (ObjInstance *) object;
-    table_free(&instance->fields);
-    FREE(ObjInstance, object);
+    chunk_free(vm, &function->chunk);
+    if (function->lazy != NULL) {
+      value_array_free(vm, &function->lazy->upvalue_names);
+      FREE(vm, LazyBody, function->lazy);
+    }
     break;
   }
-  case OBJ_NATIVE:
-    FREE(ObjNative, object);
+  case OBJ_INSTANCE:
+    table_free(vm, &((ObjInstance *) object)->fields);
     break;
-  case OBJ_STRING: {
-    ObjString *string = (ObjString *) object;
-    FREE_ARRAY(char, string->chars, string->length + 1);
-    FREE(ObjString, object);
+  case OBJ_MAP:
+    map_free(vm, &((ObjMap *) object)->entries);
     break;
-  }
-  case OBJ_UPVALUE: {
-    FREE(ObjUpvalue, object);
+  case OBJ_BOUND_METHOD:
+  case OBJ_FLOAT_ARRAY:
+  case OBJ_NATIVE:
+  case OBJ_STRING:
+  case OBJ_UPVALUE:
     break;
   }
-  }
 }
 
 static void
-mark_roots()
+mark_roots(VM *vm)
 {
-  for (Value *slot = vm.stack; slot < vm.stack_top; ++slot)
-    value_mark(*slot);
-  for (int i = 0; i < vm.frame_count; ++i)
-    object_mark((Obj *) vm.frames[i].closure);
-  for (ObjUpvalue *upvalue = vm.open_upvalues; upvalue != NULL;
+  for (Value *slot = vm->stack; slot < vm->stack_top; ++slot)
+    value_mark(vm, *slot);
+  for (int i = 0; i < vm->frame_count; ++i)
+    object_mark(vm, (Obj *) vm->frames[i].closure);
+  for (ObjUpvalue *upvalue = vm->open_upvalues; upvalue != NULL;
       upvalue = upvalue->next)
-    object_mark((Obj *) upvalue);
-  table_mark(&vm.globals);
-  compiler_mark_roots();
-  object_mark((Obj *) vm.init_string);
+    object_mark(vm, (Obj *) upvalue);
+  table_mark(vm, &vm->globals);
+  array_mark(vm, &vm->handles);
+  compiler_mark_roots(vm);
+  object_mark(vm, (Obj *) vm->init_string);
+  vm->bytes_marked += table_size(&vm->globals) + table_size(&vm->strings);
 }
 
 static void
-trace_references()
+trace_references(VM *vm)
 {
-  while (vm.gray_count > 0) {
-    Obj *object = vm.gray_stack[--vm.gray_count];
-    object_blacken(object);
+  while (vm->gray_count > 0) {
+    Obj *object = vm->gray_stack[--vm->gray_count];
+    object_blacken(vm, object);
   }
 }
 
+void
+collect_garbage(VM *vm)
+{
+  #ifdef DEBUG_LOG_GC
+  printf("-- gc begin\n");
+  size_t before = vm->bytes_allocated;
+  #endif
+  heap_sweep_all(&vm->heap);
+  vm->bytes_marked = 0;
+  mark_roots(vm);
+  trace_references(vm);
+  table_remove_white(&vm->strings);
+  #ifdef DEBUG_STRESS_GC
+  vm->compact_requested = true;
+  #else
+  // The heap grows to GC_HEAP_GROW_FACTOR times the marked bytes before the
+  // next collection, so that much free space is turnover, not fragmentation.
+  if (heap_fragmentation(&vm->heap, GC_HEAP_GROW_FACTOR - 1)
+      > GC_COMPACT_THRESHOLD)
+    vm->compact_requested = true;
+  #endif
+  heap_begin_sweep(&vm->heap);
+  vm->bytes_since_gc = 0;
+  vm->next_gc = vm->bytes_marked * GC_HEAP_GROW_FACTOR;
+  if (vm->next_gc < GC_HEAP_MIN)
+    vm->next_gc = GC_HEAP_MIN;
+  #ifdef DEBUG_LOG_GC
+  printf("-- gc end\n");
+  printf(" marked %zu bytes (allocated %zu, was %zu) next at %zu\n",
+      vm->bytes_marked, vm->bytes_allocated, before, vm->next_gc);
+  #endif
+}
+
+static Value
+value_forward(Value value)
+{
+  if (!IS_OBJ(value))
+    return value;
+  return OBJ_VAL(heap_forward(AS_OBJ(value)));
+}
+
 static void
-sweep()
-{
-  Obj *previous = NULL;
-  Obj *object = vm.objects;
-  while (object != NULL) {
-    if (object->is_marked) {
-      object->is_marked = false;
-      previous = object;
-      object = object->next;
-    } else {
-      Obj *unreached = object;
-      object = object->next;
-      if (previous != NULL)
-        previous->next = object;
-      else
-        vm.objects = object;
-      free_object(unreached);
+array_forward(ValueArray *array)
+{
+  for (int i = 0; i < array->count; ++i)
+    array->values[i] = value_forward(array->values[i]);
+}
+
+// Keys are hashed by content, not by address, so moved keys keep their slots.
+static void
+table_forward(Table *table)
+{
+  for (int i = 0; i < table->capacity; ++i) {
+    if (TABLE_IS_FULL(table, i)) {
+      table->keys[i] = (ObjString *) heap_forward((Obj *) table->keys[i]);
+      table->values[i] = value_forward(table->values[i]);
     }
   }
 }
 
+// Keys other than strings are hashed by address, so the map is rehashed if any
+// of them has moved.
+static void
+map_forward(Map *map)
+{
+  bool moved = false;
+  for (int i = 0; i < map->capacity; ++i) {
+    if (!MAP_IS_FULL(map, i))
+      continue;
+    Value key = value_forward(map->keys[i]);
+    if (IS_OBJ(key) && !IS_STRING(key) && AS_OBJ(key) != AS_OBJ(map->keys[i]))
+      moved = true;
+    map->keys[i] = key;
+    map->values[i] = value_forward(map->values[i]);
+  }
+  if (moved)
+    map_rehash(map);
+}
+
+static void
+object_forward(Obj *object, void *context)
+{
+  VM *vm = context;
+  switch (object->type) {
+  case OBJ_ARRAY:
+    array_forward(&((ObjArray *) object)->elements);
+    break;
+  case OBJ_BOUND_METHOD: {
+    ObjBoundMethod *bound = (ObjBoundMethod *) object;
+    bound->receiver = value_forward(bound->receiver);
+    bound->method = (ObjClosure *) heap_forward((Obj *) bound->method);
+    break;
+  }
+  case OBJ_CLASS: {
+    ObjClass *class = (ObjClass *) object;
+    class->name = (ObjString *) heap_forward((Obj *) class->name);
+    table_forward(&class->methods);
+    break;
+  }
+  case OBJ_CLOSURE: {
+    ObjClosure *closure = (ObjClosure *) object;
+    closure->function = (ObjFunction *) heap_forward((Obj *) closure->function);
+    for (int i = 0; i < closure->upvalue_count; ++i)
+      closure->upvalues[i] =
+          (ObjUpvalue *) heap_forward((Obj *) closure->upvalues[i]);
+    break;
+  }
+  case OBJ_FUNCTION: {
+    ObjFunction *function = (ObjFunction *) object;
+    function->name = (ObjString *) heap_forward((Obj *) function->name);
+    array_forward(&function->chunk.constants);
+    if (function->lazy != NULL) {
+      function->lazy->source = (ObjString *) heap_forward(
+          (Obj *) function->lazy->source);
+      array_forward(&function->lazy->upvalue_names);
+    }
+    break;
+  }
+  case OBJ_INSTANCE: {
+    ObjInstance *instance = (ObjInstance *) object;
+    instance->class = (ObjClass *) heap_forward((Obj *) instance->class);
+    table_forward(&instance->fields);
+    break;
+  }
+  case OBJ_MAP:
+    map_forward(&((ObjMap *) object)->entries);
+    break;
+  case OBJ_UPVALUE: {
+    // Open upvalues point into the stack and are fixed up through the open
+    // upvalue list. A closed one must point at its own, possibly moved, copy
+    // of the value.
+    ObjUpvalue *upvalue = (ObjUpvalue *) object;
+    if (upvalue->location < vm->stack
+        || upvalue->location >= vm->stack + STACK_MAX)
+      upvalue->location = &upvalue->closed;
+    upvalue->closed = value_forward(upvalue->closed);
+    break;
+  }
+  case OBJ_STRING:
+    if (((ObjString *) object)->kind == STRING_ROPE) {
+      ObjRope *rope = (ObjRope *) object;
+      rope->left = (ObjString *) heap_forward((Obj *) rope->left);
+      rope->right = (ObjString *) heap_forward((Obj *) rope->right);
+    } else if (((ObjString *) object)->kind == STRING_SLICE) {
+      ObjSlice *slice = (ObjSlice *) object;
+      slice->parent = (ObjString *) heap_forward((Obj *) slice->parent);
+    }
+    break;
+  case OBJ_FLOAT_ARRAY:
+  case OBJ_NATIVE:
+    break;
+  }
+}
+
+static void
+roots_forward(VM *vm)
+{
+  for (Value *slot = vm->stack; slot < vm->stack_top; ++slot)
+    *slot = value_forward(*slot);
+  for (int i = 0; i < vm->frame_count; ++i)
+    vm->frames[i].closure =
+        (ObjClosure *) heap_forward((Obj *) vm->frames[i].closure);
+  vm->open_upvalues = (ObjUpvalue *) heap_forward((Obj *) vm->open_upvalues);
+  for (ObjUpvalue *upvalue = vm->open_upvalues; upvalue != NULL;
+      upvalue = upvalue->next)
+    upvalue->next = (ObjUpvalue *) heap_forward((Obj *) upvalue->next);
+  table_forward(&vm->globals);
+  array_forward(&vm->handles);
+  table_forward(&vm->strings);
+  vm->init_string = (ObjString *) heap_forward((Obj *) vm->init_string);
+}
+
+// A full collection that also moves the survivors of sparse pages together,
+// so that their pages can be returned. References held in C locals are not
+// updated, so this may only run at the interpreter's safe points.
 void
-collect_garbage()
+compact_garbage(VM *vm)
 {
   #ifdef DEBUG_LOG_GC
-  printf("-- gc begin\n");
-  size_t before = vm.bytes_allocated;
+  printf("-- compact begin\n");
+  size_t before = vm->bytes_allocated;
   #endif
-  mark_roots();
-  trace_references();
-  table_remove_white(&vm.strings);
-  sweep();
-  vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+  vm->compact_requested = false;
+  heap_sweep_all(&vm->heap);
+  vm->bytes_marked = 0;
+  mark_roots(vm);
+  trace_references(vm);
+  table_remove_white(&vm->strings);
+  heap_begin_sweep(&vm->heap);
+  heap_sweep_all(&vm->heap);
+  heap_evacuate(&vm->heap);
+  roots_forward(vm);
+  heap_visit(&vm->heap, object_forward, vm);
+  heap_release_evacuated(&vm->heap);
+  vm->bytes_since_gc = 0;
+  vm->next_gc = vm->bytes_marked * GC_HEAP_GROW_FACTOR;
+  if (vm->next_gc < GC_HEAP_MIN)
+    vm->next_gc = GC_HEAP_MIN;
   #ifdef DEBUG_LOG_GC
-  printf("-- gc end\n");
-  printf(" collected %zu bytes (from %zu to %zu) next at %zu\n",
-      before - vm.bytes_allocated, before, vm.bytes_allocated, vm.next_gc);
+  printf("-- compact end\n");
+  printf(" compacted %zu bytes (from %zu to %zu) next at %zu\n",
+      before - vm->bytes_allocated, before, vm->bytes_allocated, vm->next_gc);
   #endif
 }
 
 void
-free_objects()
+free_objects(VM *vm)
 {
-  Obj *object = vm.objects;
-  while (object != NULL) {
-    Obj *next = object->next;
-    free_object(object);
-    object = next;
-  }
-  free(vm.gray_stack);
+  heap_free(&vm->heap);
+  free(vm->gray_stack);
 }
@@ -4,33 +4,42 @@
 #include "common.h"
 #include "object.h"
 
-#define ALLOCATE(type, count) \
-  (type *) reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(vm, type, count) \
+  (type *) reallocate(vm, NULL, 0, sizeof(type) * (count))
 
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity) * 2)
 
-#define GROW_ARRAY(type, pointer, old_count, new_count) \
-  (type *) reallocate(pointer, sizeof(type) * (old_count), \
+#define GROW_ARRAY(vm, type, pointer, old_count, new_count) \
+  (type *) reallocate(vm, pointer, sizeof(type) * (old_count), \
                       sizeof(type) * (new_count))
 
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, type, pointer) reallocate(vm, pointer, sizeof(type), 0)
 
-#define FREE_ARRAY(type, pointer, old_count) \
-  reallocate(pointer, sizeof(type) * (old_count), 0)
+#define FREE_ARRAY(vm, type, pointer, old_count) \
+  reallocate(vm, pointer, sizeof(type) * (old_count), 0)
 
 void *
-reallocate(void *pointer, size_t old_size, size_t new_size);
+reallocate(VM *vm, void *pointer, size_t old_size, size_t new_size);
+
+void *
+allocate_slot(VM *vm, size_t size);
+
+void
+object_mark(VM *vm, Obj *object);
+
+void
+value_mark(VM *vm, Value value);
 
 void
-object_mark(Obj *object);
+free_object(VM *vm, Obj *object);
 
 void
-value_mark(Value value);
+collect_garbage(VM *vm);
 
 void
-collect_garbage();
+compact_garbage(VM *vm);
 
 void
-free_objects();
+free_objects(VM *vm);
 
 #endif
@@ -1,78 +1,160 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "floats.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJ(type, object_type) \
-  (type *) allocate_object(sizeof(type), object_type)
+#define ALLOCATE_OBJ(vm, type, object_type) \
+  (type *) allocate_object(vm, sizeof(type), object_type)
 
 static Obj *
-allocate_object(size_t size, ObjType type)
+allocate_object(VM *vm, size_t size, ObjType type)
 {
-  Obj *object = (Obj *) reallocate(NULL, 0, size);
+  Obj *object = (Obj *) allocate_slot(vm, size);
   object->type = type;
-  object->is_marked = false;
-  object->next = vm.objects;
-  vm.objects = object;
   #ifdef DEBUG_LOG_GC
   printf("%p allocate %zu for %d\n", (void *) object, size, type);
   #endif
   return object;
 }
 
-static ObjString *
-allocate_string(char *chars, int length, uint32_t hash)
+// A word-at-a-time hash after xxHash64. Strings of 32 bytes or more are
+// consumed by four independent lanes, the rest eight bytes at a time, and the
+// final avalanche spreads every input bit over the low 32 bits
+// that the tables use.
+#define HASH_PRIME1 UINT64_C(0x9e3779b185ebca87)
+#define HASH_PRIME2 UINT64_C(0xc2b2ae3d27d4eb4f)
+#define HASH_PRIME3 UINT64_C(0x165667b19e3779f9)
+#define HASH_PRIME4 UINT64_C(0x85ebca77c2b2ae63)
+#define HASH_PRIME5 UINT64_C(0x27d4eb2f165667c5)
+
+static uint64_t
+rotate_left(uint64_t x, int bits)
 {
-  ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-  string->length = length;
-  string->chars = chars;
-  string->hash = hash;
-  vm_stack_push(OBJ_VAL(string));
-  table_set(&vm.strings, string, NIL_VAL);
-  vm_stack_pop();
-  return string;
+  return (x << bits) | (x >> (64 - bits));
+}
+
+static uint64_t
+read_u64(const char *p)
+{
+  uint64_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
 }
 
 static uint32_t
+read_u32(const char *p)
+{
+  uint32_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
+}
+
+static uint64_t
+hash_round(uint64_t acc, uint64_t input)
+{
+  acc += input * HASH_PRIME2;
+  acc = rotate_left(acc, 31);
+  return acc * HASH_PRIME1;
+}
+
+static uint64_t
+hash_merge(uint64_t acc, uint64_t lane)
+{
+  acc ^= hash_round(0, lane);
+  return acc * HASH_PRIME1 + HASH_PRIME4;
+}
+
+uint32_t
 hash_string(const char *key, int length)
 {
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; ++i) {
-    hash ^= (uint8_t) key[i];
-    hash *= 16777619;
+  const char *p = key;
+  const char *end = key + length;
+  uint64_t hash;
+  if (length >= 32) {
+    uint64_t v1 = HASH_PRIME1 + HASH_PRIME2;
+    uint64_t v2 = HASH_PRIME2;
+    uint64_t v3 = 0;
+    uint64_t v4 = -HASH_PRIME1;
+    do {
+      v1 = hash_round(v1, read_u64(p));
+      v2 = hash_round(v2, read_u64(p + 8));
+      v3 = hash_round(v3, read_u64(p + 16));
+      v4 = hash_round(v4, read_u64(p + 24));
+      p += 32;
+    } while (p + 32 <= end);
+    hash = rotate_left(v1, 1) + rotate_left(v2, 7) + rotate_left(v3, 12)
+      + rotate_left(v4, 18);
+    hash = hash_merge(hash, v1);
+    hash = hash_merge(hash, v2);
+    hash = hash_merge(hash, v3);
+    hash = hash_merge(hash, v4);
+  } else
+    hash = HASH_PRIME5;
+  hash += (uint64_t) length;
+  for (; p + 8 <= end; p += 8) {
+    hash ^= hash_round(0, read_u64(p));
+    hash = rotate_left(hash, 27) * HASH_PRIME1 + HASH_PRIME4;
   }
-  return hash;
+  // The last one to seven bytes are folded into a single word, reading two
+  // overlapping halves or the first, middle and last byte.
+  int rest = (int) (end - p);
+  if (rest > 0) {
+    uint64_t word;
+    if (rest >= 4)
+      word = read_u32(p) | (uint64_t) read_u32(end - 4) << 32;
+    else
+      word = (uint64_t) (uint8_t) p[0] << 16
+        | (uint64_t) (uint8_t) p[rest / 2] << 8 | (uint8_t) end[-1];
+    hash ^= hash_round(0, word);
+    hash = rotate_left(hash, 27) * HASH_PRIME1 + HASH_PRIME4;
+  }
+  hash ^= hash >> 33;
+  hash *= HASH_PRIME2;
+  hash ^= hash >> 29;
+  hash *= HASH_PRIME3;
+  hash ^= hash >> 32;
+  return (uint32_t) hash;
+}
+
+ObjArray *
+new_array(VM *vm)
+{
+  ObjArray *array = ALLOCATE_OBJ(vm, ObjArray, OBJ_ARRAY);
+  value_array_init(&array->elements);
+  return array;
 }
 
 ObjBoundMethod *
-new_bound_method(Value receiver, ObjClosure *method)
+new_bound_method(VM *vm, Value receiver, ObjClosure *method)
 {
-  ObjBoundMethod *bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+  ObjBoundMethod *bound = ALLOCATE_OBJ(vm, ObjBoundMethod, OBJ_BOUND_METHOD);
   bound->receiver = receiver;
   bound->method = method;
   return bound;
 }
 
 ObjClass *
-new_class(ObjString *name)
+new_class(VM *vm, ObjString *name)
 {
-  ObjClass *class = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+  ObjClass *class = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
   class->name = name;
   table_init(&class->methods);
   return class;
 }
 
 ObjClosure *
-new_closure(ObjFunction *function)
+new_closure(VM *vm, ObjFunction *function)
 {
-  ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, function->upvalue_count);
+  ObjUpvalue **upvalues = ALLOCATE(vm, ObjUpvalue *, function->upvalue_count);
   for (int i = 0; i < function->upvalue_count; ++i)
     upvalues[i] = NULL;
-  ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+  ObjClosure *closure = ALLOCATE_OBJ(vm, ObjClosure, OBJ_CLOSURE);
   closure->function = function;
   closure->upvalues = upvalues;
   closure->upvalue_count = function->upvalue_count;
@@ -80,62 +162,286 @@ new_closure(ObjFunction *function)
 }
 
 ObjInstance *
-new_instance(ObjClass *class)
+new_instance(VM *vm, ObjClass *class)
 {
-  ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+  ObjInstance *instance = ALLOCATE_OBJ(vm, ObjInstance, OBJ_INSTANCE);
   instance->class = class;
   table_init(&instance->fields);
   return instance;
 }
 
+ObjFloatArray *
+new_float_array(VM *vm, int count)
+{
+  ObjFloatArray *array = (ObjFloatArray *) allocate_object(vm, 
+      sizeof(ObjFloatArray) + sizeof(double) * count, OBJ_FLOAT_ARRAY);
+  array->count = count;
+  floats_fill(array->values, count, 0);
+  return array;
+}
+
 ObjFunction *
-new_function()
+new_function(VM *vm)
 {
-  ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+  ObjFunction *function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->upvalue_count = 0;
+  function->calls = 0;
   function->name = NULL;
+  function->lazy = NULL;
   chunk_init(&function->chunk);
   return function;
 }
 
+ObjMap *
+new_map(VM *vm)
+{
+  ObjMap *map = ALLOCATE_OBJ(vm, ObjMap, OBJ_MAP);
+  map_init(&map->entries);
+  return map;
+}
+
 ObjNative *
-new_native(NativeFn function)
+new_native(VM *vm, NativeFn function, uint8_t arity)
 {
-  ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+  ObjNative *native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
+  native->arity = arity;
   native->function = function;
   return native;
 }
 
+// Allocates a string whose characters are stored inline after the header.
+// The caller fills in the characters and then passes it to intern_string.
 ObjString *
-take_string(char *chars, int length)
+allocate_string(VM *vm, int length)
 {
-  uint32_t hash = hash_string(chars, length);
-  ObjString *interned = table_find_string(&vm.strings, chars, length, hash);
-  if (interned != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
+  ObjString *string = (ObjString *) allocate_object(vm, 
+      sizeof(ObjString) + length + 1, OBJ_STRING);
+  string->kind = STRING_FLAT;
+  string->is_interned = false;
+  string->length = length;
+  string->hash = 0;
+  string->chars[length] = '\0';
+  return string;
+}
+
+static void
+add_interned(VM *vm, ObjString *string)
+{
+  string->is_interned = true;
+  vm_stack_push(vm, OBJ_VAL(string));
+  table_set(vm, &vm->strings, string, NIL_VAL);
+  vm_stack_pop(vm);
+}
+
+// Returns the interned string equal to the given flat string, which is
+// interned itself if there is no such string yet.
+ObjString *
+intern_string(VM *vm, ObjString *string)
+{
+  if (string->is_interned)
+    return string;
+  string->hash = hash_string(string->chars, string->length);
+  ObjString *interned = table_find_string(&vm->strings, string->chars,
+      string->length, string->hash);
+  if (interned != NULL)
     return interned;
-  }
-  return allocate_string(chars, length, hash);
+  add_interned(vm, string);
+  return string;
 }
 
 ObjString *
-copy_string(const char *chars, int length)
+copy_string(VM *vm, const char *chars, int length)
 {
   uint32_t hash = hash_string(chars, length);
-  ObjString *interned = table_find_string(&vm.strings, chars, length, hash);
+  ObjString *interned = table_find_string(&vm->strings, chars, length, hash);
   if (interned != NULL)
     return interned;
-  char *heap_chars = ALLOCATE(char, length + 1);
-  memcpy(heap_chars, chars, length);
-  heap_chars[length] = '\0';
-  return allocate_string(heap_chars, length, hash);
+  ObjString *string = allocate_string(vm, length);
+  memcpy(string->chars, chars, length);
+  string->hash = hash;
+  add_interned(vm, string);
+  return string;
+}
+
+ObjString *
+new_rope(VM *vm, ObjString *left, ObjString *right)
+{
+  ObjRope *rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_STRING);
+  rope->kind = STRING_ROPE;
+  rope->is_interned = false;
+  rope->length = left->length + right->length;
+  rope->hash = 0;
+  rope->left = left;
+  rope->right = right;
+  return (ObjString *) rope;
+}
+
+static void
+rope_push(ObjString ***stack, int *count, int *capacity, ObjString *string)
+{
+  if (*capacity < *count + 1) {
+    *capacity = GROW_CAPACITY(*capacity);
+    *stack = (ObjString **) realloc(*stack, sizeof(ObjString *) * *capacity);
+    if (*stack == NULL)
+      exit(1);
+  }
+  (*stack)[(*count)++] = string;
+}
+
+// Returns the characters of a string that needs no gathering: a flat string,
+// a slice or a rope that has been flattened. Returns NULL for other ropes.
+static const char *
+leaf_chars(ObjString *string)
+{
+  switch (string->kind) {
+  case STRING_FLAT:
+    return string->chars;
+  case STRING_SLICE: {
+    ObjSlice *slice = (ObjSlice *) string;
+    return slice->parent->chars + slice->offset;
+  }
+  default: {
+    ObjRope *rope = (ObjRope *) string;
+    return rope->right == NULL ? rope->left->chars : NULL;
+  }
+  }
+}
+
+// Copies the characters of a rope into dest, filling it from the end. Ropes
+// built by appending in a loop are deep, so the tree is walked with an
+// explicit stack. The stack is not allocated through the collector, as the
+// flat string being filled is not reachable yet.
+static void
+rope_copy(ObjString *string, char *dest)
+{
+  ObjString **stack = NULL;
+  int count = 0;
+  int capacity = 0;
+  int end = string->length;
+  rope_push(&stack, &count, &capacity, string);
+  while (count > 0) {
+    ObjString *node = stack[--count];
+    const char *chars = leaf_chars(node);
+    if (chars == NULL) {
+      rope_push(&stack, &count, &capacity, ((ObjRope *) node)->left);
+      rope_push(&stack, &count, &capacity, ((ObjRope *) node)->right);
+      continue;
+    }
+    end -= node->length;
+    memcpy(dest + end, chars, node->length);
+  }
+  free(stack);
+}
+
+static ObjString *
+slice_flatten(VM *vm, ObjSlice *slice)
+{
+  if (slice->offset == 0 && slice->parent->length == slice->length)
+    return slice->parent;
+  vm_stack_push(vm, OBJ_VAL(slice));
+  ObjString *flat = allocate_string(vm, slice->length);
+  memcpy(flat->chars, slice->parent->chars + slice->offset, slice->length);
+  slice->parent = flat;
+  slice->offset = 0;
+  vm_stack_pop(vm);
+  return flat;
+}
+
+ObjString *
+string_flatten(VM *vm, ObjString *string)
+{
+  if (string->kind == STRING_FLAT)
+    return string;
+  if (string->kind == STRING_SLICE)
+    return slice_flatten(vm, (ObjSlice *) string);
+  ObjRope *rope = (ObjRope *) string;
+  if (rope->right == NULL)
+    return rope->left;
+  vm_stack_push(vm, OBJ_VAL(string));
+  ObjString *flat = allocate_string(vm, string->length);
+  rope_copy(string, flat->chars);
+  rope->left = flat;
+  rope->right = NULL;
+  vm_stack_pop(vm);
+  return flat;
+}
+
+// Returns the characters of any string, gathering those of a rope first. The
+// string must be reachable, as gathering may trigger a collection.
+const char *
+string_chars(VM *vm, ObjString *string)
+{
+  const char *chars = leaf_chars(string);
+  return chars != NULL ? chars : string_flatten(vm, string)->chars;
+}
+
+// Returns length characters of a string starting at offset, which must be
+// within the string. The string must be reachable.
+ObjString *
+string_slice(VM *vm, ObjString *string, int offset, int length)
+{
+  if (offset == 0 && length == string->length)
+    return string;
+  if (string->kind == STRING_SLICE) {
+    offset += ((ObjSlice *) string)->offset;
+    string = ((ObjSlice *) string)->parent;
+  } else
+    string = string_flatten(vm, string);
+  if (length < SLICE_MIN_LENGTH) {
+    ObjString *copy = allocate_string(vm, length);
+    memcpy(copy->chars, string->chars + offset, length);
+    return copy;
+  }
+  ObjSlice *slice = ALLOCATE_OBJ(vm, ObjSlice, OBJ_STRING);
+  slice->kind = STRING_SLICE;
+  slice->is_interned = false;
+  slice->length = length;
+  slice->hash = 0;
+  slice->parent = string;
+  slice->offset = offset;
+  return (ObjString *) slice;
+}
+
+// Interned strings are equal only if they are the same object, any other pair
+// is compared by content. Both strings must be reachable, gathering a rope may
+// trigger a collection.
+bool
+strings_equal(VM *vm, ObjString *a, ObjString *b)
+{
+  if (a == b)
+    return true;
+  if (a->length != b->length || (a->is_interned && b->is_interned))
+    return false;
+  const char *a_chars = string_chars(vm, a);
+  const char *b_chars = string_chars(vm, b);
+  return memcmp(a_chars, b_chars, a->length) == 0;
+}
+
+static void
+print_string(ObjString *string)
+{
+  ObjString **stack = NULL;
+  int count = 0;
+  int capacity = 0;
+  rope_push(&stack, &count, &capacity, string);
+  while (count > 0) {
+    ObjString *node = stack[--count];
+    const char *chars = leaf_chars(node);
+    if (chars == NULL) {
+      rope_push(&stack, &count, &capacity, ((ObjRope *) node)->right);
+      rope_push(&stack, &count, &capacity, ((ObjRope *) node)->left);
+      continue;
+    }
+    fwrite(chars, sizeof(char), node->length, stdout);
+  }
+  free(stack);
 }
 
 ObjUpvalue *
-new_upvalue(Value *slot)
+new_upvalue(VM *vm, Value *slot)
 {
-  ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+  ObjUpvalue *upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
   upvalue->location = slot;
   upvalue->closed = NIL_VAL;
   upvalue->next = NULL;
@@ -151,10 +457,93 @@ print_function(ObjFunction *function)
     printf("<fn %s>", function->name->chars);
 }
 
+// The arrays and maps being printed, innermost first, so that one reached
+// again through its own elements is printed as [...] or {...} instead of
+// forever.
+typedef struct Printing {
+  Obj *object;
+  const struct Printing *enclosing;
+} Printing;
+
+static void
+print_nested(Value value, const Printing *printing);
+
+static bool
+is_printing(Obj *object, const Printing *printing)
+{
+  for (; printing != NULL; printing = printing->enclosing)
+    if (printing->object == object)
+      return true;
+  return false;
+}
+
+static void
+print_array(ObjArray *array, const Printing *enclosing)
+{
+  if (is_printing((Obj *) array, enclosing)) {
+    printf("[...]");
+    return;
+  }
+  Printing printing = { (Obj *) array, enclosing };
+  printf("[");
+  for (int i = 0; i < array->elements.count; ++i) {
+    if (i > 0)
+      printf(", ");
+    print_nested(array->elements.values[i], &printing);
+  }
+  printf("]");
+}
+
+static void
+print_float_array(ObjFloatArray *array)
+{
+  printf("[");
+  for (int i = 0; i < array->count; ++i)
+    printf(i > 0 ? ", %g" : "%g", array->values[i]);
+  printf("]");
+}
+
+static void
+print_map(ObjMap *map, const Printing *enclosing)
+{
+  if (is_printing((Obj *) map, enclosing)) {
+    printf("{...}");
+    return;
+  }
+  Printing printing = { (Obj *) map, enclosing };
+  bool first = true;
+  printf("{");
+  for (int i = 0; i < map->entries.capacity; ++i) {
+    if (!MAP_IS_FULL(&map->entries, i))
+      continue;
+    if (!first)
+      printf(", ");
+    first = false;
+    print_nested(map->entries.keys[i], &printing);
+    printf(": ");
+    print_nested(map->entries.values[i], &printing);
+  }
+  printf("}");
+}
+
+static void
+print_nested(Value value, const Printing *printing)
+{
+  if (IS_ARRAY(value))
+    print_array(AS_ARRAY(value), printing);
+  else if (IS_MAP(value))
+    print_map(AS_MAP(value), printing);
+  else
+    value_print(value);
+}
+
 void
 object_print(Value value)
 {
   switch (OBJ_TYPE(value)) {
+  case OBJ_ARRAY:
+    print_array(AS_ARRAY(value), NULL);
+    break;
   case OBJ_BOUND_METHOD:
     print_function(AS_BOUND_METHOD(value)->method->function);
     break;
@@ -164,17 +553,23 @@ object_print(Value value)
   case OBJ_CLOSURE:
     print_function(AS_CLOSURE(value)->function);
     break;
+  case OBJ_FLOAT_ARRAY:
+    print_float_array(AS_FLOAT_ARRAY(value));
+    break;
   case OBJ_FUNCTION:
     print_function(AS_FUNCTION(value));
     break;
   case OBJ_INSTANCE:
     printf("%s instance", AS_INSTANCE(value)->class->name->chars);
     break;
+  case OBJ_MAP:
+    print_map(AS_MAP(value), NULL);
+    break;
   case OBJ_NATIVE:
     printf("<native fn>");
     break;
   case OBJ_STRING:
-    printf("%s", AS_CSTRING(value));
+    print_string(AS_STRING(value));
     break;
   case OBJ_UPVALUE:
     printf("upvalue");
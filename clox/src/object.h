@@ -3,67 +3,138 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "map.h"
 #include "table.h"
 #include "value.h"
 
+#define ROPE_MIN_LENGTH 64
+#define SLICE_MIN_LENGTH 16
+
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
+#define IS_ARRAY(value) is_obj_type(value, OBJ_ARRAY)
 #define IS_BOUND_METHOD(value) is_obj_type(value, OBJ_BOUND_METHOD)
 #define IS_CLASS(value) is_obj_type(value, OBJ_CLASS)
 #define IS_CLOSURE(value) is_obj_type(value, OBJ_CLOSURE)
+#define IS_FLOAT_ARRAY(value) is_obj_type(value, OBJ_FLOAT_ARRAY)
 #define IS_FUNCTION(value) is_obj_type(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value) is_obj_type(value, OBJ_INSTANCE)
+#define IS_MAP(value) is_obj_type(value, OBJ_MAP)
 #define IS_NATIVE(value) is_obj_type(value, OBJ_NATIVE)
 #define IS_STRING(value) is_obj_type(value, OBJ_STRING)
 
+#define AS_ARRAY(value) ((ObjArray *) AS_OBJ(value))
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod *) AS_OBJ(value))
 #define AS_CLASS(value) ((ObjClass *) AS_OBJ(value))
 #define AS_CLOSURE(value) ((ObjClosure *) AS_OBJ(value))
+#define AS_FLOAT_ARRAY(value) ((ObjFloatArray *) AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction *) AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance *) AS_OBJ(value))
+#define AS_MAP(value) ((ObjMap *) AS_OBJ(value))
 #define AS_NATIVE(value) (((ObjNative *) AS_OBJ(value))->function)
 #define AS_STRING(value) ((ObjString *) AS_OBJ(value))
-#define AS_CSTRING(value) (((ObjString *) AS_OBJ(value))->chars)
 
 typedef enum {
+  OBJ_ARRAY,
   OBJ_BOUND_METHOD,
   OBJ_CLASS,
   OBJ_CLOSURE,
+  OBJ_FLOAT_ARRAY,
   OBJ_FUNCTION,
   OBJ_INSTANCE,
+  OBJ_MAP,
   OBJ_NATIVE,
   OBJ_STRING,
   OBJ_UPVALUE,
 } ObjType;
 
+// The header is a single byte. Mark bits live in the heap's page bitmaps and
+// objects are found through the pages rather than an intrusive list, so the
+// rest of the first word is free for the object's own small fields.
 struct Obj {
-  ObjType type;
-  bool is_marked;
-  struct Obj *next;
+  uint8_t type;
 };
 
+// The source of a function whose body is compiled on its first call. By
+// then the enclosing compilers are gone, so the variables the function
+// captures are resolved by their names, in upvalue order. A body that failed
+// to compile is not compiled again.
+typedef struct {
+  ObjString *source;
+  int start;
+  int length;
+  int line;
+  uint8_t type;
+  bool in_class;
+  bool has_superclass;
+  bool failed;
+  ValueArray upvalue_names;
+} LazyBody;
+
 typedef struct {
   Obj obj;
-  int arity;
-  int upvalue_count;
+  uint8_t arity;
+  uint16_t upvalue_count;
+  uint32_t calls;
   Chunk chunk;
   ObjString *name;
+  LazyBody *lazy;
 } ObjFunction;
 
-typedef Value (*NativeFn) (uint8_t arg_count, Value *args);
+// A native stores its result and returns true, or reports a runtime error and
+// returns false. Natives are only called with the arity they were defined with.
+typedef bool (*NativeFn) (VM *vm, Value *args, Value *result);
 
 typedef struct {
   Obj obj;
+  uint8_t arity;
   NativeFn function;
 } ObjNative;
 
+typedef enum {
+  STRING_FLAT,
+  STRING_ROPE,
+  STRING_SLICE,
+} StringKind;
+
+// Strings created at runtime are neither hashed nor interned until they are
+// first needed as a table key. The hash is only valid for interned strings.
 struct ObjString {
   Obj obj;
+  uint8_t kind;
+  bool is_interned;
   int length;
-  char *chars;
   uint32_t hash;
+  char chars[];
 };
 
+// The result of a long concatenation. Its characters are only gathered into a
+// flat string once they are needed, after which left holds that flat string
+// and right is NULL.
+typedef struct {
+  Obj obj;
+  uint8_t kind;
+  bool is_interned;
+  int length;
+  uint32_t hash;
+  ObjString *left;
+  ObjString *right;
+} ObjRope;
+
+// A part of a flat string, sharing its characters and keeping it alive. Parts
+// shorter than SLICE_MIN_LENGTH take no more memory as copies, so they are
+// never made into slices. A slice is copied into a flat string of its own
+// when it is flattened, which then becomes its parent.
+typedef struct {
+  Obj obj;
+  uint8_t kind;
+  bool is_interned;
+  int length;
+  uint32_t hash;
+  ObjString *parent;
+  int offset;
+} ObjSlice;
+
 typedef struct ObjUpvalue {
   Obj obj;
   Value *location;
@@ -73,9 +144,9 @@ typedef struct ObjUpvalue {
 
 typedef struct {
   Obj obj;
+  int upvalue_count;
   ObjFunction *function;
   ObjUpvalue **upvalues;
-  int upvalue_count;
 } ObjClosure;
 
 typedef struct {
@@ -96,32 +167,82 @@ typedef struct {
   ObjClosure *method;
 } ObjBoundMethod;
 
+// Elements are stored inline in a growable buffer, so indexing is a bounds
+// check and a load.
+typedef struct {
+  Obj obj;
+  ValueArray elements;
+} ObjArray;
+
+typedef struct {
+  Obj obj;
+  Map entries;
+} ObjMap;
+
+// A fixed length buffer of unboxed doubles, stored inline after the header,
+// for the bulk numeric natives.
+typedef struct {
+  Obj obj;
+  int count;
+  double values[];
+} ObjFloatArray;
+
+ObjArray *
+new_array(VM *vm);
+
 ObjBoundMethod *
-new_bound_method(Value receiver, ObjClosure *method);
+new_bound_method(VM *vm, Value receiver, ObjClosure *method);
 
 ObjClass *
-new_class(ObjString *name);
+new_class(VM *vm, ObjString *name);
 
 ObjClosure *
-new_closure(ObjFunction *function);
+new_closure(VM *vm, ObjFunction *function);
+
+ObjFloatArray *
+new_float_array(VM *vm, int count);
 
 ObjFunction *
-new_function();
+new_function(VM *vm);
 
 ObjInstance *
-new_instance(ObjClass *class);
+new_instance(VM *vm, ObjClass *class);
+
+ObjMap *
+new_map(VM *vm);
 
 ObjNative *
-new_native(NativeFn function);
+new_native(VM *vm, NativeFn function, uint8_t arity);
 
 ObjString *
-take_string(char *chars, int length);
+allocate_string(VM *vm, int length);
+
+uint32_t
+hash_string(const char *key, int length);
 
 ObjString *
-copy_string(const char *chars, int length);
+intern_string(VM *vm, ObjString *string);
+
+ObjString *
+copy_string(VM *vm, const char *chars, int length);
+
+ObjString *
+new_rope(VM *vm, ObjString *left, ObjString *right);
+
+ObjString *
+string_flatten(VM *vm, ObjString *string);
+
+const char *
+string_chars(VM *vm, ObjString *string);
+
+ObjString *
+string_slice(VM *vm, ObjString *string, int offset, int length);
+
+bool
+strings_equal(VM *vm, ObjString *a, ObjString *b);
 
 ObjUpvalue *
-new_upvalue(Value *slot);
+new_upvalue(VM *vm, Value *slot);
 
 void
 object_print(Value value);
@@ -1,235 +1,385 @@
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "common.h"
 #include "scanner.h"
 
+// Character classes, looked up in a table indexed by the byte.
+#define CHAR_ALPHA 0x01
+#define CHAR_DIGIT 0x02
+#define CHAR_SPACE 0x04
+#define CHAR_BLOCK 0x08
+
+// Keywords are found by a perfect hash of their first two characters and
+// length into KEYWORD_SLOTS slots.
+#define KEYWORD_SLOTS 32
+#define KEYWORD_HASH(start, length) \
+  (((uint8_t) (start)[0] * 4 + (uint8_t) (start)[1] * 3 + (length)) \
+   % KEYWORD_SLOTS)
+
 typedef struct {
-  const char *start;
-  const char *current;
-  int line;
-} Scanner;
+  const char *text;
+  int length;
+  TokenType type;
+} Keyword;
+
+static const uint8_t char_classes[256] = {
+  ['a'] = CHAR_ALPHA, ['b'] = CHAR_ALPHA, ['c'] = CHAR_ALPHA,
+  ['d'] = CHAR_ALPHA, ['e'] = CHAR_ALPHA, ['f'] = CHAR_ALPHA,
+  ['g'] = CHAR_ALPHA, ['h'] = CHAR_ALPHA, ['i'] = CHAR_ALPHA,
+  ['j'] = CHAR_ALPHA, ['k'] = CHAR_ALPHA, ['l'] = CHAR_ALPHA,
+  ['m'] = CHAR_ALPHA, ['n'] = CHAR_ALPHA, ['o'] = CHAR_ALPHA,
+  ['p'] = CHAR_ALPHA, ['q'] = CHAR_ALPHA, ['r'] = CHAR_ALPHA,
+  ['s'] = CHAR_ALPHA, ['t'] = CHAR_ALPHA, ['u'] = CHAR_ALPHA,
+  ['v'] = CHAR_ALPHA, ['w'] = CHAR_ALPHA, ['x'] = CHAR_ALPHA,
+  ['y'] = CHAR_ALPHA, ['z'] = CHAR_ALPHA,
+  ['A'] = CHAR_ALPHA, ['B'] = CHAR_ALPHA, ['C'] = CHAR_ALPHA,
+  ['D'] = CHAR_ALPHA, ['E'] = CHAR_ALPHA, ['F'] = CHAR_ALPHA,
+  ['G'] = CHAR_ALPHA, ['H'] = CHAR_ALPHA, ['I'] = CHAR_ALPHA,
+  ['J'] = CHAR_ALPHA, ['K'] = CHAR_ALPHA, ['L'] = CHAR_ALPHA,
+  ['M'] = CHAR_ALPHA, ['N'] = CHAR_ALPHA, ['O'] = CHAR_ALPHA,
+  ['P'] = CHAR_ALPHA, ['Q'] = CHAR_ALPHA, ['R'] = CHAR_ALPHA,
+  ['S'] = CHAR_ALPHA, ['T'] = CHAR_ALPHA, ['U'] = CHAR_ALPHA,
+  ['V'] = CHAR_ALPHA, ['W'] = CHAR_ALPHA, ['X'] = CHAR_ALPHA,
+  ['Y'] = CHAR_ALPHA, ['Z'] = CHAR_ALPHA, ['_'] = CHAR_ALPHA,
+  ['0'] = CHAR_DIGIT, ['1'] = CHAR_DIGIT, ['2'] = CHAR_DIGIT,
+  ['3'] = CHAR_DIGIT, ['4'] = CHAR_DIGIT, ['5'] = CHAR_DIGIT,
+  ['6'] = CHAR_DIGIT, ['7'] = CHAR_DIGIT, ['8'] = CHAR_DIGIT,
+  ['9'] = CHAR_DIGIT,
+  [' '] = CHAR_SPACE, ['\t'] = CHAR_SPACE, ['\r'] = CHAR_SPACE,
+  ['\n'] = CHAR_SPACE | CHAR_BLOCK,
+  ['{'] = CHAR_BLOCK, ['}'] = CHAR_BLOCK, ['"'] = CHAR_BLOCK,
+  ['/'] = CHAR_BLOCK,
+};
 
-Scanner scanner;
+static const Keyword keywords[KEYWORD_SLOTS] = {
+  [0] = { "false", 5, TOKEN_FALSE },
+  [8] = { "for", 3, TOKEN_FOR },
+  [10] = { "true", 4, TOKEN_TRUE },
+  [12] = { "this", 4, TOKEN_THIS },
+  [16] = { "super", 5, TOKEN_SUPER },
+  [17] = { "and", 3, TOKEN_AND },
+  [20] = { "or", 2, TOKEN_OR },
+  [21] = { "class", 5, TOKEN_CLASS },
+  [22] = { "nil", 3, TOKEN_NIL },
+  [24] = { "if", 2, TOKEN_IF },
+  [25] = { "while", 5, TOKEN_WHILE },
+  [26] = { "fun", 3, TOKEN_FUN },
+  [27] = { "print", 5, TOKEN_PRINT },
+  [28] = { "else", 4, TOKEN_ELSE },
+  [29] = { "return", 6, TOKEN_RETURN },
+  [30] = { "var", 3, TOKEN_VAR },
+};
 
 void
-scanner_init(const char *source)
+scanner_init(Scanner *scanner, const char *source, size_t length, int line)
 {
-  scanner.start = source;
-  scanner.current = source;
-  scanner.line = 1;
+  scanner->start = source;
+  scanner->current = source;
+  scanner->end = source + length;
+  scanner->line = line;
 }
 
 static bool
-is_alpha(char c)
+has_class(char c, uint8_t classes)
 {
-  return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_';
+  return (char_classes[(uint8_t) c] & classes) != 0;
 }
 
-static bool
-is_digit(char c)
+#ifdef __SSE2__
+static int
+count_bits(unsigned mask)
 {
-  return '0' <= c && c <= '9';
+  #ifdef __GNUC__
+  return __builtin_popcount(mask);
+  #else
+  int count = 0;
+  for (; mask != 0; mask &= mask - 1)
+    count++;
+  return count;
+  #endif
 }
 
+static int
+lowest_bit(unsigned mask)
+{
+  #ifdef __GNUC__
+  return __builtin_ctz(mask);
+  #else
+  int bit = 0;
+  while ((mask & 1) == 0) {
+    mask >>= 1;
+    bit++;
+  }
+  return bit;
+  #endif
+}
+#endif
+
 static bool
-is_at_end()
+is_at_end(Scanner *scanner)
 {
-  return *scanner.current == '\0';
+  return scanner->current == scanner->end;
 }
 
 static char
-advance()
+advance(Scanner *scanner)
 {
-  scanner.current++;
-  return scanner.current[-1];
+  scanner->current++;
+  return scanner->current[-1];
 }
 
+// Past the end of the source, which need not be terminated, the scanner
+// sees NUL characters.
 static char
-peek()
+peek(Scanner *scanner)
 {
-  return *scanner.current;
+  if (is_at_end(scanner))
+    return '\0';
+  return *scanner->current;
 }
 
 static char
-peek_next()
+peek_next(Scanner *scanner)
 {
-  if (is_at_end())
+  if (scanner->end - scanner->current < 2)
     return '\0';
   else
-    return scanner.current[1];
+    return scanner->current[1];
 }
 
 static bool
-match(char expected)
+match(Scanner *scanner, char expected)
 {
-  if (is_at_end())
+  if (is_at_end(scanner))
     return false;
-  else if (*scanner.current != expected)
+  else if (*scanner->current != expected)
     return false;
-  scanner.current++;
+  scanner->current++;
   return true;
 }
 
 static Token
-make_token(TokenType type)
+make_token(Scanner *scanner, TokenType type)
 {
   Token token;
   token.type = type;
-  token.start = scanner.start;
-  token.length = scanner.current - scanner.start;
-  token.line = scanner.line;
+  token.start = scanner->start;
+  token.length = scanner->current - scanner->start;
+  token.line = scanner->line;
   return token;
 }
 
 static Token
-error_token(const char *message)
+error_token(Scanner *scanner, const char *message)
 {
   Token token;
   token.type = TOKEN_ERROR;
   token.start = message;
   token.length = strlen(message);
-  token.line = scanner.line;
+  token.line = scanner->line;
   return token;
 }
 
+// Most runs of blanks are a single space, which is skipped right away.
+// Longer runs, such as indentation, are skipped sixteen bytes at a time
+// where the source allows.
 static void
-skip_whitespace()
+skip_blanks(Scanner *scanner)
 {
-  for (;;) {
-    char c = peek();
-    switch (c) {
-    case ' ':
-    case '\r':
-    case '\t':
-      advance();
-      break;
-    case '\n':
-      scanner.line++;
-      advance();
-      break;
-    case '/':
-      if (peek_next() == '/')
-        while (peek() != '\n' && !is_at_end())
-          advance();
-      else
-        return;
-      break;
-    default:
-      return;
+  if (is_at_end(scanner) || !has_class(*scanner->current, CHAR_SPACE))
+    return;
+  if (*scanner->current++ == '\n')
+    scanner->line++;
+  while (!is_at_end(scanner) && has_class(*scanner->current, CHAR_SPACE)) {
+#ifdef __SSE2__
+    if (scanner->end - scanner->current >= 16) {
+      __m128i chunk = _mm_loadu_si128((const __m128i *) scanner->current);
+      unsigned newlines = (unsigned) _mm_movemask_epi8(
+          _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n')));
+      __m128i blank = _mm_or_si128(
+          _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')),
+            _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t'))),
+          _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\r')));
+      unsigned blanks = (unsigned) _mm_movemask_epi8(blank) | newlines;
+      int run = lowest_bit(~blanks);
+      scanner->line += count_bits(newlines & ((1u << run) - 1));
+      scanner->current += run;
+      continue;
     }
+#endif
+    if (*scanner->current == '\n')
+      scanner->line++;
+    scanner->current++;
   }
 }
 
-static TokenType
-check_keyword(int start, int length, const char *rest, TokenType type)
+static void
+skip_whitespace(Scanner *scanner)
 {
-  if (scanner.current - scanner.start == start + length
-      && memcmp(scanner.start + start, rest, length) == 0)
-    return type;
-  return TOKEN_IDENTIFIER;
+  for (;;) {
+    skip_blanks(scanner);
+    if (peek(scanner) != '/' || peek_next(scanner) != '/')
+      return;
+    const char *newline = memchr(scanner->current, '\n',
+        scanner->end - scanner->current);
+    scanner->current = newline != NULL ? newline : scanner->end;
+  }
 }
 
 static TokenType
-identifier_type()
-{
-  switch (scanner.start[0]) {
-  case 'a': return check_keyword(1, 2, "nd", TOKEN_AND);
-  case 'c': return check_keyword(1, 4, "lass", TOKEN_CLASS);
-  case 'e': return check_keyword(1, 3, "lse", TOKEN_ELSE);
-  case 'f':
-    if (scanner.current - scanner.start > 1) {
-      switch (scanner.start[1]) {
-      case 'a': return check_keyword(2, 3, "lse", TOKEN_FALSE);
-      case 'o': return check_keyword(2, 1, "r", TOKEN_FOR);
-      case 'u': return check_keyword(2, 1, "n", TOKEN_FUN);
-      }
-    }
-    break;
-  case 'i': return check_keyword(1, 1, "f", TOKEN_IF);
-  case 'n': return check_keyword(1, 2, "il", TOKEN_NIL);
-  case 'o': return check_keyword(1, 1, "r", TOKEN_OR);
-  case 'p': return check_keyword(1, 4, "rint", TOKEN_PRINT);
-  case 'r': return check_keyword(1, 5, "eturn", TOKEN_RETURN);
-  case 's': return check_keyword(1, 4, "uper", TOKEN_SUPER);
-  case 't':
-    if (scanner.current - scanner.start > 1) {
-      switch (scanner.start[1]) {
-      case 'h': return check_keyword(2, 2, "is", TOKEN_THIS);
-      case 'r': return check_keyword(2, 2, "ue", TOKEN_TRUE);
-      }
-    }
-    break;
-  case 'v': return check_keyword(1, 2, "ar", TOKEN_VAR);
-  case 'w': return check_keyword(1, 4, "hile", TOKEN_WHILE);
-  }
+identifier_type(Scanner *scanner)
+{
+  int length = (int) (scanner->current - scanner->start);
+  if (length < 2)
+    return TOKEN_IDENTIFIER;
+  const Keyword *keyword = &keywords[KEYWORD_HASH(scanner->start, length)];
+  if (keyword->length == length
+      && memcmp(scanner->start, keyword->text, length) == 0)
+    return keyword->type;
   return TOKEN_IDENTIFIER;
 }
 
 static Token
-identifier()
+identifier(Scanner *scanner)
 {
-  while (is_alpha(peek()) || is_digit(peek()))
-    advance();
-  return make_token(identifier_type());
+  while (!is_at_end(scanner)
+      && has_class(*scanner->current, CHAR_ALPHA | CHAR_DIGIT))
+    scanner->current++;
+  return make_token(scanner, identifier_type(scanner));
 }
 
 static Token
-number()
-{
-  while (is_digit(peek()))
-    advance();
-  if (peek() == '.' && is_digit(peek_next())) {
-    advance();
-    while (is_digit(peek()))
-      advance();
+number(Scanner *scanner)
+{
+  while (!is_at_end(scanner) && has_class(*scanner->current, CHAR_DIGIT))
+    scanner->current++;
+  if (peek(scanner) == '.' && has_class(peek_next(scanner), CHAR_DIGIT)) {
+    advance(scanner);
+    while (!is_at_end(scanner) && has_class(*scanner->current, CHAR_DIGIT))
+      scanner->current++;
   }
-  return make_token(TOKEN_NUMBER);
+  return make_token(scanner, TOKEN_NUMBER);
 }
 
+// Finds the closing quote sixteen bytes at a time, counting the newlines
+// on the way.
 static Token
-string()
+string(Scanner *scanner)
 {
-  while (peek() != '"' && !is_at_end()) {
-    if (peek() == '\n')
-      scanner.line++;
-    advance();
+#ifdef __SSE2__
+  while (scanner->end - scanner->current >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *) scanner->current);
+    unsigned quotes = (unsigned) _mm_movemask_epi8(
+        _mm_cmpeq_epi8(chunk, _mm_set1_epi8('"')));
+    unsigned newlines = (unsigned) _mm_movemask_epi8(
+        _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n')));
+    if (quotes != 0) {
+      int quote = lowest_bit(quotes);
+      scanner->line += count_bits(newlines & ((1u << quote) - 1));
+      scanner->current += quote + 1;
+      return make_token(scanner, TOKEN_STRING);
+    }
+    scanner->line += count_bits(newlines);
+    scanner->current += 16;
   }
-  if (is_at_end())
-    return error_token("Unterminated string.");
-  advance();
-  return make_token(TOKEN_STRING);
+#endif
+  while (peek(scanner) != '"' && !is_at_end(scanner)) {
+    if (peek(scanner) == '\n')
+      scanner->line++;
+    advance(scanner);
+  }
+  if (is_at_end(scanner))
+    return error_token(scanner, "Unterminated string.");
+  advance(scanner);
+  return make_token(scanner, TOKEN_STRING);
 }
 
 Token
-scanner_scan_token()
-{
-  skip_whitespace();
-  scanner.start = scanner.current;
-  if (is_at_end())
-    return make_token(TOKEN_EOF);
-  char c = advance();
-  if (is_alpha(c))
-    return identifier();
-  if (is_digit(c))
-    return number();
+scanner_scan_token(Scanner *scanner)
+{
+  skip_whitespace(scanner);
+  scanner->start = scanner->current;
+  if (is_at_end(scanner))
+    return make_token(scanner, TOKEN_EOF);
+  char c = advance(scanner);
+  if (has_class(c, CHAR_ALPHA))
+    return identifier(scanner);
+  if (has_class(c, CHAR_DIGIT))
+    return number(scanner);
   switch (c) {
-  case '(': return make_token(TOKEN_LEFT_PAREN);
-  case ')': return make_token(TOKEN_RIGHT_PAREN);
-  case '{': return make_token(TOKEN_LEFT_BRACE);
-  case '}': return make_token(TOKEN_RIGHT_BRACE);
-  case ';': return make_token(TOKEN_SEMICOLON);
-  case ',': return make_token(TOKEN_COMMA);
-  case '.': return make_token(TOKEN_DOT);
-  case '-': return make_token(TOKEN_MINUS);
-  case '+': return make_token(TOKEN_PLUS);
-  case '/': return make_token(TOKEN_SLASH);
-  case '*': return make_token(TOKEN_STAR);
-  case '!': return make_token(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
-  case '=': return make_token(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
-  case '<': return make_token(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
-  case '>': return make_token(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
-  case '"': return string();
+  case '(': return make_token(scanner, TOKEN_LEFT_PAREN);
+  case ')': return make_token(scanner, TOKEN_RIGHT_PAREN);
+  case '{': return make_token(scanner, TOKEN_LEFT_BRACE);
+  case '}': return make_token(scanner, TOKEN_RIGHT_BRACE);
+  case '[': return make_token(scanner, TOKEN_LEFT_BRACKET);
+  case ']': return make_token(scanner, TOKEN_RIGHT_BRACKET);
+  case ';': return make_token(scanner, TOKEN_SEMICOLON);
+  case ':': return make_token(scanner, TOKEN_COLON);
+  case ',': return make_token(scanner, TOKEN_COMMA);
+  case '.': return make_token(scanner, TOKEN_DOT);
+  case '-': return make_token(scanner, TOKEN_MINUS);
+  case '+': return make_token(scanner, TOKEN_PLUS);
+  case '/': return make_token(scanner, TOKEN_SLASH);
+  case '*': return make_token(scanner, TOKEN_STAR);
+  case '!':
+    return make_token(scanner,
+        match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+  case '=':
+    return make_token(scanner,
+        match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+  case '<':
+    return make_token(scanner,
+        match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+  case '>':
+    return make_token(scanner,
+        match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+  case '"': return string(scanner);
+  }
+  return error_token(scanner, "Unexpected character.");
+}
+
+// Skips to the brace closing a block nested depth deep without making any
+// tokens, only stepping over strings and comments. Returns that brace, the
+// end of the source or an unterminated string.
+Token
+scanner_skip_block(Scanner *scanner, int depth)
+{
+  for (;;) {
+    while (!is_at_end(scanner) && !has_class(*scanner->current, CHAR_BLOCK))
+      scanner->current++;
+    scanner->start = scanner->current;
+    if (is_at_end(scanner))
+      return make_token(scanner, TOKEN_EOF);
+    switch (advance(scanner)) {
+    case '\n':
+      scanner->line++;
+      break;
+    case '{':
+      depth++;
+      break;
+    case '}':
+      if (--depth == 0)
+        return make_token(scanner, TOKEN_RIGHT_BRACE);
+      break;
+    case '"': {
+      Token token = string(scanner);
+      if (token.type == TOKEN_ERROR)
+        return token;
+      break;
+    }
+    case '/':
+      if (peek(scanner) == '/') {
+        const char *newline = memchr(scanner->current, '\n',
+            scanner->end - scanner->current);
+        scanner->current = newline != NULL ? newline : scanner->end;
+      }
+      break;
+    }
   }
-  return error_token("Unexpected character.");
 }
@@ -1,11 +1,14 @@
 #ifndef CLOX_SCANNER_H
 #define CLOX_SCANNER_H
 
+#include <stddef.h>
+
 typedef enum {
   // Single-character tokens.
   TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
-  TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
+  TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
+  TOKEN_COLON, TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
   TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
   // One or two character tokens.
   TOKEN_BANG, TOKEN_BANG_EQUAL,
@@ -30,10 +33,21 @@ typedef struct {
   int line;
 } Token;
 
+// The position in the source being scanned. Each compilation has its own.
+typedef struct {
+  const char *start;
+  const char *current;
+  const char *end;
+  int line;
+} Scanner;
+
 void
-scanner_init(const char *source);
+scanner_init(Scanner *scanner, const char *source, size_t length, int line);
+
+Token
+scanner_scan_token(Scanner *scanner);
 
 Token
-scanner_scan_token();
+scanner_skip_block(Scanner *scanner, int depth);
 
 #endif
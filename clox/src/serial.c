@@ -0,0 +1,445 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "serial.h"
+
+void
+serial_writer_init(Writer *writer)
+{
+  writer->bytes = NULL;
+  writer->count = 0;
+  writer->capacity = 0;
+  writer->failed = false;
+}
+
+void
+serial_writer_free(Writer *writer)
+{
+  free(writer->bytes);
+  serial_writer_init(writer);
+}
+
+void
+serial_write_bytes(Writer *writer, const void *bytes, size_t count)
+{
+  if (writer->failed)
+    return;
+  if (writer->capacity < writer->count + count) {
+    size_t capacity = writer->capacity < 256 ? 256 : writer->capacity;
+    while (capacity < writer->count + count)
+      capacity *= 2;
+    uint8_t *grown = realloc(writer->bytes, capacity);
+    if (grown == NULL) {
+      writer->failed = true;
+      return;
+    }
+    writer->bytes = grown;
+    writer->capacity = capacity;
+  }
+  memcpy(writer->bytes + writer->count, bytes, count);
+  writer->count += count;
+}
+
+void
+serial_write_byte(Writer *writer, uint8_t byte)
+{
+  serial_write_bytes(writer, &byte, 1);
+}
+
+// Unsigned LEB128: seven bits per byte, the high bit set on all but the last.
+void
+serial_write_varint(Writer *writer, uint32_t value)
+{
+  while (value >= 0x80) {
+    serial_write_byte(writer, (uint8_t) (value | 0x80));
+    value >>= 7;
+  }
+  serial_write_byte(writer, (uint8_t) value);
+}
+
+void
+serial_write_number(Writer *writer, double number)
+{
+  serial_write_bytes(writer, &number, sizeof(number));
+}
+
+// Flattens the string, which may allocate.
+void
+serial_write_string(VM *vm, Writer *writer, ObjString *string)
+{
+  const char *chars = string_chars(vm, string);
+  serial_write_varint(writer, (uint32_t) string->length);
+  serial_write_bytes(writer, chars, string->length);
+}
+
+// The line table is stored as runs of (line, instruction count).
+void
+serial_write_code(Writer *writer, Chunk *chunk)
+{
+  serial_write_varint(writer, (uint32_t) chunk->count);
+  serial_write_bytes(writer, chunk->code, chunk->count);
+  serial_write_varint(writer, (uint32_t) chunk->line_count);
+  for (int i = 0; i < chunk->line_count; ++i) {
+    int end = i + 1 < chunk->line_count
+      ? chunk->lines[i + 1].offset : chunk->count;
+    serial_write_varint(writer, (uint32_t) chunk->lines[i].line);
+    serial_write_varint(writer, (uint32_t) (end - chunk->lines[i].offset));
+  }
+}
+
+const uint8_t *
+serial_read_bytes(Reader *reader, size_t count)
+{
+  if (reader->failed || (size_t) (reader->end - reader->current) < count) {
+    reader->failed = true;
+    return NULL;
+  }
+  const uint8_t *bytes = reader->current;
+  reader->current += count;
+  return bytes;
+}
+
+uint8_t
+serial_read_byte(Reader *reader)
+{
+  const uint8_t *byte = serial_read_bytes(reader, 1);
+  return byte != NULL ? *byte : 0;
+}
+
+uint32_t
+serial_read_varint(Reader *reader)
+{
+  uint32_t value = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    uint8_t byte = serial_read_byte(reader);
+    value |= (uint32_t) (byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0)
+      return value;
+  }
+  reader->failed = true;
+  return 0;
+}
+
+double
+serial_read_number(Reader *reader)
+{
+  double number = 0;
+  const uint8_t *bytes = serial_read_bytes(reader, sizeof(number));
+  if (bytes != NULL)
+    memcpy(&number, bytes, sizeof(number));
+  return number;
+}
+
+// Strings come back interned.
+ObjString *
+serial_read_string(VM *vm, Reader *reader)
+{
+  uint32_t length = serial_read_varint(reader);
+  const uint8_t *chars = serial_read_bytes(reader, length);
+  if (chars == NULL)
+    return NULL;
+  return copy_string(vm, (const char *) chars, (int) length);
+}
+
+// Code is copied straight out of the file, and the line runs turn back
+// into the offsets where they start.
+void
+serial_read_code(VM *vm, Reader *reader, Chunk *chunk)
+{
+  uint32_t count = serial_read_varint(reader);
+  const uint8_t *code = serial_read_bytes(reader, count);
+  // Every chunk ends in a return, so it is never empty.
+  if (code == NULL || count == 0 || count > INT32_MAX) {
+    reader->failed = true;
+    return;
+  }
+  chunk->code = GROW_ARRAY(vm, uint8_t, NULL, 0, count);
+  chunk->capacity = (int) count;
+  chunk->count = (int) count;
+  memcpy(chunk->code, code, count);
+  uint32_t runs = serial_read_varint(reader);
+  if (runs > count) {
+    reader->failed = true;
+    return;
+  }
+  chunk->lines = GROW_ARRAY(vm, LineRun, NULL, 0, runs);
+  chunk->line_capacity = (int) runs;
+  uint32_t filled = 0;
+  for (uint32_t i = 0; i < runs && !reader->failed; ++i) {
+    int line = (int) serial_read_varint(reader);
+    uint32_t run = serial_read_varint(reader);
+    if (run == 0 || run > count - filled) {
+      reader->failed = true;
+      return;
+    }
+    chunk->lines[i].offset = (int) filled;
+    chunk->lines[i].line = line;
+    chunk->line_count++;
+    filled += run;
+  }
+  if (filled != count)
+    reader->failed = true;
+}
+
+// Set in the flags serial_check_code keeps for each byte of the code.
+#define CODE_START 1
+#define CODE_TARGET 2
+
+// Looks up the constant named by the operand after the opcode at offset,
+// which the long forms of the instructions make three bytes wide.
+static bool
+read_operand_constant(Chunk *chunk, int offset, bool wide, Value *constant)
+{
+  if (chunk->count - offset <= (wide ? 3 : 1))
+    return false;
+  const uint8_t *operand = chunk->code + offset + 1;
+  uint32_t index = wide
+    ? (uint32_t) operand[0] << 16 | operand[1] << 8 | operand[2]
+    : operand[0];
+  if (index >= (uint32_t) chunk->constants.count)
+    return false;
+  *constant = chunk->constants.values[index];
+  return true;
+}
+
+// Returns the offset of the instruction after the one at offset, or -1 if
+// the instruction is not valid. Jump targets are only marked, since a
+// forward jump lands on an instruction not reached yet.
+static int
+check_instruction(ObjFunction *function, int offset, uint8_t *flags)
+{
+  Chunk *chunk = &function->chunk;
+  const uint8_t *code = chunk->code + offset;
+  int left = chunk->count - offset;
+  bool wide = code[0] >= OP_CONSTANT_LONG;
+  int width = wide ? 3 : 1;
+  Value constant;
+  switch (code[0]) {
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_POP:
+  case OP_INDEX_GET:
+  case OP_INDEX_SET:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_NOT:
+  case OP_NEGATE:
+  case OP_GREATER_NUMBER:
+  case OP_LESS_NUMBER:
+  case OP_ADD_NUMBER:
+  case OP_SUBTRACT_NUMBER:
+  case OP_MULTIPLY_NUMBER:
+  case OP_DIVIDE_NUMBER:
+  case OP_NEGATE_NUMBER:
+  case OP_PRINT:
+  case OP_CLOSE_UPVALUE:
+  case OP_RETURN:
+  case OP_INHERIT:
+    return offset + 1;
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_CALL:
+  case OP_ARRAY:
+  case OP_MAP:
+    return left >= 2 ? offset + 2 : -1;
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+    return left >= 2 && code[1] < function->upvalue_count ? offset + 2 : -1;
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+    return read_operand_constant(chunk, offset, wide, &constant)
+      ? offset + 1 + width : -1;
+  case OP_GET_GLOBAL:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+  case OP_GET_SUPER:
+  case OP_CLASS:
+  case OP_METHOD:
+  case OP_GET_GLOBAL_LONG:
+  case OP_DEFINE_GLOBAL_LONG:
+  case OP_SET_GLOBAL_LONG:
+  case OP_GET_PROPERTY_LONG:
+  case OP_SET_PROPERTY_LONG:
+  case OP_GET_SUPER_LONG:
+  case OP_CLASS_LONG:
+  case OP_METHOD_LONG:
+    return read_operand_constant(chunk, offset, wide, &constant)
+      && IS_STRING(constant) ? offset + 1 + width : -1;
+  case OP_INVOKE:
+  case OP_SUPER_INVOKE:
+  case OP_INVOKE_LONG:
+  case OP_SUPER_INVOKE_LONG:
+    return read_operand_constant(chunk, offset, wide, &constant)
+      && IS_STRING(constant) && left >= 2 + width ? offset + 2 + width : -1;
+  case OP_CLOSURE:
+  case OP_CLOSURE_LONG: {
+    if (!read_operand_constant(chunk, offset, wide, &constant)
+        || !IS_FUNCTION(constant))
+      return -1;
+    // Each upvalue of the new closure is a pair of whether it captures a
+    // local and the index of the local or of an upvalue of this function.
+    int upvalues = 2 * AS_FUNCTION(constant)->upvalue_count;
+    if (left < 1 + width + upvalues)
+      return -1;
+    for (int i = 1 + width; i < 1 + width + upvalues; i += 2) {
+      if (code[i] == 0 && code[i + 1] >= function->upvalue_count)
+        return -1;
+    }
+    return offset + 1 + width + upvalues;
+  }
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_LOOP:
+  case OP_LOOP_SHORT: {
+    int length = code[0] == OP_LOOP_SHORT ? 2 : 3;
+    if (left < length)
+      return -1;
+    int jump = length == 2 ? code[1] : code[1] << 8 | code[2];
+    bool back = code[0] == OP_LOOP || code[0] == OP_LOOP_SHORT;
+    int target = offset + length + (back ? -jump : jump);
+    if (target < 0 || target >= chunk->count)
+      return -1;
+    flags[target] |= CODE_TARGET;
+    return offset + length;
+  }
+  default:
+    return -1;
+  }
+}
+
+// The VM trusts the code it runs, so code read from a file is checked
+// before it can run: every opcode must exist, operands must fit in the
+// code, constant operands must name a constant of the kind the instruction
+// takes, upvalue operands an upvalue the closure has, and jumps the start
+// of an instruction. The code must end in a return so that it cannot run
+// off its end.
+bool
+serial_check_code(ObjFunction *function)
+{
+  Chunk *chunk = &function->chunk;
+  if (chunk->count == 0)
+    return false;
+  uint8_t *flags = calloc((size_t) chunk->count, 1);
+  if (flags == NULL)
+    exit(1);
+  int offset = 0;
+  int last = 0;
+  while (offset >= 0 && offset < chunk->count) {
+    flags[offset] |= CODE_START;
+    last = offset;
+    offset = check_instruction(function, offset, flags);
+  }
+  bool valid = offset == chunk->count && chunk->code[last] == OP_RETURN;
+  for (int i = 0; i < chunk->count && valid; ++i) {
+    if ((flags[i] & CODE_TARGET) != 0 && (flags[i] & CODE_START) == 0)
+      valid = false;
+  }
+  free(flags);
+  return valid;
+}
+
+// Other processes may be reading the file while it is rewritten, so it is
+// written to a temporary file that is then renamed into place.
+bool
+serial_store(const char *path, const char *magic, uint32_t version,
+    const void *key, size_t key_length, Writer *payload)
+{
+  if (payload->failed || payload->count > INT32_MAX
+      || key_length > INT32_MAX - payload->count)
+    return false;
+  SerialHeader header;
+  memcpy(header.magic, magic, 4);
+  header.version = version;
+  header.key_length = (uint32_t) key_length;
+  header.payload_length = (uint32_t) payload->count;
+  header.payload_hash = hash_string((const char *) payload->bytes,
+      (int) payload->count);
+  size_t temp_size = strlen(path) + 32;
+  char *temp = malloc(temp_size);
+  if (temp == NULL)
+    return false;
+  snprintf(temp, temp_size, "%s.%ld", path, (long) getpid());
+  bool stored = false;
+  FILE *file = fopen(temp, "wb");
+  if (file != NULL) {
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1
+      && fwrite(key, 1, key_length, file) == key_length
+      && fwrite(payload->bytes, 1, payload->count, file) == payload->count;
+    stored = fclose(file) == 0 && written && rename(temp, path) == 0;
+    if (!stored)
+      remove(temp);
+  }
+  free(temp);
+  return stored;
+}
+
+// Maps the file at path and points the reader at its payload, provided the
+// header and the key match and the payload is intact.
+bool
+serial_open(SerialFile *file, const char *path, const char *magic,
+    uint32_t version, const void *key, size_t key_length, Reader *payload)
+{
+  file->mapping = NULL;
+  file->size = 0;
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return false;
+  struct stat status;
+  if (fstat(fd, &status) == -1
+      || (size_t) status.st_size < sizeof(SerialHeader)
+      || (uintmax_t) status.st_size > INT32_MAX) {
+    close(fd);
+    return false;
+  }
+  size_t size = (size_t) status.st_size;
+  void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+    return false;
+  file->mapping = mapping;
+  file->size = size;
+  SerialHeader header;
+  memcpy(&header, mapping, sizeof(header));
+  const uint8_t *stored_key = (const uint8_t *) mapping + sizeof(header);
+  const uint8_t *bytes = stored_key + key_length;
+  if (memcmp(header.magic, magic, 4) != 0
+      || header.version != version
+      || header.key_length != key_length
+      || header.key_length > size - sizeof(header)
+      || (key_length > 0 && memcmp(stored_key, key, key_length) != 0)
+      || header.payload_length != size - sizeof(header) - key_length
+      || header.payload_hash != hash_string((const char *) bytes,
+        (int) header.payload_length)) {
+    serial_close(file);
+    return false;
+  }
+  payload->current = bytes;
+  payload->end = bytes + header.payload_length;
+  payload->failed = false;
+  return true;
+}
+
+void
+serial_close(SerialFile *file)
+{
+  if (file->mapping != NULL)
+    munmap(file->mapping, file->size);
+  file->mapping = NULL;
+  file->size = 0;
+}
@@ -0,0 +1,98 @@
+#ifndef CLOX_SERIAL_H
+#define CLOX_SERIAL_H
+
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+
+// The files the VM writes for itself, the bytecode cache and heap images,
+// share a header holding a magic, a format version, the length of the key
+// and the length and hash of the payload. The key, whatever the file was
+// derived from, follows the header in full and must match byte for byte. The
+// header is written in the byte order of the machine, so a file from a
+// machine of the other order fails the version check.
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t key_length;
+  uint32_t payload_length;
+  uint32_t payload_hash;
+} SerialHeader;
+
+typedef struct {
+  uint8_t *bytes;
+  size_t count;
+  size_t capacity;
+  bool failed;
+} Writer;
+
+typedef struct {
+  const uint8_t *current;
+  const uint8_t *end;
+  bool failed;
+} Reader;
+
+typedef struct {
+  void *mapping;
+  size_t size;
+} SerialFile;
+
+void
+serial_writer_init(Writer *writer);
+
+void
+serial_writer_free(Writer *writer);
+
+void
+serial_write_bytes(Writer *writer, const void *bytes, size_t count);
+
+void
+serial_write_byte(Writer *writer, uint8_t byte);
+
+void
+serial_write_varint(Writer *writer, uint32_t value);
+
+void
+serial_write_number(Writer *writer, double number);
+
+void
+serial_write_string(VM *vm, Writer *writer, ObjString *string);
+
+void
+serial_write_code(Writer *writer, Chunk *chunk);
+
+const uint8_t *
+serial_read_bytes(Reader *reader, size_t count);
+
+uint8_t
+serial_read_byte(Reader *reader);
+
+uint32_t
+serial_read_varint(Reader *reader);
+
+double
+serial_read_number(Reader *reader);
+
+ObjString *
+serial_read_string(VM *vm, Reader *reader);
+
+void
+serial_read_code(VM *vm, Reader *reader, Chunk *chunk);
+
+// Returns whether the code of a function read from a file is safe to run,
+// once its constants have been read too.
+bool
+serial_check_code(ObjFunction *function);
+
+bool
+serial_store(const char *path, const char *magic, uint32_t version,
+    const void *key, size_t key_length, Writer *payload);
+
+bool
+serial_open(SerialFile *file, const char *path, const char *magic,
+    uint32_t version, const void *key, size_t key_length, Reader *payload);
+
+void
+serial_close(SerialFile *file);
+
+#endif
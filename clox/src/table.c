@@ -1,67 +1,200 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "heap.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+#define SLOT_SIZE (1 + sizeof(ObjString *) + sizeof(Value))
+#define SMALL_SLOT_SIZE (sizeof(ObjString *) + sizeof(Value))
 
 void
 table_init(Table *table)
 {
   table->count = 0;
+  table->tombstones = 0;
   table->capacity = 0;
-  table->entries = NULL;
+  table->control = NULL;
+  table->keys = NULL;
+  table->values = NULL;
 }
 
 void
-table_free(Table *table)
+table_free(VM *vm, Table *table)
 {
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+  if (TABLE_IS_SMALL(table))
+    reallocate(vm, table->keys, table_size(table), 0);
+  else
+    reallocate(vm, table->control, table_size(table), 0);
   table_init(table);
 }
 
-static Entry *
-find_entry(Entry *entries, int capacity, ObjString *key)
+size_t
+table_size(Table *table)
 {
-  uint32_t index = key->hash & (capacity - 1);
-  Entry *tombstone = NULL;
-  for (;;) {
-    Entry *entry = &entries[index];
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value))
-        return tombstone != NULL ? tombstone : entry;
-      else if (tombstone == NULL)
-        tombstone = entry;
-    } else if (entry->key == key)
-      return entry;
-    index = (index + 1) & (capacity - 1);
+  if (TABLE_IS_SMALL(table))
+    return SMALL_SLOT_SIZE * table->capacity;
+  return SLOT_SIZE * table->capacity;
+}
+
+// Groups are probed in triangular order starting with the one holding the
+// key's home slot, which visits every group of a power of two sized table. A
+// lookup stops at the first group with an empty slot. Keys are placed in their
+// home slot whenever it is free, so most lookups only compare a single key.
+#ifdef __GNUC__
+__attribute__((noinline))
+#endif
+static int
+probe_slot(Table *table, ObjString *key, int home)
+{
+  int group_mask = (table->capacity - 1) / TABLE_GROUP_WIDTH;
+  int group = home / TABLE_GROUP_WIDTH;
+  uint8_t tag = HASH_TAG(key->hash);
+  for (int step = 1;; ++step) {
+    const uint8_t *control = table->control + group * TABLE_GROUP_WIDTH;
+    GroupMask match = group_match(control, tag);
+    while (match != 0) {
+      int index = group * TABLE_GROUP_WIDTH + group_lowest_bit(match);
+      if (table->keys[index] == key)
+        return index;
+      match &= match - 1;
+    }
+    if (group_match(control, CONTROL_EMPTY) != 0)
+      return -1;
+    group = (group + step) & group_mask;
+  }
+}
+
+// Compares every key of a small table, without stopping at the match so that
+// the loop compiles to conditional moves.
+static int
+scan_small(Table *table, ObjString *key)
+{
+  int index = -1;
+  for (int i = 0; i < table->capacity; ++i)
+    index = table->keys[i] == key ? i : index;
+  return index;
+}
+
+// Both kinds of table place keys in their home slot whenever it is free, so a
+// key is never outside a home slot that was never used. The table must not be
+// empty.
+static inline int
+find_slot(Table *table, ObjString *key)
+{
+  int home = HASH_SLOT(key->hash) & (table->capacity - 1);
+  if (table->keys[home] == key)
+    return home;
+  if (TABLE_IS_SMALL(table))
+    return table->keys[home] == NULL ? -1 : scan_small(table, key);
+  if (table->control[home] == CONTROL_EMPTY)
+    return -1;
+  return probe_slot(table, key, home);
+}
+
+// Returns the first empty or deleted slot on the probe sequence of a key with
+// the given hash, looking from the home slot onwards within the first group.
+int
+table_find_free(const uint8_t *control, int capacity, uint32_t hash)
+{
+  int home = HASH_SLOT(hash) & (capacity - 1);
+  int group_mask = (capacity - 1) / TABLE_GROUP_WIDTH;
+  int group = home / TABLE_GROUP_WIDTH;
+  int offset = home % TABLE_GROUP_WIDTH;
+  GroupMask free = group_match_free(control + group * TABLE_GROUP_WIDTH);
+  GroupMask after = free >> offset;
+  if (after != 0)
+    return home + group_lowest_bit(after);
+  for (int step = 1;; ++step) {
+    if (free != 0)
+      return group * TABLE_GROUP_WIDTH + group_lowest_bit(free);
+    group = (group + step) & group_mask;
+    free = group_match_free(control + group * TABLE_GROUP_WIDTH);
   }
 }
 
+static int
+find_free_slot(Table *table, uint32_t hash)
+{
+  return table_find_free(table->control, table->capacity, hash);
+}
+
+// Small tables also put keys in their home slot when it is free, and in the
+// first free slot otherwise.
 static void
-adjust_capacity(Table *table, int capacity)
+place_small(Table *table, ObjString *key, Value value)
 {
-  Entry *entries = ALLOCATE(Entry, capacity);
-  for (int i = 0; i < capacity; ++i) {
-    entries[i].key = NULL;
-    entries[i].value = NIL_VAL;
+  int index = HASH_SLOT(key->hash) & (table->capacity - 1);
+  if (table->keys[index] != NULL) {
+    index = 0;
+    while (table->keys[index] != NULL)
+      index++;
+  }
+  table->keys[index] = key;
+  table->values[index] = value;
+  table->count++;
+}
+
+// Reinserts the keys of a small table after some were removed, so that no key
+// is left outside a free home slot.
+static void
+rebuild_small(Table *table)
+{
+  ObjString *keys[TABLE_SMALL_MAX];
+  Value values[TABLE_SMALL_MAX];
+  int count = 0;
+  for (int i = 0; i < table->capacity; ++i) {
+    if (table->keys[i] != NULL) {
+      keys[count] = table->keys[i];
+      values[count++] = table->values[i];
+      table->keys[i] = NULL;
+    }
   }
   table->count = 0;
+  for (int i = 0; i < count; ++i)
+    place_small(table, keys[i], values[i]);
+}
+
+// Capacities up to TABLE_SMALL_MAX give a small table.
+static void
+adjust_capacity(VM *vm, Table *table, int capacity)
+{
+  Table resized;
+  resized.count = 0;
+  resized.tombstones = 0;
+  resized.capacity = capacity;
+  if (capacity <= TABLE_SMALL_MAX) {
+    resized.control = NULL;
+    resized.keys = reallocate(vm, NULL, 0, SMALL_SLOT_SIZE * capacity);
+    resized.values = (Value *) (resized.keys + capacity);
+    memset(resized.keys, 0, sizeof(ObjString *) * capacity);
+    for (int i = 0; i < table->capacity; ++i) {
+      if (TABLE_IS_FULL(table, i))
+        place_small(&resized, table->keys[i], table->values[i]);
+    }
+    table_free(vm, table);
+    *table = resized;
+    return;
+  }
+  resized.control = reallocate(vm, NULL, 0, SLOT_SIZE * capacity);
+  resized.keys = (ObjString **) (resized.control + capacity);
+  resized.values = (Value *) (resized.keys + capacity);
+  memset(resized.control, CONTROL_EMPTY, capacity);
+  memset(resized.keys, 0, sizeof(ObjString *) * capacity);
   for (int i = 0; i < table->capacity; ++i) {
-    Entry *entry = &table->entries[i];
-    if (entry->key == NULL)
+    if (!TABLE_IS_FULL(table, i))
       continue;
-    Entry *dest = find_entry(entries, capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
-    table->count++;
+    ObjString *key = table->keys[i];
+    int index = find_free_slot(&resized, key->hash);
+    resized.control[index] = HASH_TAG(key->hash);
+    resized.keys[index] = key;
+    resized.values[index] = table->values[i];
+    resized.count++;
   }
-  FREE_ARRAY(Entry, table->entries, table->capacity);
-  table->entries = entries;
-  table->capacity = capacity;
+  table_free(vm, table);
+  *table = resized;
 }
 
 bool
@@ -69,49 +202,186 @@ table_get(Table *table, ObjString *key, Value *value)
 {
   if (table->count == 0)
     return false;
-  Entry *entry = find_entry(table->entries, table->capacity, key);
-  if (entry->key == NULL)
+  int index = find_slot(table, key);
+  if (index < 0)
     return false;
-  *value = entry->value;
+  *value = table->values[index];
+  return true;
+}
+
+// Rebuilds the table within its own allocation, dropping every tombstone. Full
+// slots are first marked as deleted to flag them as not yet placed, then each
+// key is moved to the first free slot on its probe sequence. If that slot holds
+// a key yet to be placed, the two are swapped and the displaced key is placed
+// next. Groups a key's probe sequence passes over are all full by the time the
+// key is placed, and stay full.
+static void
+rehash_in_place(Table *table)
+{
+  for (int i = 0; i < table->capacity; ++i) {
+    if (TABLE_IS_FULL(table, i))
+      table->control[i] = CONTROL_DELETED;
+    else {
+      table->control[i] = CONTROL_EMPTY;
+      table->keys[i] = NULL;
+    }
+  }
+  for (int i = 0; i < table->capacity; ++i) {
+    while (table->control[i] == CONTROL_DELETED) {
+      ObjString *key = table->keys[i];
+      int index = find_free_slot(table, key->hash);
+      if (index == i) {
+        table->control[i] = HASH_TAG(key->hash);
+        break;
+      }
+      Value value = table->values[i];
+      if (table->control[index] == CONTROL_EMPTY) {
+        table->control[i] = CONTROL_EMPTY;
+        table->keys[i] = NULL;
+      } else {
+        table->keys[i] = table->keys[index];
+        table->values[i] = table->values[index];
+      }
+      table->control[index] = HASH_TAG(key->hash);
+      table->keys[index] = key;
+      table->values[index] = value;
+    }
+  }
+  table->tombstones = 0;
+}
+
+// Tables shrink once they are less than a quarter loaded, down to the size they
+// would have grown to for their current count.
+static void
+shrink_capacity(VM *vm, Table *table)
+{
+  if (TABLE_IS_SMALL(table)
+      || table->count >= table->capacity * TABLE_MAX_LOAD / 4)
+    return;
+  if (table->count == 0) {
+    table_free(vm, table);
+    return;
+  }
+  int capacity = TABLE_SMALL_MAX;
+  if (table->count > TABLE_SMALL_MAX / 2) {
+    capacity = TABLE_GROUP_WIDTH;
+    while (table->count + 1 > capacity * TABLE_MAX_LOAD / 2)
+      capacity *= 2;
+  }
+  if (capacity < table->capacity)
+    adjust_capacity(vm, table, capacity);
+}
+
+static bool
+set_small(VM *vm, Table *table, ObjString *key, Value value)
+{
+  if (table->count > 0) {
+    int index = find_slot(table, key);
+    if (index >= 0) {
+      table->values[index] = value;
+      return false;
+    }
+  }
+  if (table->count + 1 > table->capacity / 2)
+    adjust_capacity(vm, table, table->capacity == 0 ? 4 : table->capacity * 2);
+  if (!TABLE_IS_SMALL(table))
+    return table_set(vm, table, key, value);
+  place_small(table, key, value);
   return true;
 }
 
 bool
-table_set(Table *table, ObjString *key, Value value)
+table_set(VM *vm, Table *table, ObjString *key, Value value)
 {
-  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-    int capacity = GROW_CAPACITY(table->capacity);
-    adjust_capacity(table, capacity);
+  if (TABLE_IS_SMALL(table))
+    return set_small(vm, table, key, value);
+  if (table->count > 0) {
+    int index = find_slot(table, key);
+    if (index >= 0) {
+      table->values[index] = value;
+      return false;
+    }
+  }
+  shrink_capacity(vm, table);
+  if (TABLE_IS_SMALL(table))
+    return set_small(vm, table, key, value);
+  // Tombstones count towards the load. When they are what fills the table,
+  // it is rehashed in place to drop them.
+  if (table->count + table->tombstones + 1 > table->capacity * TABLE_MAX_LOAD) {
+    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD / 2)
+      adjust_capacity(vm, table, table->capacity * 2);
+    else
+      rehash_in_place(table);
   }
-  Entry *entry = find_entry(table->entries, table->capacity, key);
-  bool is_new_key = entry->key == NULL;
-  if (is_new_key && IS_NIL(entry->value))
-    table->count++;
-  entry->key = key;
-  entry->value = value;
-  return is_new_key;
+  int index = find_free_slot(table, key->hash);
+  if (table->control[index] == CONTROL_DELETED)
+    table->tombstones--;
+  table->control[index] = HASH_TAG(key->hash);
+  table->keys[index] = key;
+  table->values[index] = value;
+  table->count++;
+  return true;
+}
+
+// A slot can be emptied rather than turned into a tombstone when its group
+// already has an empty slot, as no probe sequence then continues past the
+// group, and when no key in the group has it as its home slot.
+static bool
+can_empty(Table *table, int index)
+{
+  int group = index / TABLE_GROUP_WIDTH * TABLE_GROUP_WIDTH;
+  if (group_match(table->control + group, CONTROL_EMPTY) == 0)
+    return false;
+  for (int i = group; i < group + TABLE_GROUP_WIDTH; ++i) {
+    if (TABLE_IS_FULL(table, i) && i != index
+        && (int) (HASH_SLOT(table->keys[i]->hash) & (table->capacity - 1))
+          == index)
+      return false;
+  }
+  return true;
+}
+
+static void
+delete_slot(Table *table, int index)
+{
+  table->control[index] = CONTROL_DELETED;
+  table->keys[index] = NULL;
+  table->count--;
+  table->tombstones++;
 }
 
 bool
-table_delete(Table *table, ObjString *key)
+table_delete(VM *vm, Table *table, ObjString *key)
 {
   if (table->count == 0)
     return false;
-  Entry *entry = find_entry(table->entries, table->capacity, key);
-  if (entry->key == NULL)
+  if (TABLE_IS_SMALL(table)) {
+    int index = find_slot(table, key);
+    if (index < 0)
+      return false;
+    table->keys[index] = NULL;
+    rebuild_small(table);
+    return true;
+  }
+  int index = find_slot(table, key);
+  if (index < 0)
     return false;
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+  if (can_empty(table, index)) {
+    table->control[index] = CONTROL_EMPTY;
+    table->keys[index] = NULL;
+    table->count--;
+  } else
+    delete_slot(table, index);
+  shrink_capacity(vm, table);
   return true;
 }
 
 void
-table_add_all(Table *from, Table *to)
+table_add_all(VM *vm, Table *from, Table *to)
 {
   for (int i = 0; i < from->capacity; ++i) {
-    Entry *entry = &from->entries[i];
-    if (entry->key != NULL)
-      table_set(to, entry->key, entry->value);
+    if (TABLE_IS_FULL(from, i))
+      table_set(vm, to, from->keys[i], from->values[i]);
   }
 }
 
@@ -120,36 +390,65 @@ table_find_string(Table *table, const char *chars, int length, uint32_t hash)
 {
   if (table->count == 0)
     return NULL;
-  uint32_t index = hash & (table->capacity - 1);
-  for (;;) {
-    Entry *entry = &table->entries[index];
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value))
-        return NULL;
-    } else if (entry->key->length == length
-        && entry->key->hash == hash
-        && memcmp(entry->key->chars, chars, length) == 0)
-      return entry->key;
-    index = (index + 1) & (table->capacity - 1);
+  if (TABLE_IS_SMALL(table)) {
+    for (int i = 0; i < table->capacity; ++i) {
+      ObjString *key = table->keys[i];
+      if (key != NULL && key->length == length && key->hash == hash
+          && memcmp(key->chars, chars, length) == 0)
+        return key;
+    }
+    return NULL;
+  }
+  int group_mask = (table->capacity - 1) / TABLE_GROUP_WIDTH;
+  int group = (HASH_SLOT(hash) & (table->capacity - 1)) / TABLE_GROUP_WIDTH;
+  uint8_t tag = HASH_TAG(hash);
+  for (int step = 1;; ++step) {
+    const uint8_t *control = table->control + group * TABLE_GROUP_WIDTH;
+    GroupMask match = group_match(control, tag);
+    while (match != 0) {
+      ObjString *key = table->keys[group * TABLE_GROUP_WIDTH
+        + group_lowest_bit(match)];
+      if (key->length == length && key->hash == hash
+          && memcmp(key->chars, chars, length) == 0)
+        return key;
+      match &= match - 1;
+    }
+    if (group_match(control, CONTROL_EMPTY) != 0)
+      return NULL;
+    group = (group + step) & group_mask;
   }
 }
 
+// Runs during collections, so it may not allocate. Tombstones left by the
+// removed keys are cleared in place, shrinking is left to the next insertion.
 void
 table_remove_white(Table *table)
 {
+  if (TABLE_IS_SMALL(table)) {
+    for (int i = 0; i < table->capacity; ++i) {
+      if (table->keys[i] != NULL
+          && !heap_is_marked((Obj *) table->keys[i]))
+        table->keys[i] = NULL;
+    }
+    rebuild_small(table);
+    return;
+  }
   for (int i = 0; i < table->capacity; ++i) {
-    Entry *entry = &table->entries[i];
-    if (entry->key != NULL && !entry->key->obj.is_marked)
-      table_delete(table, entry->key);
+    if (TABLE_IS_FULL(table, i)
+        && !heap_is_marked((Obj *) table->keys[i]))
+      delete_slot(table, i);
   }
+  if (table->tombstones > table->capacity / 8)
+    rehash_in_place(table);
 }
 
 void
-table_mark(Table *table)
+table_mark(VM *vm, Table *table)
 {
   for (int i = 0; i < table->capacity; ++i) {
-    Entry *entry = &table->entries[i];
-    object_mark((Obj *) entry->key);
-    value_mark(entry->value);
+    if (TABLE_IS_FULL(table, i)) {
+      object_mark(vm, (Obj *) table->keys[i]);
+      value_mark(vm, table->values[i]);
+    }
   }
 }
@@ -1,37 +1,130 @@
 #ifndef CLOX_TABLE_H
 #define CLOX_TABLE_H
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "common.h"
 #include "value.h"
 
-typedef struct {
-  ObjString *key;
-  Value value;
-} Entry;
+// Slots are grouped TABLE_GROUP_WIDTH at a time. Each slot has a control
+// byte that is either empty, deleted, or the low seven bits of its key's
+// hash, so a whole group can be searched for a key with a few vector
+// instructions before any key is compared. The control bytes, keys and
+// values are kept in separate arrays of one allocation.
+//
+// Tables with a capacity of up to TABLE_SMALL_MAX, which covers the methods
+// and fields of most classes, have no control bytes. They are kept at most
+// half full and searched by comparing key pointers, starting with the key's
+// home slot.
+#define TABLE_GROUP_WIDTH 16
+#define TABLE_SMALL_MAX 8
+#define TABLE_MAX_LOAD 0.75
+
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xfe
+
+// The high bits of a hash pick the key's home slot, the low seven are stored
+// in the control byte.
+#define HASH_SLOT(hash) ((hash) >> 7)
+#define HASH_TAG(hash) ((uint8_t) ((hash) & 0x7f))
+
+#define TABLE_IS_SMALL(table) ((table)->control == NULL)
+#define TABLE_IS_FULL(table, index) \
+  (TABLE_IS_SMALL(table) ? (table)->keys[index] != NULL \
+                         : ((table)->control[index] & 0x80) == 0)
 
 typedef struct {
   int count;
+  int tombstones;
   int capacity;
-  Entry *entries;
+  uint8_t *control;
+  ObjString **keys;
+  Value *values;
 } Table;
 
+// A group mask has bit i set when slot i of the group matches.
+typedef uint32_t GroupMask;
+
+#ifdef __SSE2__
+
+static inline GroupMask
+group_match(const uint8_t *control, uint8_t tag)
+{
+  __m128i group = _mm_loadu_si128((const __m128i *) control);
+  return (GroupMask) _mm_movemask_epi8(
+      _mm_cmpeq_epi8(group, _mm_set1_epi8((char) tag)));
+}
+
+// Empty and deleted slots are the ones with the high bit set.
+static inline GroupMask
+group_match_free(const uint8_t *control)
+{
+  __m128i group = _mm_loadu_si128((const __m128i *) control);
+  return (GroupMask) _mm_movemask_epi8(group);
+}
+
+#else
+
+static inline GroupMask
+group_match(const uint8_t *control, uint8_t tag)
+{
+  GroupMask mask = 0;
+  for (int i = 0; i < TABLE_GROUP_WIDTH; ++i)
+    mask |= (GroupMask) (control[i] == tag) << i;
+  return mask;
+}
+
+static inline GroupMask
+group_match_free(const uint8_t *control)
+{
+  GroupMask mask = 0;
+  for (int i = 0; i < TABLE_GROUP_WIDTH; ++i)
+    mask |= (GroupMask) (control[i] >> 7) << i;
+  return mask;
+}
+
+#endif
+
+static inline int
+group_lowest_bit(GroupMask mask)
+{
+  #ifdef __GNUC__
+  return __builtin_ctz(mask);
+  #else
+  int bit = 0;
+  while ((mask & 1) == 0) {
+    mask >>= 1;
+    bit++;
+  }
+  return bit;
+  #endif
+}
+
 void
 table_init(Table *table);
 
+int
+table_find_free(const uint8_t *control, int capacity, uint32_t hash);
+
 void
-table_free(Table *table);
+table_free(VM *vm, Table *table);
+
+size_t
+table_size(Table *table);
 
 bool
 table_get(Table *table, ObjString *key, Value *value);
 
 bool
-table_set(Table *table, ObjString *key, Value value);
+table_set(VM *vm, Table *table, ObjString *key, Value value);
 
 bool
-table_delete(Table *table, ObjString *key);
+table_delete(VM *vm, Table *table, ObjString *key);
 
 void
-table_add_all(Table *from, Table *to);
+table_add_all(VM *vm, Table *from, Table *to);
 
 ObjString *
 table_find_string(Table *table, const char *chars, int length, uint32_t hash);
@@ -40,6 +133,6 @@ void
 table_remove_white(Table *table);
 
 void
-table_mark(Table *table);
+table_mark(VM *vm, Table *table);
 
 #endif
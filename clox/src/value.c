@@ -14,11 +14,13 @@ value_array_init(ValueArray *array)
 }
 
 bool
-values_equal(Value a, Value b)
+values_equal(VM *vm, Value a, Value b)
 {
   #ifdef NAN_BOXING
   if (IS_NUMBER(a) && IS_NUMBER(b))
     return AS_NUMBER(a) == AS_NUMBER(b);
+  if (IS_STRING(a) && IS_STRING(b))
+    return strings_equal(vm, AS_STRING(a), AS_STRING(b));
   return a == b;
   #else
   if (a.type != b.type)
@@ -31,6 +33,8 @@ values_equal(Value a, Value b)
   case VAL_NUMBER:
     return AS_NUMBER(a) == AS_NUMBER(b);
   case VAL_OBJ:
+    if (IS_STRING(a) && IS_STRING(b))
+      return strings_equal(vm, AS_STRING(a), AS_STRING(b));
     return AS_OBJ(a) == AS_OBJ(b);
   default:
     // Unreachable.
@@ -40,21 +44,29 @@ values_equal(Value a, Value b)
 }
 
 void
-value_array_write(ValueArray *array, Value value)
+value_array_write(VM *vm, ValueArray *array, Value value)
 {
   if (array->capacity < array->count + 1) {
     int old_capacity = array->capacity;
     array->capacity = GROW_CAPACITY(old_capacity);
-    array->values = GROW_ARRAY(Value, array->values, old_capacity,
+    array->values = GROW_ARRAY(vm, Value, array->values, old_capacity,
                                array->capacity);
   }
   array->values[array->count++] = value;
 }
 
 void
-value_array_free(ValueArray *array)
+value_array_shrink(VM *vm, ValueArray *array)
 {
-  FREE_ARRAY(Value, array->values, array->capacity);
+  array->values = GROW_ARRAY(vm, Value, array->values, array->capacity,
+                             array->count);
+  array->capacity = array->count;
+}
+
+void
+value_array_free(VM *vm, ValueArray *array)
+{
+  FREE_ARRAY(vm, Value, array->values, array->capacity);
   value_array_init(array);
 }
 
@@ -93,13 +93,16 @@ typedef struct {
 void
 value_array_init(ValueArray *array);
 
-bool values_equal(Value a, Value b);
+bool values_equal(VM *vm, Value a, Value b);
 
 void
-value_array_write(ValueArray *array, Value value);
+value_array_write(VM *vm, ValueArray *array, Value value);
 
 void
-value_array_free(ValueArray *array);
+value_array_shrink(VM *vm, ValueArray *array);
+
+void
+value_array_free(VM *vm, ValueArray *array);
 
 void
 value_print(Value value);
@@ -3,8 +3,10 @@
 #include <string.h>
 #include <time.h>
 
+#include "arena.h"
 #include "common.h"
 #include "compiler.h"
+#include "floats.h"
 #include "memory.h"
 #include "object.h"
 #include "vm.h"
@@ -13,238 +15,782 @@
 #include "debug.h"
 #endif
 
-VM vm;
-
-static Value
-clock_native(uint8_t arg_count, Value *args)
-{
-  return NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
-}
+#define FLOAT_ARRAY_MAX (1 << 28)
 
 static void
-vm_stack_reset()
+vm_stack_reset(VM *vm)
 {
-  vm.stack_top = vm.stack;
-  vm.frame_count = 0;
-  vm.open_upvalues = NULL;
+  vm->stack_top = vm->stack;
+  vm->frame_count = 0;
+  vm->open_upvalues = NULL;
 }
 
 static void
-runtime_error(const char *format, ...)
+runtime_error(VM *vm, const char *format, ...)
 {
   va_list args;
   va_start(args, format);
   vfprintf(stderr, format, args);
   va_end(args);
   fputs("\n", stderr);
-  for (int i = vm.frame_count - 1; i >= 0; --i) {
-    CallFrame *frame = &vm.frames[i];
+  for (int i = vm->frame_count - 1; i >= 0; --i) {
+    CallFrame *frame = &vm->frames[i];
     ObjFunction *function = frame->closure->function;
-    size_t instruction = frame->ip - function->chunk.code - 1;
-    fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+    int instruction = (int) (frame->ip - function->chunk.code - 1);
+    fprintf(stderr, "[line %d] in ",
+        chunk_get_line(&function->chunk, instruction));
     if (function->name == NULL)
       fprintf(stderr, "script\n");
     else
       fprintf(stderr, "%s()\n", function->name->chars);
   }
-  vm_stack_reset();
+  vm_stack_reset(vm);
+}
+
+static bool
+clock_native(VM *vm, Value *args, Value *result)
+{
+  *result = NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
+  return true;
+}
+
+static bool
+len_native(VM *vm, Value *args, Value *result)
+{
+  if (IS_ARRAY(args[0]))
+    *result = NUMBER_VAL(AS_ARRAY(args[0])->elements.count);
+  else if (IS_FLOAT_ARRAY(args[0]))
+    *result = NUMBER_VAL(AS_FLOAT_ARRAY(args[0])->count);
+  else if (IS_MAP(args[0]))
+    *result = NUMBER_VAL(AS_MAP(args[0])->entries.count);
+  else if (IS_STRING(args[0]))
+    *result = NUMBER_VAL(AS_STRING(args[0])->length);
+  else {
+    runtime_error(vm, "Argument must be an array, a map or a string.");
+    return false;
+  }
+  return true;
+}
+
+static bool
+push_native(VM *vm, Value *args, Value *result)
+{
+  if (!IS_ARRAY(args[0])) {
+    runtime_error(vm, "Can only push to an array.");
+    return false;
+  }
+  ObjArray *array = AS_ARRAY(args[0]);
+  value_array_write(vm, &array->elements, args[1]);
+  *result = NUMBER_VAL(array->elements.count);
+  return true;
+}
+
+static bool
+pop_native(VM *vm, Value *args, Value *result)
+{
+  if (!IS_ARRAY(args[0])) {
+    runtime_error(vm, "Can only pop from an array.");
+    return false;
+  }
+  ObjArray *array = AS_ARRAY(args[0]);
+  if (array->elements.count == 0) {
+    runtime_error(vm, "Can't pop from an empty array.");
+    return false;
+  }
+  *result = array->elements.values[--array->elements.count];
+  return true;
+}
+
+static bool
+has_native(VM *vm, Value *args, Value *result)
+{
+  if (!IS_MAP(args[0])) {
+    runtime_error(vm, "Can only look up keys in a map.");
+    return false;
+  }
+  Value value;
+  args[1] = map_key(vm, args[1]);
+  *result = BOOL_VAL(map_get(&AS_MAP(args[0])->entries, args[1], &value));
+  return true;
+}
+
+static bool
+delete_native(VM *vm, Value *args, Value *result)
+{
+  if (!IS_MAP(args[0])) {
+    runtime_error(vm, "Can only delete keys from a map.");
+    return false;
+  }
+  args[1] = map_key(vm, args[1]);
+  *result = BOOL_VAL(map_delete(&AS_MAP(args[0])->entries, args[1]));
+  return true;
+}
+
+// Returns a new array of either the keys or the values of a map, in slot
+// order. The array is kept on the stack while its buffer is allocated.
+static bool
+map_entries(VM *vm, Value *args, Value *result, bool keys)
+{
+  if (!IS_MAP(args[0])) {
+    runtime_error(vm, "Argument must be a map.");
+    return false;
+  }
+  ObjArray *array = new_array(vm);
+  vm_stack_push(vm, OBJ_VAL(array));
+  Map *map = &AS_MAP(args[0])->entries;
+  array->elements.values = ALLOCATE(vm, Value, map->count);
+  array->elements.capacity = map->count;
+  for (int i = 0; i < map->capacity; ++i) {
+    if (MAP_IS_FULL(map, i))
+      array->elements.values[array->elements.count++] =
+        keys ? map->keys[i] : map->values[i];
+  }
+  vm_stack_pop(vm);
+  *result = OBJ_VAL(array);
+  return true;
+}
+
+static bool
+keys_native(VM *vm, Value *args, Value *result)
+{
+  return map_entries(vm, args, result, true);
+}
+
+static bool
+values_native(VM *vm, Value *args, Value *result)
+{
+  return map_entries(vm, args, result, false);
+}
+
+// Returns the position of the first occurrence of needle in chars at or after
+// from, or -1.
+static int
+find_chars(const char *chars, int length, const char *needle,
+    int needle_length, int from)
+{
+  if (needle_length == 0)
+    return from;
+  int last = length - needle_length;
+  for (int i = from; i <= last; ++i) {
+    const char *match = memchr(chars + i, needle[0], last - i + 1);
+    if (match == NULL)
+      return -1;
+    i = (int) (match - chars);
+    if (memcmp(match, needle, needle_length) == 0)
+      return i;
+  }
+  return -1;
+}
+
+static bool
+string_args(VM *vm, Value *args, int count)
+{
+  for (int i = 0; i < count; ++i) {
+    if (!IS_STRING(args[i])) {
+      runtime_error(vm, "Arguments must be strings.");
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool
+substring_native(VM *vm, Value *args, Value *result)
+{
+  if (!string_args(vm, args, 1))
+    return false;
+  ObjString *string = AS_STRING(args[0]);
+  double start = IS_NUMBER(args[1]) ? AS_NUMBER(args[1]) : -1;
+  double end = IS_NUMBER(args[2]) ? AS_NUMBER(args[2]) : -1;
+  if (!(start >= 0 && start <= end && end <= string->length)
+      || start != (int) start || end != (int) end) {
+    runtime_error(vm, "Substring bounds must be whole numbers within 0 and %d.",
+        string->length);
+    return false;
+  }
+  *result = OBJ_VAL(string_slice(vm, string, (int) start, (int) (end - start)));
+  return true;
+}
+
+static bool
+index_native(VM *vm, Value *args, Value *result)
+{
+  if (!string_args(vm, args, 2))
+    return false;
+  ObjString *string = AS_STRING(args[0]);
+  ObjString *needle = AS_STRING(args[1]);
+  const char *chars = string_chars(vm, string);
+  const char *needle_chars = string_chars(vm, needle);
+  *result = NUMBER_VAL(find_chars(chars, string->length, needle_chars,
+        needle->length, 0));
+  return true;
+}
+
+// The parts are slices of the string, kept on the stack while the array grows.
+static bool
+split_native(VM *vm, Value *args, Value *result)
+{
+  if (!string_args(vm, args, 2))
+    return false;
+  ObjString *string = AS_STRING(args[0]);
+  ObjString *separator = AS_STRING(args[1]);
+  if (separator->length == 0) {
+    runtime_error(vm, "Separator must not be empty.");
+    return false;
+  }
+  const char *chars = string_chars(vm, string);
+  const char *separator_chars = string_chars(vm, separator);
+  ObjArray *array = new_array(vm);
+  vm_stack_push(vm, OBJ_VAL(array));
+  int start = 0;
+  for (;;) {
+    int end = find_chars(chars, string->length, separator_chars,
+        separator->length, start);
+    if (end < 0)
+      end = string->length;
+    vm_stack_push(vm, OBJ_VAL(string_slice(vm, string, start, end - start)));
+    value_array_write(vm, &array->elements, vm->stack_top[-1]);
+    vm_stack_pop(vm);
+    if (end == string->length)
+      break;
+    start = end + separator->length;
+  }
+  vm_stack_pop(vm);
+  *result = OBJ_VAL(array);
+  return true;
+}
+
+static bool
+is_space(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static bool
+trim_native(VM *vm, Value *args, Value *result)
+{
+  if (!string_args(vm, args, 1))
+    return false;
+  ObjString *string = AS_STRING(args[0]);
+  const char *chars = string_chars(vm, string);
+  int start = 0;
+  int end = string->length;
+  while (start < end && is_space(chars[start]))
+    start++;
+  while (end > start && is_space(chars[end - 1]))
+    end--;
+  *result = OBJ_VAL(string_slice(vm, string, start, end - start));
+  return true;
+}
+
+static bool
+float_array_native(VM *vm, Value *args, Value *result)
+{
+  double length = IS_NUMBER(args[0]) ? AS_NUMBER(args[0]) : -1;
+  if (!(length >= 0 && length <= FLOAT_ARRAY_MAX) || length != (int) length) {
+    runtime_error(vm, "Length must be a whole number between 0 and %d.",
+        FLOAT_ARRAY_MAX);
+    return false;
+  }
+  *result = OBJ_VAL(new_float_array(vm, (int) length));
+  return true;
+}
+
+// Checks that the first count arguments are float arrays of equal length.
+static bool
+float_array_args(VM *vm, Value *args, int count)
+{
+  for (int i = 0; i < count; ++i) {
+    if (!IS_FLOAT_ARRAY(args[i])) {
+      runtime_error(vm, "Arguments must be float arrays.");
+      return false;
+    }
+  }
+  if (count == 2
+      && AS_FLOAT_ARRAY(args[0])->count != AS_FLOAT_ARRAY(args[1])->count) {
+    runtime_error(vm, "Float arrays must have the same length.");
+    return false;
+  }
+  return true;
+}
+
+static bool
+number_arg(VM *vm, Value value)
+{
+  if (!IS_NUMBER(value)) {
+    runtime_error(vm, "Argument must be a number.");
+    return false;
+  }
+  return true;
+}
+
+static bool
+fill_native(VM *vm, Value *args, Value *result)
+{
+  if (!float_array_args(vm, args, 1) || !number_arg(vm, args[1]))
+    return false;
+  ObjFloatArray *array = AS_FLOAT_ARRAY(args[0]);
+  floats_fill(array->values, array->count, AS_NUMBER(args[1]));
+  *result = args[0];
+  return true;
+}
+
+static bool
+add_native(VM *vm, Value *args, Value *result)
+{
+  if (!float_array_args(vm, args, 2))
+    return false;
+  ObjFloatArray *dest = AS_FLOAT_ARRAY(args[0]);
+  floats_add(dest->values, AS_FLOAT_ARRAY(args[1])->values, dest->count);
+  *result = args[0];
+  return true;
+}
+
+static bool
+mul_native(VM *vm, Value *args, Value *result)
+{
+  if (!float_array_args(vm, args, 2))
+    return false;
+  ObjFloatArray *dest = AS_FLOAT_ARRAY(args[0]);
+  floats_mul(dest->values, AS_FLOAT_ARRAY(args[1])->values, dest->count);
+  *result = args[0];
+  return true;
+}
+
+static bool
+scale_native(VM *vm, Value *args, Value *result)
+{
+  if (!float_array_args(vm, args, 1) || !number_arg(vm, args[1]))
+    return false;
+  ObjFloatArray *array = AS_FLOAT_ARRAY(args[0]);
+  floats_scale(array->values, array->count, AS_NUMBER(args[1]));
+  *result = args[0];
+  return true;
+}
+
+static bool
+dot_native(VM *vm, Value *args, Value *result)
+{
+  if (!float_array_args(vm, args, 2))
+    return false;
+  ObjFloatArray *a = AS_FLOAT_ARRAY(args[0]);
+  *result = NUMBER_VAL(floats_dot(a->values, AS_FLOAT_ARRAY(args[1])->values,
+        a->count));
+  return true;
+}
+
+static bool
+sum_native(VM *vm, Value *args, Value *result)
+{
+  if (!float_array_args(vm, args, 1))
+    return false;
+  ObjFloatArray *array = AS_FLOAT_ARRAY(args[0]);
+  *result = NUMBER_VAL(floats_sum(array->values, array->count));
+  return true;
+}
+
+static bool
+min_native(VM *vm, Value *args, Value *result)
+{
+  if (!float_array_args(vm, args, 1))
+    return false;
+  ObjFloatArray *array = AS_FLOAT_ARRAY(args[0]);
+  if (array->count == 0) {
+    runtime_error(vm, "Float array is empty.");
+    return false;
+  }
+  *result = NUMBER_VAL(floats_min(array->values, array->count));
+  return true;
+}
+
+static bool
+max_native(VM *vm, Value *args, Value *result)
+{
+  if (!float_array_args(vm, args, 1))
+    return false;
+  ObjFloatArray *array = AS_FLOAT_ARRAY(args[0]);
+  if (array->count == 0) {
+    runtime_error(vm, "Float array is empty.");
+    return false;
+  }
+  *result = NUMBER_VAL(floats_max(array->values, array->count));
+  return true;
+}
+
+static bool
+prefix_sum_native(VM *vm, Value *args, Value *result)
+{
+  if (!float_array_args(vm, args, 1))
+    return false;
+  ObjFloatArray *array = AS_FLOAT_ARRAY(args[0]);
+  floats_prefix_sum(array->values, array->count);
+  *result = args[0];
+  return true;
 }
 
+static const struct {
+  const char *name;
+  NativeFn function;
+  uint8_t arity;
+} natives[] = {
+  { "clock", clock_native, 0 },
+  { "len", len_native, 1 },
+  { "push", push_native, 2 },
+  { "pop", pop_native, 1 },
+  { "has", has_native, 2 },
+  { "delete", delete_native, 2 },
+  { "keys", keys_native, 1 },
+  { "values", values_native, 1 },
+  { "substring", substring_native, 3 },
+  { "index", index_native, 2 },
+  { "split", split_native, 2 },
+  { "trim", trim_native, 1 },
+  { "float_array", float_array_native, 1 },
+  { "fill", fill_native, 2 },
+  { "add", add_native, 2 },
+  { "mul", mul_native, 2 },
+  { "scale", scale_native, 2 },
+  { "dot", dot_native, 2 },
+  { "sum", sum_native, 1 },
+  { "min", min_native, 1 },
+  { "max", max_native, 1 },
+  { "prefix_sum", prefix_sum_native, 1 },
+};
+
+#define NATIVE_COUNT (int) (sizeof(natives) / sizeof(natives[0]))
+
 static void
-define_native(const char *name, NativeFn function)
+define_native(VM *vm, const char *name, NativeFn function, uint8_t arity)
 {
-  vm_stack_push(OBJ_VAL(copy_string(name, strlen(name))));
-  vm_stack_push(OBJ_VAL(new_native(function)));
-  table_set(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-  vm_stack_pop();
-  vm_stack_pop();
+  vm_stack_push(vm, OBJ_VAL(copy_string(vm, name, strlen(name))));
+  vm_stack_push(vm, OBJ_VAL(new_native(vm, function, arity)));
+  table_set(vm, &vm->globals, AS_STRING(vm->stack[0]), vm->stack[1]);
+  vm_stack_pop(vm);
+  vm_stack_pop(vm);
 }
 
 void
-vm_init()
-{
-  vm_stack_reset();
-  vm.objects = NULL;
-  vm.bytes_allocated = 0;
-  vm.next_gc = 1024 * 1024;
-  vm.gray_count = 0;
-  vm.gray_capacity = 0;
-  vm.gray_stack = NULL;
-  table_init(&vm.globals);
-  table_init(&vm.strings);
-  vm.init_string = NULL;
-  vm.init_string = copy_string("init", 4);
-  define_native("clock", clock_native);
+vm_init(VM *vm)
+{
+  vm_stack_reset(vm);
+  heap_init(&vm->heap, vm);
+  vm->bytes_allocated = 0;
+  vm->bytes_marked = 0;
+  vm->bytes_since_gc = 0;
+  vm->compact_requested = false;
+  vm->lazy_compile = false;
+  vm->parser = NULL;
+  vm->next_gc = 1024 * 1024;
+  vm->gray_count = 0;
+  vm->gray_capacity = 0;
+  vm->gray_stack = NULL;
+  table_init(&vm->globals);
+  table_init(&vm->strings);
+  value_array_init(&vm->handles);
+  vm->free_handle = -1;
+  vm->init_string = NULL;
+  vm->init_string = copy_string(vm, "init", 4);
+  for (int i = 0; i < NATIVE_COUNT; ++i)
+    define_native(vm, natives[i].name, natives[i].function, natives[i].arity);
+}
+
+// Natives are stored in heap images by name.
+const char *
+vm_native_name(NativeFn function)
+{
+  for (int i = 0; i < NATIVE_COUNT; ++i)
+    if (natives[i].function == function)
+      return natives[i].name;
+  return NULL;
+}
+
+ObjNative *
+vm_native_new(VM *vm, const char *name, int length)
+{
+  for (int i = 0; i < NATIVE_COUNT; ++i)
+    if ((int) strlen(natives[i].name) == length
+        && memcmp(natives[i].name, name, length) == 0)
+      return new_native(vm, natives[i].function, natives[i].arity);
+  return NULL;
 }
 
 void
-vm_free()
+vm_free(VM *vm)
 {
-  table_free(&vm.globals);
-  table_free(&vm.strings);
-  vm.init_string = NULL;
-  free_objects();
+  table_free(vm, &vm->globals);
+  table_free(vm, &vm->strings);
+  value_array_free(vm, &vm->handles);
+  vm->init_string = NULL;
+  free_objects(vm);
 }
 
 void
-vm_stack_push(Value value)
+vm_stack_push(VM *vm, Value value)
 {
-  *vm.stack_top = value;
-  vm.stack_top++;
+  *vm->stack_top = value;
+  vm->stack_top++;
 }
 
 Value
-vm_stack_pop()
+vm_stack_pop(VM *vm)
 {
-  vm.stack_top--;
-  return *vm.stack_top;
+  vm->stack_top--;
+  return *vm->stack_top;
 }
 
 static Value
-vm_stack_peek(int distance)
+vm_stack_peek(VM *vm, int distance)
 {
-  return vm.stack_top[-1 - distance];
+  return vm->stack_top[-1 - distance];
 }
 
 static bool
-call(ObjClosure *closure, uint8_t arg_count)
+call(VM *vm, ObjClosure *closure, uint8_t arg_count)
 {
   if (arg_count != closure->function->arity) {
-    runtime_error("Expected %u arguments but got %u.",
+    runtime_error(vm, "Expected %u arguments but got %u.",
         closure->function->arity, arg_count);
     return false;
   }
-  if (vm.frame_count == FRAMES_MAX) {
-    runtime_error("Stack overflow.");
+  if (vm->frame_count == FRAMES_MAX) {
+    runtime_error(vm, "Stack overflow.");
+    return false;
+  }
+  if (closure->function->lazy != NULL
+      && !compile_function(vm, closure->function)) {
+    runtime_error(vm, "Could not compile %s().",
+        closure->function->name->chars);
     return false;
   }
-  CallFrame *frame = &vm.frames[vm.frame_count++];
+  if (++closure->function->calls == ARENA_HOT_CALLS)
+    arena_heat(vm, closure->function);
+  CallFrame *frame = &vm->frames[vm->frame_count++];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
-  frame->slots = vm.stack_top - arg_count - 1;
+  frame->slots = vm->stack_top - arg_count - 1;
   return true;
 }
 
 static bool
-call_value(Value callee, uint8_t arg_count)
+call_value(VM *vm, Value callee, uint8_t arg_count)
 {
   if (IS_OBJ(callee)) {
     switch (OBJ_TYPE(callee)) {
     case OBJ_BOUND_METHOD: {
       ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
-      vm.stack_top[-arg_count - 1] = bound->receiver;
-      return call(bound->method, arg_count);
+      vm->stack_top[-arg_count - 1] = bound->receiver;
+      return call(vm, bound->method, arg_count);
     }
     case OBJ_CLASS: {
       ObjClass *class = AS_CLASS(callee);
-      vm.stack_top[-arg_count - 1] = OBJ_VAL(new_instance(class));
+      vm->stack_top[-arg_count - 1] = OBJ_VAL(new_instance(vm, class));
       Value initializer;
-      if (table_get(&class->methods, vm.init_string, &initializer))
-        return call(AS_CLOSURE(initializer), arg_count);
+      if (table_get(&class->methods, vm->init_string, &initializer))
+        return call(vm, AS_CLOSURE(initializer), arg_count);
       else if (arg_count != 0) {
-        runtime_error("Expected 0 arguments but got %zu.", arg_count);
+        runtime_error(vm, "Expected 0 arguments but got %zu.", arg_count);
         return false;
       }
       return true;
     }
     case OBJ_CLOSURE:
-      return call(AS_CLOSURE(callee), arg_count);
+      return call(vm, AS_CLOSURE(callee), arg_count);
     case OBJ_NATIVE: {
-      NativeFn native = AS_NATIVE(callee);
-      Value result = native(arg_count, vm.stack_top - arg_count);
-      vm.stack_top -= arg_count + 1;
-      vm_stack_push(result);
+      ObjNative *native = (ObjNative *) AS_OBJ(callee);
+      if (arg_count != native->arity) {
+        runtime_error(vm, "Expected %u arguments but got %u.", native->arity,
+            arg_count);
+        return false;
+      }
+      Value result;
+      if (!native->function(vm, vm->stack_top - arg_count, &result))
+        return false;
+      vm->stack_top -= arg_count + 1;
+      vm_stack_push(vm, result);
       return true;
     }
     default:
       break;
     }
   }
-  runtime_error("Can only call functions and classes.");
+  runtime_error(vm, "Can only call functions and classes.");
   return false;
 }
 
 static bool
-invoke_from_class(ObjClass *class, ObjString *name, uint8_t arg_count)
+invoke_from_class(VM *vm, ObjClass *class, ObjString *name, uint8_t arg_count)
 {
   Value method;
   if (!table_get(&class->methods, name, &method)) {
-    runtime_error("Undefined property '%s'.", name->chars);
+    runtime_error(vm, "Undefined property '%s'.", name->chars);
     return false;
   }
-  return call(AS_CLOSURE(method), arg_count);
+  return call(vm, AS_CLOSURE(method), arg_count);
 }
 
 static bool
-invoke(ObjString *name, uint8_t arg_count)
+invoke(VM *vm, ObjString *name, uint8_t arg_count)
 {
-  Value receiver = vm_stack_peek(arg_count);
+  Value receiver = vm_stack_peek(vm, arg_count);
   if (!IS_INSTANCE(receiver)) {
-    runtime_error("Only instances have methods.");
+    runtime_error(vm, "Only instances have methods.");
     return false;
   }
   ObjInstance *instance = AS_INSTANCE(receiver);
   Value value;
   if (table_get(&instance->fields, name, &value)) {
-    vm.stack_top[-arg_count - 1] = value;
-    return call_value(value, arg_count);
+    vm->stack_top[-arg_count - 1] = value;
+    return call_value(vm, value, arg_count);
   }
-  return invoke_from_class(instance->class, name, arg_count);
+  return invoke_from_class(vm, instance->class, name, arg_count);
 }
 
 static bool
-bind_method(ObjClass *class, ObjString *name)
+bind_method(VM *vm, ObjClass *class, ObjString *name)
 {
   Value method;
   if (!table_get(&class->methods, name, &method)) {
-    runtime_error("Undefined property '%s'.", name->chars);
+    runtime_error(vm, "Undefined property '%s'.", name->chars);
     return false;
   }
-  ObjBoundMethod *bound = new_bound_method(vm_stack_peek(0),
+  ObjBoundMethod *bound = new_bound_method(vm, vm_stack_peek(vm, 0),
       AS_CLOSURE(method));
-  vm_stack_pop();
-  vm_stack_push(OBJ_VAL(bound));
+  vm_stack_pop(vm);
+  vm_stack_push(vm, OBJ_VAL(bound));
+  return true;
+}
+
+static bool
+get_global(VM *vm, ObjString *name)
+{
+  Value value;
+  if (!table_get(&vm->globals, name, &value)) {
+    runtime_error(vm, "Undefined variable '%s'.", name->chars);
+    return false;
+  }
+  vm_stack_push(vm, value);
+  return true;
+}
+
+static bool
+set_global(VM *vm, ObjString *name)
+{
+  if (table_set(vm, &vm->globals, name, vm_stack_peek(vm, 0))) {
+    table_delete(vm, &vm->globals, name);
+    runtime_error(vm, "Undefined variable '%s'.", name->chars);
+    return false;
+  }
+  return true;
+}
+
+static bool
+get_property(VM *vm, ObjString *name)
+{
+  if (!IS_INSTANCE(vm_stack_peek(vm, 0))) {
+    runtime_error(vm, "Only instances have properties.");
+    return false;
+  }
+  ObjInstance *instance = AS_INSTANCE(vm_stack_peek(vm, 0));
+  Value value;
+  if (table_get(&instance->fields, name, &value)) {
+    vm->stack_top[-1] = value;
+    return true;
+  }
+  return bind_method(vm, instance->class, name);
+}
+
+static bool
+set_property(VM *vm, ObjString *name)
+{
+  if (!IS_INSTANCE(vm_stack_peek(vm, 1))) {
+    runtime_error(vm, "Only instances have fields.");
+    return false;
+  }
+  ObjInstance *instance = AS_INSTANCE(vm_stack_peek(vm, 1));
+  table_set(vm, &instance->fields, name, vm_stack_peek(vm, 0));
+  Value value = vm_stack_pop(vm);
+  vm->stack_top[-1] = value;
   return true;
 }
 
 static ObjUpvalue *
-capture_upvalue(Value *local)
+capture_upvalue(VM *vm, Value *local)
 {
   ObjUpvalue *prev_upvalue = NULL;
-  ObjUpvalue *upvalue = vm.open_upvalues;
+  ObjUpvalue *upvalue = vm->open_upvalues;
   while (upvalue != NULL && upvalue->location > local) {
     prev_upvalue = upvalue;
     upvalue = upvalue->next;
   }
   if (upvalue != NULL && upvalue->location == local)
     return upvalue;
-  ObjUpvalue *created_upvalue = new_upvalue(local);
+  ObjUpvalue *created_upvalue = new_upvalue(vm, local);
   created_upvalue->next = upvalue;
   if (prev_upvalue == NULL)
-    vm.open_upvalues = created_upvalue;
+    vm->open_upvalues = created_upvalue;
   else
     prev_upvalue->next = created_upvalue;
   return created_upvalue;
 }
 
 static void
-close_upvalues(Value *last)
+close_upvalues(VM *vm, Value *last)
 {
-  while (vm.open_upvalues != NULL && vm.open_upvalues->location >= last) {
-    ObjUpvalue *upvalue = vm.open_upvalues;
+  while (vm->open_upvalues != NULL && vm->open_upvalues->location >= last) {
+    ObjUpvalue *upvalue = vm->open_upvalues;
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
-    vm.open_upvalues = upvalue->next;
+    vm->open_upvalues = upvalue->next;
   }
 }
 
+// Makes a closure of the function and captures its upvalues, which follow
+// the instruction as pairs of bytes.
 static void
-define_method(ObjString *name)
+make_closure(VM *vm, CallFrame *frame, ObjFunction *function)
+{
+  ObjClosure *closure = new_closure(vm, function);
+  vm_stack_push(vm, OBJ_VAL(closure));
+  for (int i = 0; i < closure->upvalue_count; ++i) {
+    uint8_t is_local = *frame->ip++;
+    uint8_t index = *frame->ip++;
+    if (is_local)
+      closure->upvalues[i] = capture_upvalue(vm, frame->slots + index);
+    else
+      closure->upvalues[i] = frame->closure->upvalues[index];
+  }
+}
+
+static void
+define_method(VM *vm, ObjString *name)
+{
+  Value method = vm_stack_peek(vm, 0);
+  ObjClass *class = AS_CLASS(vm_stack_peek(vm, 1));
+  table_set(vm, &class->methods, name, method);
+  vm_stack_pop(vm);
+}
+
+// Checks that the value is a whole number below the array's length. The
+// range is checked first, so that the conversion to int is always defined.
+static bool
+array_index(VM *vm, int length, Value value, int *index)
 {
-  Value method = vm_stack_peek(0);
-  ObjClass *class = AS_CLASS(vm_stack_peek(1));
-  table_set(&class->methods, name, method);
-  vm_stack_pop();
+  if (!IS_NUMBER(value)) {
+    runtime_error(vm, "Array index must be a number.");
+    return false;
+  }
+  double number = AS_NUMBER(value);
+  if (!(number >= 0 && number < length)) {
+    runtime_error(vm, "Array index %g out of bounds for length %d.", number,
+        length);
+    return false;
+  }
+  *index = (int) number;
+  if (*index != number) {
+    runtime_error(vm, "Array index must be a whole number.");
+    return false;
+  }
+  return true;
 }
 
 static bool
@@ -252,44 +798,78 @@ is_falsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+static ObjString *
+concatenate_flat(VM *vm, ObjString *a, ObjString *b)
+{
+  ObjString *result = allocate_string(vm, a->length + b->length);
+  memcpy(result->chars, string_chars(vm, a), a->length);
+  memcpy(result->chars + a->length, string_chars(vm, b), b->length);
+  return result;
+}
+
+// Short results are copied. Longer ones become ropes, so that building a
+// string in a loop does not copy everything built so far on every step. When
+// a short string is appended to a rope ending in a short string, the two are
+// merged into a new leaf to keep the rope from growing a node per append.
 static void
-concatenate()
+concatenate(VM *vm)
 {
-  ObjString *b = AS_STRING(vm_stack_peek(0));
-  ObjString *a = AS_STRING(vm_stack_peek(1));
-  int length = a->length + b->length;
-  char *chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
-  ObjString *result = take_string(chars, length);
-  vm_stack_pop();
-  vm_stack_pop();
-  vm_stack_push(OBJ_VAL(result));
+  ObjString *b = AS_STRING(vm_stack_peek(vm, 0));
+  ObjString *a = AS_STRING(vm_stack_peek(vm, 1));
+  ObjString *result;
+  if (a->length + b->length < ROPE_MIN_LENGTH)
+    result = concatenate_flat(vm, a, b);
+  else if (a->kind == STRING_ROPE && ((ObjRope *) a)->right != NULL
+      && ((ObjRope *) a)->right->kind != STRING_ROPE
+      && b->kind != STRING_ROPE
+      && ((ObjRope *) a)->right->length + b->length < ROPE_MIN_LENGTH) {
+    ObjRope *rope = (ObjRope *) a;
+    ObjString *leaf = concatenate_flat(vm, rope->right, b);
+    vm_stack_push(vm, OBJ_VAL(leaf));
+    result = new_rope(vm, rope->left, leaf);
+    vm_stack_pop(vm);
+  } else
+    result = new_rope(vm, a, b);
+  vm_stack_pop(vm);
+  vm_stack_pop(vm);
+  vm_stack_push(vm, OBJ_VAL(result));
 }
 
+// Runs until the frame at base returns, leaving its result on the stack.
 static InterpretResult
-run()
+run(VM *vm, int base)
 {
-  CallFrame *frame = &vm.frames[vm.frame_count - 1];
+  CallFrame *frame = &vm->frames[vm->frame_count - 1];
   #define READ_BYTE() (*frame->ip++)
   #define READ_SHORT() (frame->ip += 2, (uint16_t) ((frame->ip[-2] << 8) | frame->ip[-1]))
   #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
   #define READ_STRING() AS_STRING(READ_CONSTANT())
+  #define READ_LONG() (frame->ip += 3, (uint32_t) ((frame->ip[-3] << 16) \
+        | (frame->ip[-2] << 8) | frame->ip[-1]))
+  #define READ_CONSTANT_LONG() \
+  (frame->closure->function->chunk.constants.values[READ_LONG()])
+  #define READ_STRING_LONG() AS_STRING(READ_CONSTANT_LONG())
   #define BINARY_OP(value_type, op) \
   do { \
-    if (!IS_NUMBER(vm_stack_peek(0)) || !IS_NUMBER(vm_stack_peek(1))) { \
-      runtime_error("Operands must be numbers."); \
+    if (!IS_NUMBER(vm_stack_peek(vm, 0)) \
+        || !IS_NUMBER(vm_stack_peek(vm, 1))) { \
+      runtime_error(vm, "Operands must be numbers."); \
       return INTERPRET_RUNTIME_ERROR; \
     } \
-    double b = AS_NUMBER(vm_stack_pop()); \
-    double a = AS_NUMBER(vm_stack_pop()); \
-    vm_stack_push(value_type(a op b)); \
+    double b = AS_NUMBER(vm_stack_pop(vm)); \
+    double a = AS_NUMBER(vm_stack_pop(vm)); \
+    vm_stack_push(vm, value_type(a op b)); \
+  } while (false)
+  #define NUMBER_OP(value_type, op) \
+  do { \
+    double b = AS_NUMBER(vm_stack_pop(vm)); \
+    double a = AS_NUMBER(vm_stack_peek(vm, 0)); \
+    vm->stack_top[-1] = value_type(a op b); \
   } while (false)
   for (;;) {
     #ifdef DEBUG_TRACE_EXECUTION
     printf(" ");
-    for (Value *slot = vm.stack; slot < vm.stack_top; ++slot) {
+    for (Value *slot = vm->stack; slot < vm->stack_top; ++slot) {
       printf("[ ");
       value_print(*slot);
       printf(" ]");
@@ -302,106 +882,136 @@ run()
     switch (instruction = READ_BYTE()) {
     case OP_CONSTANT: {
       Value constant = READ_CONSTANT();
-      vm_stack_push(constant);
+      vm_stack_push(vm, constant);
       break;
     }
     case OP_NIL:
-      vm_stack_push(NIL_VAL);
+      vm_stack_push(vm, NIL_VAL);
       break;
     case OP_TRUE:
-      vm_stack_push(BOOL_VAL(true));
+      vm_stack_push(vm, BOOL_VAL(true));
       break;
     case OP_FALSE:
-      vm_stack_push(BOOL_VAL(false));
+      vm_stack_push(vm, BOOL_VAL(false));
       break;
     case OP_POP:
-      vm_stack_pop();
+      vm_stack_pop(vm);
       break;
     case OP_GET_LOCAL: {
       uint8_t slot = READ_BYTE();
-      vm_stack_push(frame->slots[slot]);
+      vm_stack_push(vm, frame->slots[slot]);
       break;
     }
     case OP_SET_LOCAL: {
       uint8_t slot = READ_BYTE();
-      frame->slots[slot] = vm_stack_peek(0);
+      frame->slots[slot] = vm_stack_peek(vm, 0);
       break;
     }
-    case OP_GET_GLOBAL: {
-      ObjString *name = READ_STRING();
-      Value value;
-      if (!table_get(&vm.globals, name, &value)) {
-        runtime_error("Undefined variable '%s'.", name->chars);
+    case OP_GET_GLOBAL:
+      if (!get_global(vm, READ_STRING()))
         return INTERPRET_RUNTIME_ERROR;
-      }
-      vm_stack_push(value);
       break;
-    }
     case OP_DEFINE_GLOBAL: {
       ObjString *name = READ_STRING();
-      table_set(&vm.globals, name, vm_stack_peek(0));
-      vm_stack_pop();
+      table_set(vm, &vm->globals, name, vm_stack_peek(vm, 0));
+      vm_stack_pop(vm);
       break;
     }
-    case OP_SET_GLOBAL: {
-      ObjString *name = READ_STRING();
-      if (table_set(&vm.globals, name, vm_stack_peek(0))) {
-        table_delete(&vm.globals, name);
-        runtime_error("Undefined variable '%s'.", name->chars);
+    case OP_SET_GLOBAL:
+      if (!set_global(vm, READ_STRING()))
         return INTERPRET_RUNTIME_ERROR;
-      }
       break;
-    }
     case OP_GET_UPVALUE: {
       uint8_t slot = READ_BYTE();
-      vm_stack_push(*frame->closure->upvalues[slot]->location);
+      vm_stack_push(vm, *frame->closure->upvalues[slot]->location);
       break;
     }
     case OP_SET_UPVALUE: {
       uint8_t slot = READ_BYTE();
-      *frame->closure->upvalues[slot]->location = vm_stack_peek(0);
+      *frame->closure->upvalues[slot]->location = vm_stack_peek(vm, 0);
       break;
     }
-    case OP_GET_PROPERTY: {
-      if (!IS_INSTANCE(vm_stack_peek(0))) {
-        runtime_error("Only instances have properties.");
+    case OP_GET_PROPERTY:
+      if (!get_property(vm, READ_STRING()))
         return INTERPRET_RUNTIME_ERROR;
-      }
-      ObjInstance *instance = AS_INSTANCE(vm_stack_peek(0));
+      break;
+    case OP_SET_PROPERTY:
+      if (!set_property(vm, READ_STRING()))
+        return INTERPRET_RUNTIME_ERROR;
+      break;
+    case OP_GET_SUPER: {
       ObjString *name = READ_STRING();
-      Value value;
-      if (table_get(&instance->fields, name, &value)) {
-        vm_stack_pop();
-        vm_stack_push(value);
-        break;
-      }
-      if (!bind_method(instance->class, name))
+      ObjClass *superclass = AS_CLASS(vm_stack_pop(vm));
+      if (!bind_method(vm, superclass, name))
         return INTERPRET_RUNTIME_ERROR;
       break;
     }
-    case OP_SET_PROPERTY: {
-      if (!IS_INSTANCE(vm_stack_peek(1))) {
-        runtime_error("Only instances have fields.");
+    case OP_INDEX_GET: {
+      Value value;
+      if (IS_ARRAY(vm_stack_peek(vm, 1))) {
+        ObjArray *array = AS_ARRAY(vm_stack_peek(vm, 1));
+        int index;
+        if (!array_index(vm, array->elements.count, vm_stack_peek(vm, 0),
+              &index))
+          return INTERPRET_RUNTIME_ERROR;
+        value = array->elements.values[index];
+      } else if (IS_FLOAT_ARRAY(vm_stack_peek(vm, 1))) {
+        ObjFloatArray *array = AS_FLOAT_ARRAY(vm_stack_peek(vm, 1));
+        int index;
+        if (!array_index(vm, array->count, vm_stack_peek(vm, 0), &index))
+          return INTERPRET_RUNTIME_ERROR;
+        value = NUMBER_VAL(array->values[index]);
+      } else if (IS_MAP(vm_stack_peek(vm, 1))) {
+        vm->stack_top[-1] = map_key(vm, vm_stack_peek(vm, 0));
+        if (!map_get(&AS_MAP(vm_stack_peek(vm, 1))->entries,
+              vm_stack_peek(vm, 0), &value))
+          value = NIL_VAL;
+      } else {
+        runtime_error(vm, "Only arrays and maps can be indexed.");
         return INTERPRET_RUNTIME_ERROR;
       }
-      ObjInstance *instance = AS_INSTANCE(vm_stack_peek(1));
-      table_set(&instance->fields, READ_STRING(), vm_stack_peek(0));
-      Value value = vm_stack_pop();
-      vm_stack_pop();
-      vm_stack_push(value);
+      vm_stack_pop(vm);
+      vm_stack_pop(vm);
+      vm_stack_push(vm, value);
       break;
     }
-    case OP_GET_SUPER: {
-      ObjString *name = READ_STRING();
-      ObjClass *superclass = AS_CLASS(vm_stack_pop());
-      if (!bind_method(superclass, name))
+    case OP_INDEX_SET: {
+      if (IS_ARRAY(vm_stack_peek(vm, 2))) {
+        ObjArray *array = AS_ARRAY(vm_stack_peek(vm, 2));
+        int index;
+        if (!array_index(vm, array->elements.count, vm_stack_peek(vm, 1),
+              &index))
+          return INTERPRET_RUNTIME_ERROR;
+        array->elements.values[index] = vm_stack_peek(vm, 0);
+      } else if (IS_FLOAT_ARRAY(vm_stack_peek(vm, 2))) {
+        ObjFloatArray *array = AS_FLOAT_ARRAY(vm_stack_peek(vm, 2));
+        int index;
+        if (!array_index(vm, array->count, vm_stack_peek(vm, 1), &index))
+          return INTERPRET_RUNTIME_ERROR;
+        if (!IS_NUMBER(vm_stack_peek(vm, 0))) {
+          runtime_error(vm, "Float array elements must be numbers.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        array->values[index] = AS_NUMBER(vm_stack_peek(vm, 0));
+      } else if (IS_MAP(vm_stack_peek(vm, 2))) {
+        vm->stack_top[-2] = map_key(vm, vm_stack_peek(vm, 1));
+        map_set(vm, &AS_MAP(vm_stack_peek(vm, 2))->entries,
+            vm_stack_peek(vm, 1), vm_stack_peek(vm, 0));
+      } else {
+        runtime_error(vm, "Only arrays and maps can be indexed.");
         return INTERPRET_RUNTIME_ERROR;
+      }
+      Value value = vm_stack_pop(vm);
+      vm_stack_pop(vm);
+      vm_stack_pop(vm);
+      vm_stack_push(vm, value);
       break;
     }
     case OP_EQUAL: {
-      Value b = vm_stack_pop();
-      Value a = vm_stack_pop();
-      vm_stack_push(BOOL_VAL(values_equal(a, b)));
+      bool equal = values_equal(vm, vm_stack_peek(vm, 1), vm_stack_peek(vm, 0));
+      vm_stack_pop(vm);
+      vm_stack_pop(vm);
+      vm_stack_push(vm, BOOL_VAL(equal));
       break;
     }
     case OP_GREATER:
@@ -411,14 +1021,15 @@ run()
       BINARY_OP(BOOL_VAL, <);
       break;
     case OP_ADD: {
-      if (IS_STRING(vm_stack_peek(0)) && IS_STRING(vm_stack_peek(1)))
-        concatenate();
-      else if (IS_NUMBER(vm_stack_peek(0)) && IS_NUMBER(vm_stack_peek(1))) {
-        double b = AS_NUMBER(vm_stack_pop());
-        double a = AS_NUMBER(vm_stack_pop());
-        vm_stack_push(NUMBER_VAL(a + b));
+      if (IS_STRING(vm_stack_peek(vm, 0)) && IS_STRING(vm_stack_peek(vm, 1)))
+        concatenate(vm);
+      else if (IS_NUMBER(vm_stack_peek(vm, 0))
+          && IS_NUMBER(vm_stack_peek(vm, 1))) {
+        double b = AS_NUMBER(vm_stack_pop(vm));
+        double a = AS_NUMBER(vm_stack_pop(vm));
+        vm_stack_push(vm, NUMBER_VAL(a + b));
       } else {
-        runtime_error("Operands must be two numbers or two strings.");
+        runtime_error(vm, "Operands must be two numbers or two strings.");
         return INTERPRET_RUNTIME_ERROR;
       }
       break;
@@ -433,18 +1044,41 @@ run()
       BINARY_OP(NUMBER_VAL, /);
       break;
     case OP_NOT:
-      vm_stack_push(BOOL_VAL(is_falsey(vm_stack_pop())));
+      vm_stack_push(vm, BOOL_VAL(is_falsey(vm_stack_pop(vm))));
       break;
     case OP_NEGATE:
-      if (!IS_NUMBER(vm_stack_peek(0))) {
-        runtime_error("Operand must be a number.");
+      if (!IS_NUMBER(vm_stack_peek(vm, 0))) {
+        runtime_error(vm, "Operand must be a number.");
         return INTERPRET_RUNTIME_ERROR;
       }
-      vm_stack_push(NUMBER_VAL(-AS_NUMBER(vm_stack_pop())));
+      vm_stack_push(vm, NUMBER_VAL(-AS_NUMBER(vm_stack_pop(vm))));
+      break;
+    // The compiler only emits these where both operands are proven numbers.
+    case OP_GREATER_NUMBER:
+      NUMBER_OP(BOOL_VAL, >);
+      break;
+    case OP_LESS_NUMBER:
+      NUMBER_OP(BOOL_VAL, <);
+      break;
+    case OP_ADD_NUMBER:
+      NUMBER_OP(NUMBER_VAL, +);
+      break;
+    case OP_SUBTRACT_NUMBER:
+      NUMBER_OP(NUMBER_VAL, -);
+      break;
+    case OP_MULTIPLY_NUMBER:
+      NUMBER_OP(NUMBER_VAL, *);
+      break;
+    case OP_DIVIDE_NUMBER:
+      NUMBER_OP(NUMBER_VAL, /);
+      break;
+    case OP_NEGATE_NUMBER:
+      vm->stack_top[-1] = NUMBER_VAL(-AS_NUMBER(vm->stack_top[-1]));
       break;
     case OP_PRINT:
-      value_print(vm_stack_pop());
+      value_print(vm_stack_peek(vm, 0));
       printf("\n");
+      vm_stack_pop(vm);
       break;
     case OP_JUMP: {
       uint16_t offset = READ_SHORT();
@@ -453,86 +1087,164 @@ run()
     }
     case OP_JUMP_IF_FALSE: {
       uint16_t offset = READ_SHORT();
-      if (is_falsey(vm_stack_peek(0)))
+      if (is_falsey(vm_stack_peek(vm, 0)))
         frame->ip += offset;
       break;
     }
     case OP_LOOP: {
       uint16_t offset = READ_SHORT();
       frame->ip -= offset;
+      if (vm->compact_requested)
+        compact_garbage(vm);
+      break;
+    }
+    case OP_LOOP_SHORT: {
+      uint8_t offset = READ_BYTE();
+      frame->ip -= offset;
+      if (vm->compact_requested)
+        compact_garbage(vm);
       break;
     }
     case OP_CALL: {
       uint8_t arg_count = READ_BYTE();
-      if (!call_value(vm_stack_peek(arg_count), arg_count))
+      if (!call_value(vm, vm_stack_peek(vm, arg_count), arg_count))
         return INTERPRET_RUNTIME_ERROR;
-      frame = &vm.frames[vm.frame_count - 1];
+      frame = &vm->frames[vm->frame_count - 1];
       break;
     }
     case OP_INVOKE: {
       ObjString *method = READ_STRING();
       uint8_t arg_count = READ_BYTE();
-      if (!invoke(method, arg_count))
+      if (!invoke(vm, method, arg_count))
         return INTERPRET_RUNTIME_ERROR;
-      frame = &vm.frames[vm.frame_count - 1];
+      frame = &vm->frames[vm->frame_count - 1];
       break;
     }
     case OP_SUPER_INVOKE: {
       ObjString *method = READ_STRING();
       uint8_t arg_count = READ_BYTE();
-      ObjClass *superclass = AS_CLASS(vm_stack_pop());
-      if (!invoke_from_class(superclass, method, arg_count))
+      ObjClass *superclass = AS_CLASS(vm_stack_pop(vm));
+      if (!invoke_from_class(vm, superclass, method, arg_count))
         return INTERPRET_RUNTIME_ERROR;
-      frame = &vm.frames[vm.frame_count - 1];
-      break;
-    }
-    case OP_CLOSURE: {
-      ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-      ObjClosure *closure = new_closure(function);
-      vm_stack_push(OBJ_VAL(closure));
-      for (int i = 0; i < closure->upvalue_count; ++i) {
-        uint8_t is_local = READ_BYTE();
-        uint8_t index = READ_BYTE();
-        if (is_local)
-          closure->upvalues[i] = capture_upvalue(frame->slots + index);
-        else
-          closure->upvalues[i] = frame->closure->upvalues[index];
-      }
+      frame = &vm->frames[vm->frame_count - 1];
       break;
     }
+    case OP_CLOSURE:
+      make_closure(vm, frame, AS_FUNCTION(READ_CONSTANT()));
+      break;
     case OP_CLOSE_UPVALUE:
-      close_upvalues(vm.stack_top - 1);
-      vm_stack_pop();
+      close_upvalues(vm, vm->stack_top - 1);
+      vm_stack_pop(vm);
       break;
     case OP_RETURN: {
-      Value result = vm_stack_pop();
-      close_upvalues(frame->slots);
-      vm.frame_count--;
-      if (vm.frame_count == 0) {
-        vm_stack_pop();
+      Value result = vm_stack_pop(vm);
+      close_upvalues(vm, frame->slots);
+      vm->frame_count--;
+      vm->stack_top = frame->slots;
+      vm_stack_push(vm, result);
+      if (vm->frame_count == base)
         return INTERPRET_OK;
-      }
-      vm.stack_top = frame->slots;
-      vm_stack_push(result);
-      frame = &vm.frames[vm.frame_count - 1];
+      frame = &vm->frames[vm->frame_count - 1];
+      if (vm->compact_requested)
+        compact_garbage(vm);
       break;
     }
     case OP_CLASS:
-      vm_stack_push(OBJ_VAL(new_class(READ_STRING())));
+      vm_stack_push(vm, OBJ_VAL(new_class(vm, READ_STRING())));
       break;
     case OP_INHERIT: {
-      Value superclass = vm_stack_peek(1);
+      Value superclass = vm_stack_peek(vm, 1);
       if (!IS_CLASS(superclass)) {
-        runtime_error("Superclass must be a class.");
+        runtime_error(vm, "Superclass must be a class.");
         return INTERPRET_RUNTIME_ERROR;
       }
-      ObjClass *subclass = AS_CLASS(vm_stack_peek(0));
-      table_add_all(&AS_CLASS(superclass)->methods, &subclass->methods);
-      vm_stack_pop();
+      ObjClass *subclass = AS_CLASS(vm_stack_peek(vm, 0));
+      table_add_all(vm, &AS_CLASS(superclass)->methods, &subclass->methods);
+      vm_stack_pop(vm);
       break;
     }
     case OP_METHOD:
-      define_method(READ_STRING());
+      define_method(vm, READ_STRING());
+      break;
+    case OP_ARRAY: {
+      // The elements stay on the stack, and so reachable, until copied.
+      uint8_t count = READ_BYTE();
+      ObjArray *array = new_array(vm);
+      vm_stack_push(vm, OBJ_VAL(array));
+      for (int i = count; i > 0; --i)
+        value_array_write(vm, &array->elements, vm_stack_peek(vm, i));
+      vm->stack_top -= count + 1;
+      vm_stack_push(vm, OBJ_VAL(array));
+      break;
+    }
+    case OP_MAP: {
+      uint8_t count = READ_BYTE();
+      ObjMap *map = new_map(vm);
+      vm_stack_push(vm, OBJ_VAL(map));
+      for (int i = 2 * count; i > 0; i -= 2) {
+        Value *entry = vm->stack_top - 1 - i;
+        entry[0] = map_key(vm, entry[0]);
+        map_set(vm, &map->entries, entry[0], entry[1]);
+      }
+      vm->stack_top -= 2 * count + 1;
+      vm_stack_push(vm, OBJ_VAL(map));
+      break;
+    }
+    case OP_CONSTANT_LONG:
+      vm_stack_push(vm, READ_CONSTANT_LONG());
+      break;
+    case OP_GET_GLOBAL_LONG:
+      if (!get_global(vm, READ_STRING_LONG()))
+        return INTERPRET_RUNTIME_ERROR;
+      break;
+    case OP_DEFINE_GLOBAL_LONG:
+      table_set(vm, &vm->globals, READ_STRING_LONG(), vm_stack_peek(vm, 0));
+      vm_stack_pop(vm);
+      break;
+    case OP_SET_GLOBAL_LONG:
+      if (!set_global(vm, READ_STRING_LONG()))
+        return INTERPRET_RUNTIME_ERROR;
+      break;
+    case OP_GET_PROPERTY_LONG:
+      if (!get_property(vm, READ_STRING_LONG()))
+        return INTERPRET_RUNTIME_ERROR;
+      break;
+    case OP_SET_PROPERTY_LONG:
+      if (!set_property(vm, READ_STRING_LONG()))
+        return INTERPRET_RUNTIME_ERROR;
+      break;
+    case OP_GET_SUPER_LONG: {
+      ObjString *name = READ_STRING_LONG();
+      ObjClass *superclass = AS_CLASS(vm_stack_pop(vm));
+      if (!bind_method(vm, superclass, name))
+        return INTERPRET_RUNTIME_ERROR;
+      break;
+    }
+    case OP_INVOKE_LONG: {
+      ObjString *method = READ_STRING_LONG();
+      uint8_t arg_count = READ_BYTE();
+      if (!invoke(vm, method, arg_count))
+        return INTERPRET_RUNTIME_ERROR;
+      frame = &vm->frames[vm->frame_count - 1];
+      break;
+    }
+    case OP_SUPER_INVOKE_LONG: {
+      ObjString *method = READ_STRING_LONG();
+      uint8_t arg_count = READ_BYTE();
+      ObjClass *superclass = AS_CLASS(vm_stack_pop(vm));
+      if (!invoke_from_class(vm, superclass, method, arg_count))
+        return INTERPRET_RUNTIME_ERROR;
+      frame = &vm->frames[vm->frame_count - 1];
+      break;
+    }
+    case OP_CLOSURE_LONG:
+      make_closure(vm, frame, AS_FUNCTION(READ_CONSTANT_LONG()));
+      break;
+    case OP_CLASS_LONG:
+      vm_stack_push(vm, OBJ_VAL(new_class(vm, READ_STRING_LONG())));
+      break;
+    case OP_METHOD_LONG:
+      define_method(vm, READ_STRING_LONG());
       break;
     }
   }
@@ -540,19 +1252,124 @@ run()
   #undef READ_SHORT
   #undef READ_CONSTANT
   #undef READ_STRING
+  #undef READ_LONG
+  #undef READ_CONSTANT_LONG
+  #undef READ_STRING_LONG
   #undef BINARY_OP
+  #undef NUMBER_OP
 }
 
 InterpretResult
-vm_interpret(const char *source)
+vm_interpret(VM *vm, const char *source)
 {
-  ObjFunction *function = compile(source);
+  ObjFunction *function = compile(vm, source, strlen(source));
   if (function == NULL)
     return INTERPRET_COMPILE_ERROR;
-  vm_stack_push(OBJ_VAL(function));
-  ObjClosure *closure = new_closure(function);
-  vm_stack_pop();
-  vm_stack_push(OBJ_VAL(closure));
-  call(closure, 0);
-  return run();
+  return vm_interpret_function(vm, function);
+}
+
+// Calls the callee below the arguments on the stack and runs it to the end,
+// which replaces them with its result.
+static InterpretResult
+call_and_run(VM *vm, int arg_count)
+{
+  int base = vm->frame_count;
+  if (!call_value(vm, vm_stack_peek(vm, arg_count), (uint8_t) arg_count))
+    return INTERPRET_RUNTIME_ERROR;
+  if (vm->frame_count == base)
+    return INTERPRET_OK;
+  return run(vm, base);
+}
+
+// Runs a compiled script, such as one loaded from the bytecode cache.
+InterpretResult
+vm_interpret_function(VM *vm, ObjFunction *function)
+{
+  vm_stack_push(vm, OBJ_VAL(function));
+  ObjClosure *closure = new_closure(vm, function);
+  vm_stack_pop(vm);
+  vm_stack_push(vm, OBJ_VAL(closure));
+  InterpretResult result = call_and_run(vm, 0);
+  if (result == INTERPRET_OK)
+    vm_stack_pop(vm);
+  return result;
+}
+
+// A released handle holds the number of the next released one, or -1.
+int
+vm_hold(VM *vm, Value value)
+{
+  if (vm->free_handle != -1) {
+    int handle = vm->free_handle;
+    vm->free_handle = (int) AS_NUMBER(vm->handles.values[handle]);
+    vm->handles.values[handle] = value;
+    return handle;
+  }
+  vm_stack_push(vm, value);
+  value_array_write(vm, &vm->handles, value);
+  vm_stack_pop(vm);
+  return vm->handles.count - 1;
+}
+
+Value
+vm_held(VM *vm, int handle)
+{
+  return vm->handles.values[handle];
+}
+
+void
+vm_release(VM *vm, int handle)
+{
+  vm->handles.values[handle] = NUMBER_VAL(vm->free_handle);
+  vm->free_handle = handle;
+}
+
+int
+vm_compile(VM *vm, const char *source, size_t length)
+{
+  ObjFunction *function = compile(vm, source, length);
+  if (function == NULL)
+    return -1;
+  vm_stack_push(vm, OBJ_VAL(function));
+  ObjClosure *closure = new_closure(vm, function);
+  vm_stack_pop(vm);
+  return vm_hold(vm, OBJ_VAL(closure));
+}
+
+InterpretResult
+vm_run(VM *vm, int script)
+{
+  vm_stack_push(vm, vm_held(vm, script));
+  InterpretResult result = call_and_run(vm, 0);
+  if (result == INTERPRET_OK)
+    vm_stack_pop(vm);
+  return result;
+}
+
+int
+vm_find_global(VM *vm, const char *name)
+{
+  int length = (int) strlen(name);
+  ObjString *key = table_find_string(&vm->strings, name, length,
+      hash_string(name, length));
+  Value value;
+  if (key == NULL || !table_get(&vm->globals, key, &value))
+    return -1;
+  return vm_hold(vm, value);
+}
+
+InterpretResult
+vm_call(VM *vm, int callee, const Value *args, int arg_count, Value *result)
+{
+  if (arg_count > UINT8_MAX) {
+    runtime_error(vm, "Can't have more than 255 arguments.");
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  vm_stack_push(vm, vm_held(vm, callee));
+  for (int i = 0; i < arg_count; ++i)
+    vm_stack_push(vm, args[i]);
+  InterpretResult status = call_and_run(vm, arg_count);
+  if (status == INTERPRET_OK)
+    *result = vm_stack_pop(vm);
+  return status;
 }
@@ -2,6 +2,7 @@
 #define CLOX_VM_H
 
 #include "chunk.h"
+#include "heap.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
@@ -15,22 +16,33 @@ typedef struct {
   Value *slots;
 } CallFrame;
 
-typedef struct {
+struct VM {
   CallFrame frames[FRAMES_MAX];
   int frame_count;
   Value stack[STACK_MAX];
   Value *stack_top;
   Table globals;
   Table strings;
+  ValueArray handles;
+  int free_handle;
   ObjString *init_string;
   ObjUpvalue *open_upvalues;
   size_t bytes_allocated;
+  size_t bytes_marked;
+  // Garbage stays in bytes_allocated until the lazy sweep frees it, so the
+  // next collection is due once the marked bytes plus the bytes allocated
+  // since the last collection exceed next_gc.
+  size_t bytes_since_gc;
   size_t next_gc;
-  Obj *objects;
+  Heap heap;
+  bool compact_requested;
+  bool lazy_compile;
+  // The compilation in progress, if any.
+  struct Parser *parser;
   int gray_count;
   int gray_capacity;
   Obj **gray_stack;
-} VM;
+};
 
 typedef enum {
   INTERPRET_OK,
@@ -38,21 +50,61 @@ typedef enum {
   INTERPRET_RUNTIME_ERROR,
 } InterpretResult;
 
-extern VM vm;
+// The VM is too large for most stacks, so it is usually allocated. Objects
+// and handles belong to the VM that made them and must not be passed to
+// another one. Threads may each run their own VM once floats_init has run.
+void
+vm_init(VM *vm);
+
+InterpretResult
+vm_interpret(VM *vm, const char *source);
+
+InterpretResult
+vm_interpret_function(VM *vm, ObjFunction *function);
+
+// Embedding. A script is compiled once into a handle and can then be run any
+// number of times, and the functions it defines called from C without
+// parsing anything again. Values kept through handles are roots and follow
+// their objects when the collector moves them. Plain values do not, so an
+// object in a result or argument must be held before the VM runs or
+// allocates again. Every call returns what vm_interpret would.
+int
+vm_hold(VM *vm, Value value);
+
+Value
+vm_held(VM *vm, int handle);
 
 void
-vm_init();
+vm_release(VM *vm, int handle);
+
+// Returns a handle to the compiled script, or -1 on a compile error.
+int
+vm_compile(VM *vm, const char *source, size_t length);
 
 InterpretResult
-vm_interpret(const char *source);
+vm_run(VM *vm, int script);
+
+// Returns a handle to the current value of the global, or -1 if it is not
+// defined.
+int
+vm_find_global(VM *vm, const char *name);
+
+InterpretResult
+vm_call(VM *vm, int callee, const Value *args, int arg_count, Value *result);
+
+const char *
+vm_native_name(NativeFn function);
+
+ObjNative *
+vm_native_new(VM *vm, const char *name, int length);
 
 void
-vm_stack_push(Value value);
+vm_stack_push(VM *vm, Value value);
 
 Value
-vm_stack_pop();
+vm_stack_pop(VM *vm);
 
 void
-vm_free();
+vm_free(VM *vm);
 
 #endif